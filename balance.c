@@ -1,189 +1,1000 @@
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <poll.h>
-#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <threads.h>
 #include <unistd.h>
 #include <linux/btrfs.h>
-#include <sys/eventfd.h>
+#include <linux/btrfs_tree.h>
 #include <sys/ioctl.h>
-#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "ops.h"
+#include "state.h"
+#include "telemetry.h"
+#include "util.h"
 
-static const int PROGRESS_INTERVAL = 5000;
+static const unsigned int PROGRESS_INTERVAL = 5000;
 
+// The usage below which a blanket usage filter would relocate chunks. Unless
+// told otherwise, the plan aims to free as much space as that would.
 static const unsigned int DATA_USAGE_THRESHOLD = 30;
 static const unsigned int METADATA_USAGE_THRESHOLD = 10;
 static const unsigned int SYSTEM_USAGE_THRESHOLD = METADATA_USAGE_THRESHOLD;
 
-struct thread_info {
+// The upper usage bounds, in percent, of the passes into which a plan is
+// split, emptiest first. The first pass takes only empty chunks, which cost
+// nothing to relocate; the narrow bands at the bottom keep the chunks chosen
+// by each pass’s limit close to those in the plan.
+static const unsigned int STAGES[] = { 0, 5, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100 };
+#define STAGE_COUNT (sizeof(STAGES) / sizeof(*STAGES))
+
+// With a budget, how many seconds’ worth of chunks each round relocates,
+// judging by the rate of earlier rounds, so that the budget is checked often
+// enough.
+static const uint64_t ROUND_SECONDS = 60;
+
+// How many runs’ throughput to remember in the state file.
+#define HISTORY_RUNS 16
+
+static const uint64_t MIB = 1024 * 1024;
+static const uint64_t NANOSECONDS_PER_SECOND = 1000000000;
+
+struct chunk {
+	uint64_t length;
+	uint64_t used;
+
+	// The device space the chunk takes, which depends on its profile.
+	uint64_t physical;
+};
+
+// The chunks of one type and profile, sorted emptiest first. The plan
+// relocates the first planned of them.
+struct chunk_group {
+	uint64_t flags;
+	struct chunk *chunks;
+	size_t count, capacity;
+	uint64_t length, used, physical;
+
+	// The planned chunks, the device space they take, the data in them, and
+	// the free space left in the rest of the group.
+	size_t planned;
+	uint64_t freed, moved, room;
+};
+
+struct layout {
+	const char *mountpoint;
+	int fd;
+	bool ok;
+	struct chunk_group *groups;
+	size_t count;
+
+	// The tree holding block group items: the extent tree, or the block group
+	// tree on filesystems that have one.
+	uint64_t block_group_tree;
+
+	// The logical address just past the last chunk. Chunks allocated during
+	// the balance come after it, so limiting passes to the addresses below it
+	// keeps a pass from relocating the chunks an earlier one filled.
+	uint64_t end;
+};
+
+// A balance pass, relocating at most limit chunks of one type and profile
+// whose usage falls within a range, expected to move the given number of
+// bytes.
+struct pass {
+	uint64_t flags;
+	unsigned int usage_min, usage_max;
+	size_t limit;
+	uint64_t moved;
+};
+
+struct balance {
+	const char *mountpoint;
+	bool verbose;
+	const struct balance_options *options;
 	int fd;
-	int efd;
+	bool ok;
+	struct runner *runner;
 	struct btrfs_ioctl_balance_args args;
-	int ioctl_ret;
-	int ioctl_errno;
+	struct runner_task task;
+	uint64_t completed, considered;
+	bool progress_shown;
+
+	// The passes, the address just past the last chunk when they were
+	// planned, and the chunks of the current pass still to relocate.
+	struct pass *passes;
+	size_t pass_count, next_pass;
+	uint64_t end;
+	size_t pass_left;
+
+	// When the budget started running, and whether a paused balance is being
+	// resumed, the budget has run out between rounds, or a round was paused
+	// when it ran out.
+	uint64_t start_ns;
+	bool resuming, out_of_budget, paused;
+
+	// The limit and start time of the current round, and the chunks relocated,
+	// time taken, and estimated bytes moved by all rounds so far.
+	size_t round_limit;
+	uint64_t round_start_ns;
+	uint64_t round_chunks, round_ns, moved;
+
+	// The chunks in the plan, less those of passes that found fewer chunks
+	// than planned, and samples of progress across all rounds.
+	uint64_t plan_chunks;
+	struct telemetry telemetry;
 };
 
-static int thread_proc(void *raw_ti) {
-	struct thread_info *ti = raw_ti;
-	ti->ioctl_ret = ioctl(ti->fd, BTRFS_IOC_BALANCE_V2, &ti->args);
-	ti->ioctl_errno = errno;
-	if(eventfd_write(ti->efd, 1) < 0) {
-		perror("eventfd_write");
-		abort();
-	}
-	return 0;
-}
-
-static bool do_balance_fd_auxfds(const char *mountpoint, bool verbose, int fd, int sigfd, int efd) {
-	// Start a thread to do the balance.
-	struct thread_info ti = {
-		.fd = fd,
-		.efd = efd,
-		.args = {
-			.flags = BTRFS_BALANCE_DATA | BTRFS_BALANCE_METADATA | BTRFS_BALANCE_SYSTEM,
-			.data = { .flags = BTRFS_BALANCE_ARGS_USAGE, .usage = DATA_USAGE_THRESHOLD, },
-			.meta = { .flags = BTRFS_BALANCE_ARGS_USAGE, .usage = METADATA_USAGE_THRESHOLD, },
-			.sys = { .flags = BTRFS_BALANCE_ARGS_USAGE, .usage = SYSTEM_USAGE_THRESHOLD, },
-		},
-	};
-	thrd_t thread;
-	switch(thrd_create(&thread, &thread_proc, &ti)) {
-		case thrd_success:
-			break;
+static const char *type_name(uint64_t flags) {
+	if((flags & BTRFS_BLOCK_GROUP_DATA) && (flags & BTRFS_BLOCK_GROUP_METADATA)) {
+		return "mixed";
+	} else if(flags & BTRFS_BLOCK_GROUP_DATA) {
+		return "data";
+	} else if(flags & BTRFS_BLOCK_GROUP_SYSTEM) {
+		return "system";
+	} else {
+		return "metadata";
+	}
+}
 
-		case thrd_nomem:
-			fprintf(stderr, "thrd_create: %s\n", strerror(ENOMEM));
-			return false;
+static const char *profile_name(uint64_t flags) {
+	switch(flags & BTRFS_BLOCK_GROUP_PROFILE_MASK) {
+		case BTRFS_BLOCK_GROUP_RAID0: return "RAID0";
+		case BTRFS_BLOCK_GROUP_RAID1: return "RAID1";
+		case BTRFS_BLOCK_GROUP_DUP: return "DUP";
+		case BTRFS_BLOCK_GROUP_RAID10: return "RAID10";
+		case BTRFS_BLOCK_GROUP_RAID5: return "RAID5";
+		case BTRFS_BLOCK_GROUP_RAID6: return "RAID6";
+		case BTRFS_BLOCK_GROUP_RAID1C3: return "RAID1C3";
+		case BTRFS_BLOCK_GROUP_RAID1C4: return "RAID1C4";
+		default: return "single";
+	}
+}
+
+static unsigned int usage_threshold(uint64_t flags) {
+	if(flags & BTRFS_BLOCK_GROUP_DATA) {
+		return DATA_USAGE_THRESHOLD;
+	} else if(flags & BTRFS_BLOCK_GROUP_SYSTEM) {
+		return SYSTEM_USAGE_THRESHOLD;
+	} else {
+		return METADATA_USAGE_THRESHOLD;
+	}
+}
+
+// Converts a percentage of a chunk’s length to bytes, rounding down as the
+// kernel’s usage filters do.
+static uint64_t usage_bytes(uint64_t length, unsigned int percent) {
+	return length * percent / 100;
+}
+
+static uint64_t chunk_physical(uint64_t length, uint64_t flags, uint16_t num_stripes, uint16_t sub_stripes) {
+	uint64_t data_stripes = 1;
+	if(flags & BTRFS_BLOCK_GROUP_RAID0) {
+		data_stripes = num_stripes;
+	} else if(flags & BTRFS_BLOCK_GROUP_RAID10) {
+		data_stripes = sub_stripes ? num_stripes / sub_stripes : num_stripes;
+	} else if(flags & BTRFS_BLOCK_GROUP_RAID5) {
+		data_stripes = num_stripes - 1;
+	} else if(flags & BTRFS_BLOCK_GROUP_RAID6) {
+		data_stripes = num_stripes - 2;
+	}
+	if(!data_stripes || data_stripes > num_stripes) {
+		data_stripes = 1;
+	}
+	return length / data_stripes * num_stripes;
+}
 
-		case thrd_error:
-			fputs("thrd_create: failed\n", stderr);
+struct block_group_lookup {
+	uint64_t start, length, used;
+	bool found;
+};
+
+static bool read_block_group(const struct btrfs_ioctl_search_header *header, const void *data, void *raw_lookup) {
+	struct block_group_lookup *lookup = raw_lookup;
+	if(header->type == BTRFS_BLOCK_GROUP_ITEM_KEY && header->objectid == lookup->start && header->offset == lookup->length && header->len >= sizeof(struct btrfs_block_group_item)) {
+		struct btrfs_block_group_item item;
+		memcpy(&item, data, sizeof(item));
+		lookup->used = le64toh(item.used);
+		lookup->found = true;
+	}
+	return !lookup->found;
+}
+
+// Finds how many bytes of a chunk are in use, from the block group item
+// covering it.
+static bool block_group_used(struct layout *layout, uint64_t start, uint64_t length, uint64_t *used) {
+	struct block_group_lookup lookup = { .start = start, .length = length, .used = 0, .found = false };
+	for(unsigned int attempt = 0; attempt != 2 && !lookup.found; ++attempt) {
+		if(attempt) {
+			layout->block_group_tree = layout->block_group_tree == BTRFS_EXTENT_TREE_OBJECTID ? BTRFS_BLOCK_GROUP_TREE_OBJECTID : BTRFS_EXTENT_TREE_OBJECTID;
+		}
+		const struct btrfs_ioctl_search_key key = {
+			.tree_id = layout->block_group_tree,
+			.min_objectid = start,
+			.max_objectid = start,
+			.min_type = BTRFS_BLOCK_GROUP_ITEM_KEY,
+			.max_type = BTRFS_BLOCK_GROUP_ITEM_KEY,
+			.min_offset = length,
+			.max_offset = length,
+			.min_transid = 0,
+			.max_transid = UINT64_MAX,
+		};
+		if(!for_each_tree_item(layout->mountpoint, layout->fd, &key, &read_block_group, &lookup)) {
 			return false;
+		}
+	}
+	if(!lookup.found) {
+		fprintf(stderr, "%s: no block group found for chunk at %" PRIu64 "\n", layout->mountpoint, start);
+		return false;
+	}
+	*used = lookup.used;
+	return true;
+}
 
-		default:
-			fputs("thrd_create: unknown error\n", stderr);
+static struct chunk_group *find_group(struct layout *layout, uint64_t flags) {
+	for(size_t i = 0; i != layout->count; ++i) {
+		if(layout->groups[i].flags == flags) {
+			return &layout->groups[i];
+		}
+	}
+	struct chunk_group *new_groups = realloc(layout->groups, (layout->count + 1) * sizeof(*new_groups));
+	if(!new_groups) {
+		perror("realloc");
+		return 0;
+	}
+	layout->groups = new_groups;
+	struct chunk_group *group = &layout->groups[layout->count++];
+	memset(group, 0, sizeof(*group));
+	group->flags = flags;
+	return group;
+}
+
+static bool add_chunk(const struct btrfs_ioctl_search_header *header, const void *data, void *raw_layout) {
+	struct layout *layout = raw_layout;
+	if(header->type != BTRFS_CHUNK_ITEM_KEY || header->len < sizeof(struct btrfs_chunk)) {
+		return true;
+	}
+	struct btrfs_chunk item;
+	memcpy(&item, data, sizeof(item));
+	if(!item.length) {
+		return true;
+	}
+	uint64_t flags = le64toh(item.type) & (BTRFS_BLOCK_GROUP_TYPE_MASK | BTRFS_BLOCK_GROUP_PROFILE_MASK);
+	struct chunk chunk = { .length = le64toh(item.length) };
+	chunk.physical = chunk_physical(chunk.length, flags, le16toh(item.num_stripes), le16toh(item.sub_stripes));
+	if(!block_group_used(layout, header->offset, chunk.length, &chunk.used)) {
+		layout->ok = false;
+		return false;
+	}
+	if(header->offset + chunk.length > layout->end) {
+		layout->end = header->offset + chunk.length;
+	}
+
+	struct chunk_group *group = find_group(layout, flags);
+	if(!group) {
+		layout->ok = false;
+		return false;
+	}
+	if(group->count == group->capacity) {
+		size_t new_capacity = group->capacity ? group->capacity * 2 : 16;
+		struct chunk *new_chunks = realloc(group->chunks, new_capacity * sizeof(*new_chunks));
+		if(!new_chunks) {
+			perror("realloc");
+			layout->ok = false;
 			return false;
+		}
+		group->chunks = new_chunks;
+		group->capacity = new_capacity;
 	}
+	group->chunks[group->count++] = chunk;
+	group->length += chunk.length;
+	group->used += chunk.used;
+	group->physical += chunk.physical;
+	return true;
+}
 
-	// Monitor.
-	bool done = false;
-	while(!done) {
-		struct pollfd pfds[] = {
-			{ .fd = sigfd, .events = POLLIN, .revents = 0 },
-			{ .fd = efd, .events = POLLIN, .revents = 0 },
-		};
-		if(poll(pfds, sizeof(pfds) / sizeof(*pfds), verbose ? PROGRESS_INTERVAL : -1) < 0) {
-			perror("poll");
-			break;
+static int compare_chunks(const void *x, const void *y) {
+	const struct chunk *a = x, *b = y;
+	double ua = (double) a->used / (double) a->length;
+	double ub = (double) b->used / (double) b->length;
+	return ua < ub ? -1 : ua > ub ? 1 : 0;
+}
+
+static void free_layout(struct layout *layout) {
+	for(size_t i = 0; i != layout->count; ++i) {
+		free(layout->groups[i].chunks);
+	}
+	free(layout->groups);
+}
+
+// Reads every chunk in the chunk tree and how full it is.
+static bool read_layout(struct layout *layout) {
+	const struct btrfs_ioctl_search_key key = {
+		.tree_id = BTRFS_CHUNK_TREE_OBJECTID,
+		.min_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+		.max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+		.min_type = BTRFS_CHUNK_ITEM_KEY,
+		.max_type = BTRFS_CHUNK_ITEM_KEY,
+		.min_offset = 0,
+		.max_offset = UINT64_MAX,
+		.min_transid = 0,
+		.max_transid = UINT64_MAX,
+	};
+	if(!for_each_tree_item(layout->mountpoint, layout->fd, &key, &add_chunk, layout) || !layout->ok) {
+		return false;
+	}
+	for(size_t i = 0; i != layout->count; ++i) {
+		struct chunk_group *group = &layout->groups[i];
+		qsort(group->chunks, group->count, sizeof(*group->chunks), &compare_chunks);
+	}
+	return true;
+}
+
+static void show_histogram(const struct layout *layout) {
+	for(size_t i = 0; i != layout->count; ++i) {
+		const struct chunk_group *group = &layout->groups[i];
+		size_t buckets[10] = { 0 };
+		for(size_t j = 0; j != group->count; ++j) {
+			size_t bucket = (size_t) (group->chunks[j].used * 10 / group->chunks[j].length);
+			++buckets[bucket < 10 ? bucket : 9];
+		}
+		printf("%s: %s, %s: %zu chunks, %" PRIu64 " / %" PRIu64 " MiB used, by tenths full:", layout->mountpoint, type_name(group->flags), profile_name(group->flags), group->count, group->used / MIB, group->length / MIB);
+		for(size_t j = 0; j != 10; ++j) {
+			printf(" %zu", buckets[j]);
+		}
+		putchar('\n');
+	}
+}
+
+static void unplan(struct chunk_group *group) {
+	group->planned = 0;
+	group->freed = 0;
+	group->moved = 0;
+	group->room = group->length - group->used;
+}
+
+static void plan_next(struct chunk_group *group) {
+	const struct chunk *chunk = &group->chunks[group->planned++];
+	group->freed += chunk->physical;
+	group->moved += chunk->used;
+	group->room -= chunk->length - chunk->used;
+}
+
+static void unplan_last(struct chunk_group *group) {
+	const struct chunk *chunk = &group->chunks[--group->planned];
+	group->freed -= chunk->physical;
+	group->moved -= chunk->used;
+	group->room += chunk->length - chunk->used;
+}
+
+// Estimates how much unallocated space relocating a group’s planned chunks
+// would free: the device space they take, less that of the new chunks needed
+// for whatever data moved out of them does not fit in the free space of the
+// group’s other chunks.
+static int64_t group_gain(const struct chunk_group *group) {
+	uint64_t cost = 0;
+	if(group->moved > group->room) {
+		uint64_t chunk_length = group->length / group->count;
+		uint64_t new_chunks = (group->moved - group->room + chunk_length - 1) / chunk_length;
+		cost = new_chunks * (group->physical / group->count);
+	}
+	return (int64_t) group->freed - (int64_t) cost;
+}
+
+struct plan_totals {
+	size_t chunks;
+	uint64_t moved;
+	int64_t gain;
+};
+
+static struct plan_totals plan_totals(const struct layout *layout) {
+	struct plan_totals totals = { 0, 0, 0 };
+	for(size_t i = 0; i != layout->count; ++i) {
+		totals.chunks += layout->groups[i].planned;
+		totals.moved += layout->groups[i].moved;
+		totals.gain += group_gain(&layout->groups[i]);
+	}
+	return totals;
+}
+
+// Plans what a blanket usage filter would relocate.
+static void plan_blanket(struct layout *layout) {
+	for(size_t i = 0; i != layout->count; ++i) {
+		struct chunk_group *group = &layout->groups[i];
+		unsigned int threshold = usage_threshold(group->flags);
+		unplan(group);
+		while(group->planned != group->count && group->chunks[group->planned].used < usage_bytes(group->chunks[group->planned].length, threshold)) {
+			plan_next(group);
 		}
-		if(pfds[0].revents & POLLIN) {
-			// A signal was received. Get out.
+	}
+}
+
+// Plans the fewest relocations expected to free at least target bytes of
+// unallocated space, or as much as possible if that is out of reach. Chunks
+// are taken emptiest first across all groups, since those free the most space
+// for the least data moved.
+static void plan_target(struct layout *layout, int64_t target) {
+	size_t *best = calloc(layout->count, sizeof(*best));
+	if(!best) {
+		perror("calloc");
+		layout->ok = false;
+		return;
+	}
+	for(size_t i = 0; i != layout->count; ++i) {
+		unplan(&layout->groups[i]);
+	}
+	int64_t gain = 0, best_gain = 0;
+	while(gain < target) {
+		struct chunk_group *next = 0;
+		double next_usage = 1.0;
+		for(size_t i = 0; i != layout->count; ++i) {
+			struct chunk_group *group = &layout->groups[i];
+			if(group->planned != group->count) {
+				const struct chunk *chunk = &group->chunks[group->planned];
+				double usage = (double) chunk->used / (double) chunk->length;
+				if(usage < next_usage) {
+					next = group;
+					next_usage = usage;
+				}
+			}
+		}
+		if(!next) {
 			break;
 		}
-		if(pfds[1].revents & POLLIN) {
-			// The thread notified us of completion.
-			done = true;
+		gain -= group_gain(next);
+		plan_next(next);
+		gain += group_gain(next);
+		if(gain > best_gain) {
+			best_gain = gain;
+			for(size_t i = 0; i != layout->count; ++i) {
+				best[i] = layout->groups[i].planned;
+			}
 		}
-		if(verbose) {
-			struct btrfs_ioctl_balance_args args;
-			if(ioctl(fd, BTRFS_IOC_BALANCE_PROGRESS, &args) >= 0) {
-				unsigned int permille;
-				if(!args.stat.expected) {
-					permille = 0;
-				} else {
-					permille = args.stat.completed * 1000 / args.stat.expected;
+	}
+	for(size_t i = 0; i != layout->count; ++i) {
+		struct chunk_group *group = &layout->groups[i];
+		unplan(group);
+		while(group->planned != best[i]) {
+			plan_next(group);
+		}
+	}
+	free(best);
+
+	// Taking chunks in order of usage can pick up some, such as a small
+	// system chunk, that turn out not to be needed to reach the target, or
+	// that free nothing, so drop whatever can be dropped, the fullest first.
+	int64_t goal = best_gain < target ? best_gain : target;
+	for(;;) {
+		struct chunk_group *drop = 0;
+		for(size_t i = 0; i != layout->count; ++i) {
+			struct chunk_group *group = &layout->groups[i];
+			if(group->planned) {
+				struct chunk_group trial = *group;
+				unplan_last(&trial);
+				if(best_gain - group_gain(group) + group_gain(&trial) >= goal && (!drop || group->chunks[group->planned - 1].used > drop->chunks[drop->planned - 1].used)) {
+					drop = group;
 				}
-				printf("%" PRIu64 " / %" PRIu64 " expected = %u.%u%% (%" PRIu64 " considered)\r", (uint64_t) args.stat.completed, (uint64_t) args.stat.expected, permille / 10, permille % 10, (uint64_t) args.stat.considered);
-				fflush(stdout);
 			}
 		}
+		if(!drop) {
+			break;
+		}
+		best_gain -= group_gain(drop);
+		unplan_last(drop);
+		best_gain += group_gain(drop);
 	}
+}
 
-	// If the balance didn’t finish normally, cancel it.
-	if(!done) {
-		ioctl(fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_CANCEL);
+// Splits the plan into passes by usage band, each limited to the number of
+// planned chunks in its band.
+static bool plan_passes(const struct layout *layout, struct balance *balance) {
+	balance->passes = malloc(layout->count * STAGE_COUNT * sizeof(*balance->passes));
+	if(!balance->passes) {
+		perror("malloc");
+		return false;
 	}
+	balance->pass_count = 0;
+	for(size_t i = 0; i != layout->count; ++i) {
+		const struct chunk_group *group = &layout->groups[i];
+		size_t j = 0;
+		for(size_t stage = 0; stage != STAGE_COUNT && j != group->planned; ++stage) {
+			size_t first = j;
+			uint64_t moved = 0;
+			while(j != group->planned && group->chunks[j].used < (STAGES[stage] ? usage_bytes(group->chunks[j].length, STAGES[stage]) : 1)) {
+				moved += group->chunks[j].used;
+				++j;
+			}
+			if(j != first) {
+				struct pass *pass = &balance->passes[balance->pass_count++];
+				pass->flags = group->flags;
+				pass->usage_min = stage ? STAGES[stage - 1] : 0;
+				pass->usage_max = STAGES[stage];
+				pass->limit = j - first;
+				pass->moved = moved;
+			}
+		}
+	}
+	return true;
+}
 
-	// If we were displaying progress, print an empty line to avoid terminal
-	// corruption.
-	if(verbose) {
+struct allocation {
+	// The lowest share of any device not yet allocated to chunks, in percent.
+	double unallocated;
+
+	// The space allocated to chunks and how much of it is used, not counting
+	// the global reserve.
+	uint64_t allocated, used;
+};
+
+static bool add_device_allocation(const struct btrfs_ioctl_fs_info_args *fs_info, const struct btrfs_ioctl_dev_info_args *dev_info, void *raw_allocation) {
+	(void) fs_info;
+	struct allocation *allocation = raw_allocation;
+	if(dev_info->total_bytes) {
+		uint64_t unallocated = dev_info->total_bytes > dev_info->bytes_used ? dev_info->total_bytes - dev_info->bytes_used : 0;
+		double percent = (double) unallocated * 100.0 / (double) dev_info->total_bytes;
+		if(percent < allocation->unallocated) {
+			allocation->unallocated = percent;
+		}
+	}
+	return true;
+}
+
+// Finds how much of each device is unallocated, and how much of the space
+// allocated to chunks is unused, which are cheap to ask for, unlike how full
+// each chunk is.
+static bool read_allocation(const char *mountpoint, int fd, struct allocation *allocation) {
+	allocation->unallocated = 100.0;
+	allocation->allocated = 0;
+	allocation->used = 0;
+	if(!for_each_device(mountpoint, fd, &add_device_allocation, allocation)) {
+		return false;
+	}
+
+	// Ask how many space infos there are, then fetch them.
+	struct btrfs_ioctl_space_args count = { .space_slots = 0 };
+	if(ioctl(fd, BTRFS_IOC_SPACE_INFO, &count) < 0) {
+		perror(mountpoint);
+		return false;
+	}
+	struct btrfs_ioctl_space_args *args = malloc(sizeof(*args) + count.total_spaces * sizeof(*args->spaces));
+	if(!args) {
+		perror("malloc");
+		return false;
+	}
+	args->space_slots = count.total_spaces;
+	if(ioctl(fd, BTRFS_IOC_SPACE_INFO, args) < 0) {
+		perror(mountpoint);
+		free(args);
+		return false;
+	}
+	for(uint64_t i = 0; i != args->total_spaces && i != args->space_slots; ++i) {
+		if(!(args->spaces[i].flags & BTRFS_SPACE_INFO_GLOBAL_RSV)) {
+			allocation->allocated += args->spaces[i].total_bytes;
+			allocation->used += args->spaces[i].used_bytes;
+		}
+	}
+	free(args);
+	return true;
+}
+
+static int thread_proc(void *raw_balance) {
+	struct balance *balance = raw_balance;
+	return ioctl(balance->fd, BTRFS_IOC_BALANCE_V2, &balance->args);
+}
+
+static void cancel_balance(void *raw_balance) {
+	struct balance *balance = raw_balance;
+	ioctl(balance->fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_CANCEL);
+}
+
+// If we were displaying progress, print an empty line to avoid terminal
+// corruption.
+static void end_progress_line(struct balance *balance) {
+	if(balance->progress_shown) {
 		putchar('\n');
+		balance->progress_shown = false;
 	}
+}
 
-	// Join the thread and present the results.
-	if(thrd_join(thread, 0) == thrd_error) {
-		fputs("thrd_join: error\n", stderr);
-		abort();
+// Returns the average number of bytes in each chunk of the current pass, or
+// zero while resuming, for which there is nothing to go by.
+static uint64_t chunk_bytes(const struct balance *balance) {
+	if(balance->resuming || !balance->next_pass) {
+		return 0;
 	}
-	if(ti.ioctl_ret >= 0) {
-		if(verbose && !(ti.args.state & BTRFS_BALANCE_STATE_CANCEL_REQ)) {
-			printf("%s: relocated %" PRIu64" / %" PRIu64 " chunks\n", mountpoint, (uint64_t) ti.args.stat.completed, (uint64_t) ti.args.stat.considered);
+	const struct pass *pass = &balance->passes[balance->next_pass - 1];
+	return pass->moved / pass->limit;
+}
+
+static void show_progress(void *raw_balance) {
+	struct balance *balance = raw_balance;
+	struct btrfs_ioctl_balance_args args;
+	if(ioctl(balance->fd, BTRFS_IOC_BALANCE_PROGRESS, &args) >= 0) {
+		uint64_t completed = args.stat.completed;
+		telemetry_sample(&balance->telemetry, balance->completed + completed, balance->moved + completed * chunk_bytes(balance));
+
+		unsigned int permille;
+		if(!args.stat.expected) {
+			permille = 0;
+		} else {
+			permille = args.stat.completed * 1000 / args.stat.expected;
 		}
-		return true;
-	} else {
-		if(ti.ioctl_errno != ECANCELED) {
-			fprintf(stderr, "%s: balance failed: %s\n", mountpoint, strerror(ti.ioctl_errno));
-		}
-		return false;
-	}
-}
-
-static bool do_balance_fd(const char *mountpoint, bool verbose, int fd) {
-	// The balance ioctl is blocking and uninterruptible (in the traditional
-	// signal-delivery sense) so just running it straight makes the process
-	// unkillable (even with kill -9). However, BTRFS_BALANCE_CTL_CANCEL is
-	// available, so make a signalfd to detect SIGINT, SIGQUIT, and SIGTERM and
-	// cancel the in-progress balance. In order to accomplish that, the balance
-	// runs in a separate thread and the main thread handles termination
-	// signals, thread reaping, and progress display.
-	//
-	// A signalfd is used to take the termination signals. An eventfd is used
-	// by the balance thread to notify the main thread that it is finished.
-	sigset_t sigs;
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGINT);
-	sigaddset(&sigs, SIGQUIT);
-	sigaddset(&sigs, SIGTERM);
-	if(sigprocmask(SIG_BLOCK, &sigs, 0) < 0) {
-		perror("sigprocmask");
-		return false;
-	}
-	bool ret = true;
-	int sigfd = signalfd(-1, &sigs, 0);
-	if(sigfd >= 0) {
-		int efd = eventfd(0, 0);
-		if(efd >= 0) {
-			ret = do_balance_fd_auxfds(mountpoint, verbose, fd, sigfd, efd);
+		balance->progress_shown = true;
+		if(balance->resuming) {
+			printf("resumed: ");
 		} else {
-			perror("eventfd");
-			ret = false;
+			printf("pass %zu of %zu: ", balance->next_pass, balance->pass_count);
 		}
+		printf("%" PRIu64 " / %" PRIu64 " expected = %u.%u%% (%" PRIu64 " considered)", (uint64_t) args.stat.completed, (uint64_t) args.stat.expected, permille / 10, permille % 10, (uint64_t) args.stat.considered);
+
+		double chunks_per_second, bytes_per_second, eta;
+		if(telemetry_rates(&balance->telemetry, &chunks_per_second, &bytes_per_second)) {
+			printf(", %.2f chunks/s", chunks_per_second);
+			if(!balance->resuming) {
+				printf(", %.1f MiB/s", bytes_per_second / MIB);
+			}
+		}
+		uint64_t done = balance->resuming ? completed : balance->round_chunks + completed;
+		uint64_t total = balance->resuming ? args.stat.expected : balance->plan_chunks;
+		if(telemetry_eta(&balance->telemetry, total > done ? total - done : 0, &eta)) {
+			printf(", ETA %.0f s", eta);
+		}
+		fputs("   \r", stdout);
+		fflush(stdout);
+	}
+}
+
+// Pauses the running round once the time budget has run out, leaving the
+// kernel to keep its place for the next run to resume.
+static void pause_balance(void *raw_balance) {
+	struct balance *balance = raw_balance;
+	if(!balance->paused && balance->runner->running && ioctl(balance->fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_PAUSE) >= 0) {
+		balance->paused = true;
+	}
+}
+
+// Works out how many chunks the next round of the current pass may relocate,
+// or zero if the budget has run out. Without a budget, a pass runs in one go.
+// With one, rounds are sized from the rate seen so far to take about
+// ROUND_SECONDS, or whatever is left of a time budget, starting with a single
+// chunk to measure the rate; and to move no more than what is left of a byte
+// budget.
+static size_t round_size(const struct balance *balance) {
+	const struct balance_options *options = balance->options;
+	if(!options->budget_seconds && !options->budget_bytes) {
+		return balance->pass_left;
+	}
+	uint64_t seconds = ROUND_SECONDS;
+	if(options->budget_seconds) {
+		uint64_t elapsed = (monotonic_ns() - balance->start_ns) / NANOSECONDS_PER_SECOND;
+		if(elapsed >= options->budget_seconds) {
+			return 0;
+		}
+		if(options->budget_seconds - elapsed < seconds) {
+			seconds = options->budget_seconds - elapsed;
+		}
+	}
+	uint64_t size = balance->round_ns ? balance->round_chunks * seconds * NANOSECONDS_PER_SECOND / balance->round_ns : 1;
+	if(!size) {
+		size = 1;
+	}
+	if(options->budget_bytes) {
+		if(balance->moved >= options->budget_bytes) {
+			return 0;
+		}
+		const struct pass *pass = &balance->passes[balance->next_pass - 1];
+		uint64_t chunk_bytes = pass->moved / pass->limit;
+		if(chunk_bytes && (options->budget_bytes - balance->moved) / chunk_bytes < size) {
+			size = (options->budget_bytes - balance->moved) / chunk_bytes;
+		}
+	}
+	return size < balance->pass_left ? (size_t) size : balance->pass_left;
+}
+
+// Starts the next round, moving on to the next pass when the current one is
+// done, unless there is nothing left to do or the budget has run out.
+static bool start_round(struct balance *balance) {
+	if(balance->resuming) {
+		memset(&balance->args, 0, sizeof(balance->args));
+		balance->args.flags = BTRFS_BALANCE_RESUME;
+		return runner_start(balance->runner, &balance->task, &thread_proc, balance);
+	}
+
+	while(!balance->pass_left) {
+		if(balance->next_pass == balance->pass_count) {
+			return true;
+		}
+		const struct pass *pass = &balance->passes[balance->next_pass++];
+		balance->pass_left = pass->limit;
+		if(balance->verbose) {
+			if(pass->usage_max) {
+				printf("%s: pass %zu of %zu: up to %zu %s, %s chunks %u–%u%% full\n", balance->mountpoint, balance->next_pass, balance->pass_count, pass->limit, type_name(pass->flags), profile_name(pass->flags), pass->usage_min, pass->usage_max);
+			} else {
+				printf("%s: pass %zu of %zu: up to %zu empty %s, %s chunks\n", balance->mountpoint, balance->next_pass, balance->pass_count, pass->limit, type_name(pass->flags), profile_name(pass->flags));
+			}
+		}
+	}
+	const struct pass *pass = &balance->passes[balance->next_pass - 1];
+
+	balance->round_limit = round_size(balance);
+	if(!balance->round_limit) {
+		balance->out_of_budget = true;
+		return true;
+	}
+	if(balance->verbose && (balance->options->budget_seconds || balance->options->budget_bytes)) {
+		printf("%s: round of up to %zu chunks\n", balance->mountpoint, balance->round_limit);
+	}
+
+	struct btrfs_balance_args bargs = {
+		.flags = BTRFS_BALANCE_ARGS_PROFILES | BTRFS_BALANCE_ARGS_USAGE_RANGE | BTRFS_BALANCE_ARGS_VRANGE | BTRFS_BALANCE_ARGS_LIMIT,
+		.profiles = (pass->flags & BTRFS_BLOCK_GROUP_PROFILE_MASK) ? (pass->flags & BTRFS_BLOCK_GROUP_PROFILE_MASK) : BTRFS_AVAIL_ALLOC_BIT_SINGLE,
+		.usage_min = pass->usage_min,
+		.usage_max = pass->usage_max,
+		.vstart = 0,
+		.vend = balance->end,
+		.limit = balance->round_limit < UINT32_MAX ? (uint32_t) balance->round_limit : UINT32_MAX,
+	};
+	memset(&balance->args, 0, sizeof(balance->args));
+	if(pass->flags & BTRFS_BLOCK_GROUP_DATA) {
+		// Mixed chunks are both data and metadata, and the kernel insists on
+		// identical filters for both.
+		balance->args.flags |= BTRFS_BALANCE_DATA;
+		balance->args.data = bargs;
+	}
+	if(pass->flags & BTRFS_BLOCK_GROUP_METADATA) {
+		balance->args.flags |= BTRFS_BALANCE_METADATA;
+		balance->args.meta = bargs;
+	}
+	if(pass->flags & BTRFS_BLOCK_GROUP_SYSTEM) {
+		balance->args.flags |= BTRFS_BALANCE_SYSTEM;
+		balance->args.sys = bargs;
+	}
+	balance->round_start_ns = monotonic_ns();
+	return runner_start(balance->runner, &balance->task, &thread_proc, balance);
+}
+
+static void round_finished(struct runner_task *task, void *raw_balance) {
+	struct balance *balance = raw_balance;
+	uint64_t completed = balance->args.stat.completed;
+	balance->completed += completed;
+	balance->considered += balance->args.stat.considered;
+	end_progress_line(balance);
+	balance->moved += completed * chunk_bytes(balance);
+	telemetry_sample(&balance->telemetry, balance->completed, balance->moved);
+	if(task->ret < 0) {
+		// A paused or cancelled round fails with ECANCELED.
+		if(task->error != ECANCELED) {
+			fprintf(stderr, "%s: balance failed: %s\n", balance->mountpoint, strerror(task->error));
+			balance->ok = false;
+		}
+		return;
+	}
+	if(balance->resuming) {
+		return;
+	}
+
+	balance->round_chunks += completed;
+	balance->round_ns += monotonic_ns() - balance->round_start_ns;
+	if(completed < balance->round_limit) {
+		// Fewer chunks than planned were left in the band, so the pass is
+		// done.
+		balance->plan_chunks -= balance->pass_left - completed;
+		balance->pass_left = 0;
 	} else {
-		perror("signalfd");
-		ret = false;
+		balance->pass_left -= completed;
 	}
-	if(sigprocmask(SIG_UNBLOCK, &sigs, 0) < 0) {
-		perror("sigprocmask");
-		abort();
+	if(!balance->runner->cancelled && !start_round(balance)) {
+		balance->ok = false;
 	}
-	return ret;
 }
 
-bool do_balance(const char *mountpoint, bool verbose) {
+// Runs either the paused balance being resumed or the planned passes, until
+// done, out of budget, paused, or cancelled.
+static bool run_balance(struct balance *balance) {
+	uint64_t deadline_ms = 0;
+	if(balance->options->budget_seconds) {
+		uint64_t elapsed_ms = (monotonic_ns() - balance->start_ns) / 1000000;
+		if(elapsed_ms >= balance->options->budget_seconds * 1000ULL) {
+			balance->out_of_budget = true;
+			return true;
+		}
+		deadline_ms = balance->options->budget_seconds * 1000ULL - elapsed_ms;
+	}
+
+	// The balance ioctl is blocking and uninterruptible, but
+	// BTRFS_BALANCE_CTL_CANCEL is available, so run each round on a worker
+	// thread and cancel it if a termination signal arrives.
+	struct runner runner;
+	if(!runner_init(&runner, &cancel_balance, &round_finished, balance)) {
+		return false;
+	}
+	balance->runner = &runner;
+	if((balance->verbose && !runner_add_timer(&runner, PROGRESS_INTERVAL, &show_progress)) || (deadline_ms && !runner_add_timer(&runner, (unsigned int) deadline_ms, &pause_balance)) || !start_round(balance)) {
+		runner_deinit(&runner);
+		return false;
+	}
+	bool ok = runner_run(&runner) && !runner.cancelled;
+
+	if(balance->verbose) {
+		end_progress_line(balance);
+		runner_report(&runner, balance->mountpoint, balance->resuming ? "resumed balance" : "balance");
+	}
+
+	// A pending termination signal takes effect here.
+	runner_deinit(&runner);
+	return ok;
+}
+
+// Resumes a balance that a previous run paused, if there is one.
+static bool resume_balance(struct balance *balance) {
+	struct btrfs_ioctl_balance_args args;
+	if(ioctl(balance->fd, BTRFS_IOC_BALANCE_PROGRESS, &args) < 0 || (args.state & BTRFS_BALANCE_STATE_RUNNING)) {
+		// Either there is no balance, or another one is running, in which
+		// case starting ours will fail.
+		return true;
+	}
+	if(balance->verbose) {
+		printf("%s: resuming paused balance at %" PRIu64 " / %" PRIu64 " chunks\n", balance->mountpoint, (uint64_t) args.stat.completed, (uint64_t) args.stat.expected);
+	}
+	balance->resuming = true;
+	bool ok = run_balance(balance);
+	balance->resuming = false;
+	return ok && balance->ok;
+}
+
+static bool balance_fd(struct balance *balance) {
+	const char *mountpoint = balance->mountpoint;
+	bool verbose = balance->verbose;
+	const struct balance_options *options = balance->options;
+	int fd = balance->fd;
+	if(!resume_balance(balance)) {
+		return false;
+	}
+	if(balance->paused || balance->out_of_budget) {
+		if(verbose) {
+			printf("%s: balance budget spent; paused for the next run to resume\n", mountpoint);
+		}
+		return true;
+	}
+
+	// Skip the balance if there is enough unallocated space on every device
+	// and little enough unused space in the chunks to win back, without
+	// looking at every chunk.
+	struct allocation allocation;
+	if(!read_allocation(mountpoint, fd, &allocation)) {
+		return false;
+	}
+	double slack = allocation.allocated ? (double) (allocation.allocated - allocation.used) * 100.0 / (double) allocation.allocated : 0.0;
+	if(allocation.unallocated >= options->min_unallocated_percent && slack <= options->max_slack_percent) {
+		if(verbose) {
+			printf("%s: balance not needed: at least %.1f%% of every device unallocated and %.1f%% of allocated space unused\n", mountpoint, allocation.unallocated, slack);
+		}
+		return true;
+	}
+	if(verbose) {
+		printf("%s: %.1f%% of the fullest device unallocated and %.1f%% of allocated space unused\n", mountpoint, allocation.unallocated, slack);
+	}
+
+	// Work out which chunks are worth relocating.
+	struct layout layout = { .mountpoint = mountpoint, .fd = fd, .ok = true, .groups = 0, .count = 0, .block_group_tree = BTRFS_EXTENT_TREE_OBJECTID, .end = 0 };
+	if(!read_layout(&layout)) {
+		free_layout(&layout);
+		return false;
+	}
+	if(verbose) {
+		show_histogram(&layout);
+	}
+	plan_blanket(&layout);
+	struct plan_totals blanket = plan_totals(&layout);
+	int64_t target = options->target_mib ? (int64_t) (options->target_mib * MIB) : blanket.gain;
+	plan_target(&layout, target);
+	if(!layout.ok) {
+		free_layout(&layout);
+		return false;
+	}
+	struct plan_totals plan = plan_totals(&layout);
+	if(verbose) {
+		printf("%s: usage filters of %u%% for data and %u%% for metadata would relocate %zu chunks, moving %" PRIu64 " MiB, to free about %" PRId64 " MiB\n", mountpoint, DATA_USAGE_THRESHOLD, METADATA_USAGE_THRESHOLD, blanket.chunks, blanket.moved / MIB, blanket.gain / (int64_t) MIB);
+		printf("%s: relocating %zu chunks, moving %" PRIu64 " MiB, to free about %" PRId64 " MiB\n", mountpoint, plan.chunks, plan.moved / MIB, plan.gain / (int64_t) MIB);
+	}
+	balance->end = layout.end;
+	bool ok = plan_passes(&layout, balance);
+	free_layout(&layout);
+	if(!ok) {
+		return false;
+	}
+	for(size_t i = 0; i != balance->pass_count; ++i) {
+		balance->plan_chunks += balance->passes[i].limit;
+	}
+
+	if(balance->pass_count) {
+		ok = run_balance(balance) && balance->ok;
+
+		// Present the results.
+		if(verbose && ok) {
+			printf("%s: relocated %" PRIu64" / %" PRIu64 " chunks\n", mountpoint, balance->completed, balance->considered);
+			if(balance->paused) {
+				printf("%s: balance budget spent; paused for the next run to resume\n", mountpoint);
+			} else if(balance->out_of_budget) {
+				size_t left = balance->pass_left;
+				for(size_t i = balance->next_pass; i != balance->pass_count; ++i) {
+					left += balance->passes[i].limit;
+				}
+				printf("%s: balance budget spent with %zu planned chunks left\n", mountpoint, left);
+			}
+		}
+	}
+	return ok;
+}
+
+// Shows a record of the run, and remembers its throughput in the state file so
+// that a balance getting slower from one run to the next shows up.
+static bool record_run(const struct balance *balance) {
+	double seconds = (double) (monotonic_ns() - balance->telemetry.start_ns) / 1e9;
+	double chunks_per_second = (double) balance->completed / seconds;
+	double bytes_per_second = (double) balance->moved / seconds;
+	if(balance->verbose) {
+		printf("%s: balance record: duration_seconds %.1f chunks %" PRIu64 " bytes %" PRIu64 " chunks_per_second %.3f bytes_per_second %.0f\n", balance->mountpoint, seconds, balance->completed, balance->moved, chunks_per_second, bytes_per_second);
+	}
+
+	// A run too short to measure, or one that only resumed a paused balance
+	// and so has no estimate of the data moved, is not counted.
+	if(!state_enabled() || seconds < 1.0 || !balance->moved) {
+		return true;
+	}
+	struct btrfs_ioctl_fs_info_args fs_info;
+	if(ioctl(balance->fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+		perror(balance->mountpoint);
+		return false;
+	}
+	char fsid[FSID_STRING_SIZE];
+	format_fsid(fs_info.fsid, fsid);
+	char key[64 + FSID_STRING_SIZE];
+	bool ok = true;
+	uint64_t runs = 0;
+	sprintf(key, "balance.runs.%s", fsid);
+	state_get_u64(key, &runs);
+	ok &= state_set_u64(key, runs + 1);
+	sprintf(key, "balance.rate.%s.%" PRIu64, fsid, runs % HISTORY_RUNS);
+	ok &= state_set_u64(key, (uint64_t) bytes_per_second);
+	++runs;
+
+	if(balance->verbose) {
+		printf("%s: balance throughput over the last %" PRIu64 " run(s), oldest first:", balance->mountpoint, runs < HISTORY_RUNS ? runs : HISTORY_RUNS);
+		for(uint64_t run = runs < HISTORY_RUNS ? 0 : runs - HISTORY_RUNS; run != runs; ++run) {
+			uint64_t rate = 0;
+			sprintf(key, "balance.rate.%s.%" PRIu64, fsid, run % HISTORY_RUNS);
+			state_get_u64(key, &rate);
+			printf(" %.1f", rate / (1024.0 * 1024.0));
+		}
+		puts(" MiB/s");
+	}
+	return ok && state_save();
+}
+
+static bool do_balance_fd(const char *mountpoint, bool verbose, const struct balance_options *options, int fd) {
+	struct balance balance = { .mountpoint = mountpoint, .verbose = verbose, .options = options, .fd = fd, .ok = true, .completed = 0, .considered = 0, .progress_shown = false, .passes = 0, .pass_count = 0, .next_pass = 0, .pass_left = 0, .start_ns = monotonic_ns(), .resuming = false, .out_of_budget = false, .paused = false, .round_chunks = 0, .round_ns = 0, .moved = 0, .plan_chunks = 0 };
+	telemetry_init(&balance.telemetry);
+	bool ok = balance_fd(&balance);
+	if(ok && balance.completed) {
+		ok = record_run(&balance);
+	}
+	free(balance.passes);
+	return ok;
+}
+
+bool do_balance(const char *mountpoint, bool verbose, const struct balance_options *options) {
 	if(verbose) {
 		printf("Balance %s:\n", mountpoint);
 	}
 	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
 	bool ret;
 	if(fd >= 0) {
-		ret = do_balance_fd(mountpoint, verbose, fd);
+		ret = do_balance_fd(mountpoint, verbose, options, fd);
 		close(fd);
 	} else {
 		perror(mountpoint);
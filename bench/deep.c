@@ -0,0 +1,316 @@
+// Compares loop detection and path building on deep trees between the stack
+// used by defragmentation and the one it replaced. The old stack was singly
+// linked, so loop detection walked every entry down from the top and walking
+// up from the bottom searched for each chunk’s successor from the top; the
+// new one keeps a hash set of the (device, inode) pairs on it and links its
+// chunks both ways.
+//
+// The tree is synthetic and lives only in memory: a chain of directories as
+// deep as asked, each with some leaf directories beside the next link. Every
+// directory is checked for a loop before it is pushed, as process() does, and
+// the path of each link is built once, as progress output and handing a
+// directory to another worker do. Each stack is first grown to the full depth
+// and emptied, since a worker keeps its stack for the whole walk and so does
+// not allocate chunks for every directory; the new stack’s chunks carry the
+// getdents64 buffers and are large enough that mapping them would otherwise
+// swamp the checks on shallow trees.
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stack.h"
+
+static const char NAME[] = "node_modules";
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// The old stack, as defrag.c kept it before the ancestor set.
+struct old_entry {
+	uint32_t dev_major, dev_minor;
+	uint64_t inode;
+	const char *name;
+};
+
+struct old_chunk {
+	struct old_entry entries[CHUNK_CAPACITY];
+	struct old_chunk *previous;
+};
+
+struct old_stack {
+	struct old_chunk *top;
+	size_t top_used;
+	struct old_chunk *free_chunks;
+};
+
+static bool old_push(struct old_stack *stack, const struct old_entry *new) {
+	if(!stack->top || stack->top_used == CHUNK_CAPACITY) {
+		struct old_chunk *chunk = stack->free_chunks;
+		if(chunk) {
+			stack->free_chunks = chunk->previous;
+		} else if(!(chunk = malloc(sizeof(*chunk)))) {
+			perror("malloc");
+			return false;
+		}
+		chunk->previous = stack->top;
+		stack->top = chunk;
+		stack->top_used = 0;
+	}
+	stack->top->entries[stack->top_used++] = *new;
+	return true;
+}
+
+static void old_pop(struct old_stack *stack) {
+	if(!--stack->top_used) {
+		struct old_chunk *empty_chunk = stack->top;
+		stack->top = empty_chunk->previous;
+		empty_chunk->previous = stack->free_chunks;
+		stack->free_chunks = empty_chunk;
+		if(stack->top) {
+			stack->top_used = CHUNK_CAPACITY;
+		}
+	}
+}
+
+static void old_deinit(struct old_stack *stack) {
+	while(stack->top) {
+		old_pop(stack);
+	}
+	while(stack->free_chunks) {
+		struct old_chunk *prev = stack->free_chunks->previous;
+		free(stack->free_chunks);
+		stack->free_chunks = prev;
+	}
+}
+
+static void old_foreach_down(struct old_stack *stack, bool (*cb)(struct old_entry *, void *), void *cookie) {
+	struct old_chunk *chunk = stack->top;
+	size_t next_index = stack->top_used - 1;
+	while(chunk) {
+		if(!cb(&chunk->entries[next_index], cookie)) {
+			break;
+		}
+		if(next_index) {
+			--next_index;
+		} else {
+			chunk = chunk->previous;
+			next_index = CHUNK_CAPACITY - 1;
+		}
+	}
+}
+
+static void old_foreach_up(struct old_stack *stack, bool (*cb)(struct old_entry *, void *), void *cookie) {
+	struct old_chunk *chunk = stack->top;
+	while(chunk && chunk->previous) {
+		chunk = chunk->previous;
+	}
+	size_t next_index = 0;
+	while(chunk) {
+		if(!cb(&chunk->entries[next_index], cookie)) {
+			break;
+		}
+		++next_index;
+		if(chunk == stack->top && next_index == stack->top_used) {
+			break;
+		} else if(next_index == CHUNK_CAPACITY) {
+			next_index = 0;
+			struct old_chunk *next_chunk = stack->top;
+			while(next_chunk->previous != chunk) {
+				next_chunk = next_chunk->previous;
+			}
+			chunk = next_chunk;
+		}
+	}
+}
+
+struct loop_check {
+	uint64_t inode;
+	bool loop_found;
+};
+
+static bool old_check_loop(struct old_entry *e, void *check_raw) {
+	struct loop_check *check = check_raw;
+	if(e->dev_major == 0 && e->dev_minor == 42 && e->inode == check->inode) {
+		check->loop_found = true;
+		return false;
+	}
+	return true;
+}
+
+struct path {
+	char *buffer;
+	size_t length;
+};
+
+static bool old_append(struct old_entry *e, void *path_raw) {
+	struct path *path = path_raw;
+	memcpy(path->buffer + path->length, e->name, strlen(e->name));
+	path->length += strlen(e->name);
+	path->buffer[path->length++] = '/';
+	return true;
+}
+
+static bool new_append(struct stack_entry *e, void *path_raw) {
+	struct path *path = path_raw;
+	memcpy(path->buffer + path->length, e->name, e->name_len);
+	path->length += e->name_len;
+	path->buffer[path->length++] = '/';
+	return true;
+}
+
+// The times taken by one walk of the tree, and a checksum of the paths so
+// that both stacks can be seen to have built the same ones.
+struct result {
+	uint64_t check_ns;
+	uint64_t path_ns;
+	uint64_t path_bytes;
+	bool loop_found;
+};
+
+static bool walk_old(unsigned int depth, unsigned int width, char *buffer, struct result *result) {
+	struct old_stack stack = { .top = 0, .top_used = 0, .free_chunks = 0 };
+	struct old_entry warm = { .dev_major = 0, .dev_minor = 42, .inode = 0, .name = NAME };
+	bool ok = true;
+	for(unsigned int level = 0; ok && level != depth; ++level) {
+		ok = old_push(&stack, &warm);
+	}
+	while(stack.top) {
+		old_pop(&stack);
+	}
+	uint64_t inode = 256;
+	*result = (struct result) { 0, 0, 0, false };
+	for(unsigned int level = 0; ok && level != depth; ++level) {
+		uint64_t before = now_ns();
+		for(unsigned int i = 0; ok && i <= width; ++i) {
+			struct loop_check check = { .inode = ++inode, .loop_found = false };
+			if(stack.top) {
+				old_foreach_down(&stack, &old_check_loop, &check);
+			}
+			result->loop_found |= check.loop_found;
+			struct old_entry e = { .dev_major = 0, .dev_minor = 42, .inode = inode, .name = NAME };
+			ok = old_push(&stack, &e);
+			if(ok && i != width) {
+				// A leaf, which is left straight away.
+				old_pop(&stack);
+			}
+		}
+		uint64_t middle = now_ns();
+		struct path path = { .buffer = buffer, .length = 0 };
+		old_foreach_up(&stack, &old_append, &path);
+		result->path_bytes += path.length;
+		result->check_ns += middle - before;
+		result->path_ns += now_ns() - middle;
+	}
+	old_deinit(&stack);
+	return ok;
+}
+
+static bool walk_new(unsigned int depth, unsigned int width, char *buffer, struct result *result) {
+	struct stack stack;
+	stack_init(&stack);
+	struct stack_entry warm = { .dev_major = 0, .dev_minor = 42, .inode = 0, .name = NAME, .name_len = sizeof(NAME) - 1, .fd = -1 };
+	bool ok = true;
+	for(unsigned int level = 0; ok && level != depth; ++level) {
+		ok = stack_push(&stack, &warm);
+	}
+	while(!stack_empty(&stack)) {
+		stack_pop(&stack);
+	}
+	uint64_t inode = 256;
+	*result = (struct result) { 0, 0, 0, false };
+	for(unsigned int level = 0; ok && level != depth; ++level) {
+		uint64_t before = now_ns();
+		for(unsigned int i = 0; ok && i <= width; ++i) {
+			++inode;
+			result->loop_found |= stack_contains(&stack, 0, 42, inode);
+			struct stack_entry e = { .dev_major = 0, .dev_minor = 42, .inode = inode, .name = NAME, .name_len = sizeof(NAME) - 1, .fd = -1 };
+			ok = stack_push(&stack, &e);
+			if(ok && i != width) {
+				stack_pop(&stack);
+			}
+		}
+		uint64_t middle = now_ns();
+		struct path path = { .buffer = buffer, .length = 0 };
+		stack_foreach_up(&stack, &new_append, &path);
+		result->path_bytes += path.length;
+		result->check_ns += middle - before;
+		result->path_ns += now_ns() - middle;
+	}
+	stack_deinit(&stack);
+	return ok;
+}
+
+static void keep_best(struct result *best, const struct result *run) {
+	if(run->check_ns < best->check_ns) {
+		best->check_ns = run->check_ns;
+	}
+	if(run->path_ns < best->path_ns) {
+		best->path_ns = run->path_ns;
+	}
+	best->path_bytes = run->path_bytes;
+	best->loop_found = run->loop_found;
+}
+
+int main(int argc, char **argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s depth ... [-w width] [-r runs]\n\n"
+				"Walks a synthetic chain of directories of each depth, each with width leaf\n"
+				"directories (default 16), with both stacks, keeping the best of runs\n"
+				"(default 5).\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	unsigned int width = 16, runs = 5, max_depth = 0;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-w") && i + 1 < argc) {
+			width = (unsigned int) strtoul(argv[++i], 0, 10);
+		} else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+			runs = (unsigned int) strtoul(argv[++i], 0, 10);
+		} else {
+			unsigned int depth = (unsigned int) strtoul(argv[i], 0, 10);
+			if(depth > max_depth) {
+				max_depth = depth;
+			}
+		}
+	}
+	if(!runs || !max_depth) {
+		fprintf(stderr, "%s: runs and depths must be positive\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	char *buffer = malloc((size_t) max_depth * sizeof(NAME));
+	if(!buffer) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("%8s %6s  %12s %12s  %12s %12s\n", "depth", "width", "old check", "new check", "old paths", "new paths");
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-w") || !strcmp(argv[i], "-r")) {
+			++i;
+			continue;
+		}
+		unsigned int depth = (unsigned int) strtoul(argv[i], 0, 10);
+		struct result old_best = { UINT64_MAX, UINT64_MAX, 0, false }, new_best = old_best, run;
+		for(unsigned int j = 0; j != runs; ++j) {
+			if(!walk_old(depth, width, buffer, &run)) {
+				return EXIT_FAILURE;
+			}
+			keep_best(&old_best, &run);
+			if(!walk_new(depth, width, buffer, &run)) {
+				return EXIT_FAILURE;
+			}
+			keep_best(&new_best, &run);
+		}
+		if(old_best.loop_found || new_best.loop_found || old_best.path_bytes != new_best.path_bytes) {
+			fprintf(stderr, "%s: stacks disagree at depth %u\n", argv[0], depth);
+			return EXIT_FAILURE;
+		}
+		printf("%8u %6u  %9.3f ms %9.3f ms  %9.3f ms %9.3f ms\n", depth, width, old_best.check_ns / 1e6, new_best.check_ns / 1e6, old_best.path_ns / 1e6, new_best.path_ns / 1e6);
+	}
+	free(buffer);
+	return EXIT_SUCCESS;
+}
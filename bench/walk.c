@@ -0,0 +1,285 @@
+// Compares the directory reader used by defragmentation, which reads
+// directories with getdents64 into buffers and copies names into arenas held
+// by the stack’s chunks, with the fdopendir and readdir walker it replaced,
+// which allocated a DIR and a strdup()ed name for every directory.
+//
+// Both walk the same generated tree, opening only directories, so that what
+// is measured is the reading and the stack rather than per-file system calls.
+// The tree can be on any filesystem.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "stack.h"
+
+struct counts {
+	uint64_t entries;
+	uint64_t directories;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static bool create_files(const char *path, unsigned int count) {
+	if(mkdir(path, 0755) < 0) {
+		perror(path);
+		return false;
+	}
+	int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if(dir_fd < 0) {
+		perror(path);
+		return false;
+	}
+	for(unsigned int i = 0; i != count; ++i) {
+		char name[32];
+		sprintf(name, "file-%u", i);
+		int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if(fd < 0) {
+			perror(name);
+			close(dir_fd);
+			return false;
+		}
+		close(fd);
+	}
+	close(dir_fd);
+	return true;
+}
+
+// Creates one directory holding big files and, beside it, directories
+// directories holding small files each.
+static bool generate(const char *root, unsigned int big, unsigned int directories, unsigned int small) {
+	char path[PATH_MAX];
+	if(mkdir(root, 0755) < 0) {
+		perror(root);
+		return false;
+	}
+	snprintf(path, sizeof(path), "%s/big", root);
+	if(!create_files(path, big)) {
+		return false;
+	}
+	snprintf(path, sizeof(path), "%s/small", root);
+	if(mkdir(path, 0755) < 0) {
+		perror(path);
+		return false;
+	}
+	for(unsigned int i = 0; i != directories; ++i) {
+		snprintf(path, sizeof(path), "%s/small/directory-%u", root, i);
+		if(!create_files(path, small)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// The old walker: a growing array of DIR handles and separately allocated
+// names, as defrag.c kept before it switched to getdents64.
+struct old_entry {
+	char *name;
+	DIR *dir_handle;
+};
+
+static bool walk_readdir(const char *root, struct counts *counts) {
+	size_t capacity = 16, used = 0;
+	struct old_entry *stack = malloc(capacity * sizeof(*stack));
+	if(!stack) {
+		perror("malloc");
+		return false;
+	}
+	DIR *dir_handle = opendir(root);
+	if(!dir_handle) {
+		perror(root);
+		free(stack);
+		return false;
+	}
+	stack[used++] = (struct old_entry) { .name = strdup(root), .dir_handle = dir_handle };
+	bool ok = true;
+	while(used) {
+		struct old_entry *e = &stack[used - 1];
+		errno = 0;
+		struct dirent *de = readdir(e->dir_handle);
+		if(!de) {
+			if(errno) {
+				perror(e->name);
+				ok = false;
+			}
+			closedir(e->dir_handle);
+			free(e->name);
+			--used;
+			continue;
+		}
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		++counts->entries;
+		if(de->d_type != DT_DIR) {
+			continue;
+		}
+		int fd = openat(dirfd(e->dir_handle), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if(fd < 0) {
+			perror(de->d_name);
+			ok = false;
+			continue;
+		}
+		++counts->directories;
+		if(used == capacity) {
+			capacity *= 2;
+			struct old_entry *bigger = realloc(stack, capacity * sizeof(*stack));
+			if(!bigger) {
+				perror("realloc");
+				close(fd);
+				ok = false;
+				break;
+			}
+			stack = bigger;
+		}
+		stack[used++] = (struct old_entry) { .name = strdup(de->d_name), .dir_handle = fdopendir(fd) };
+	}
+	while(used) {
+		closedir(stack[used - 1].dir_handle);
+		free(stack[used - 1].name);
+		--used;
+	}
+	free(stack);
+	return ok;
+}
+
+static bool walk_getdents(const char *root, struct counts *counts) {
+	struct stack stack;
+	stack_init(&stack);
+	int fd = open(root, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		perror(root);
+		return false;
+	}
+	struct stack_entry root_entry = { .name = root, .name_len = strlen(root), .fd = fd };
+	if(!stack_push(&stack, &root_entry)) {
+		close(fd);
+		return false;
+	}
+	bool ok = true;
+	while(!stack_empty(&stack)) {
+		struct stack_entry *e = stack_peek(&stack);
+		const struct dirent64 *de = stack_entry_read(e);
+		if(!de) {
+			if(errno) {
+				perror(e->name);
+				ok = false;
+			}
+			stack_pop(&stack);
+			continue;
+		}
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		++counts->entries;
+		if(de->d_type != DT_DIR) {
+			continue;
+		}
+		fd = openat(e->fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if(fd < 0) {
+			perror(de->d_name);
+			ok = false;
+			continue;
+		}
+		++counts->directories;
+		struct stack_entry child = { .inode = de->d_ino, .name = de->d_name, .name_len = strlen(de->d_name), .fd = fd };
+		if(!stack_push(&stack, &child)) {
+			close(fd);
+			ok = false;
+			break;
+		}
+	}
+	stack_deinit(&stack);
+	return ok;
+}
+
+static int compare_u64(const void *x, const void *y) {
+	uint64_t a = *(const uint64_t *) x, b = *(const uint64_t *) y;
+	return a < b ? -1 : a > b;
+}
+
+static void show(const char *name, uint64_t *times, unsigned int runs, const struct counts *counts) {
+	qsort(times, runs, sizeof(*times), &compare_u64);
+	printf("%-10s best %8.1f ms, median %8.1f ms, %6.2f M entries/s\n", name, times[0] / 1e6, times[runs / 2] / 1e6, counts->entries / (times[0] / 1e9) / 1e6);
+}
+
+int main(int argc, char **argv) {
+	if(argc < 2 || argc > 6) {
+		fprintf(stderr, "Usage: %s directory [runs [big [directories [small]]]]\n\n"
+				"Walks directory with both readers, runs times each (default 5), creating it\n"
+				"first if it does not exist with one directory of big empty files (default\n"
+				"200000) and directories directories (default 1000) of small files each\n"
+				"(default 100).\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *root = argv[1];
+	unsigned int runs = argc > 2 ? (unsigned int) strtoul(argv[2], 0, 10) : 5;
+	unsigned int big = argc > 3 ? (unsigned int) strtoul(argv[3], 0, 10) : 200000;
+	unsigned int directories = argc > 4 ? (unsigned int) strtoul(argv[4], 0, 10) : 1000;
+	unsigned int small = argc > 5 ? (unsigned int) strtoul(argv[5], 0, 10) : 100;
+	if(!runs) {
+		fprintf(stderr, "%s: runs must be positive\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct stat st;
+	if(stat(root, &st) < 0) {
+		if(errno != ENOENT) {
+			perror(root);
+			return EXIT_FAILURE;
+		}
+		printf("Generating %s\n", root);
+		if(!generate(root, big, directories, small)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Alternate the walkers so that neither is favoured by what the other
+	// left in the caches, after one untimed walk to warm them.
+	uint64_t *readdir_times = malloc(runs * sizeof(*readdir_times));
+	uint64_t *getdents_times = malloc(runs * sizeof(*getdents_times));
+	if(!readdir_times || !getdents_times) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	struct counts readdir_counts = { 0, 0 }, getdents_counts = { 0, 0 };
+	if(!walk_getdents(root, &getdents_counts)) {
+		return EXIT_FAILURE;
+	}
+	for(unsigned int i = 0; i != runs; ++i) {
+		readdir_counts = (struct counts) { 0, 0 };
+		uint64_t before = now_ns();
+		if(!walk_readdir(root, &readdir_counts)) {
+			return EXIT_FAILURE;
+		}
+		readdir_times[i] = now_ns() - before;
+		getdents_counts = (struct counts) { 0, 0 };
+		before = now_ns();
+		if(!walk_getdents(root, &getdents_counts)) {
+			return EXIT_FAILURE;
+		}
+		getdents_times[i] = now_ns() - before;
+	}
+	if(readdir_counts.entries != getdents_counts.entries || readdir_counts.directories != getdents_counts.directories) {
+		fprintf(stderr, "%s: walkers disagree: readdir found %" PRIu64 " entries and %" PRIu64 " directories, getdents64 %" PRIu64 " and %" PRIu64 "\n", root, readdir_counts.entries, readdir_counts.directories, getdents_counts.entries, getdents_counts.directories);
+		return EXIT_FAILURE;
+	}
+
+	printf("%s: %" PRIu64 " entries, %" PRIu64 " directories, %u runs\n", root, getdents_counts.entries, getdents_counts.directories, runs);
+	show("readdir", readdir_times, runs, &readdir_counts);
+	show("getdents64", getdents_times, runs, &getdents_counts);
+	free(readdir_times);
+	free(getdents_times);
+	return EXIT_SUCCESS;
+}
@@ -1,150 +1,178 @@
 #include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 #include <time.h>
 #include <unistd.h>
 #include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <linux/magic.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include "ops.h"
+#include "pacer.h"
+#include "stack.h"
+#include "state.h"
+#include "uring.h"
+#include "util.h"
 
-#define CHUNK_CAPACITY 8
+#define FIEMAP_BATCH 128
+
+#define URING_BATCH 64
+
+// The layout of a btrfs file handle without parent information, as accepted
+// by open_by_handle_at; see fs/btrfs/export.h in the kernel. The handle holds
+// the inode number (64 bits), the subvolume ID (64 bits), and the inode
+// generation (32 bits), in native byte order and without padding.
+#define FILEID_BTRFS_WITHOUT_PARENT 0x4d
+#define BTRFS_FID_SIZE_NON_CONNECTABLE 20
+
+// Handles with parent information (types 0x4e and 0x4f) start the same way,
+// followed by up to 20 more bytes.
+#define FILEID_BTRFS_WITH_PARENT_ROOT 0x4f
+#define BTRFS_FID_SIZE_CONNECTABLE_ROOT 40
 
 static const uint32_t EXTENT_THRESHOLD = 32 * 1024 * 1024;
 
 static const unsigned int MILLISECONDS_PER_PROGRESS = 250;
 
-struct stack_entry {
-	uint32_t dev_major, dev_minor;
-	uint64_t inode;
-	char *name;
-	DIR *dir_handle;
-};
+// With a time budget, the share of it in percent that the measuring scan may
+// use, so that there is always time left to defragment what it found.
+static const unsigned int SCAN_BUDGET_PERCENT = 50;
 
-struct stack_chunk {
-	struct stack_entry entries[CHUNK_CAPACITY];
-	struct stack_chunk *previous;
-};
+// When choosing files to recompress, how many evenly spaced blocks of what
+// size to read, and the byte entropy, in bits per byte, below which the
+// samples are taken to be worth compressing.
+#define COMPRESSION_SAMPLES 4
+#define COMPRESSION_SAMPLE_SIZE (16 * 1024)
+static const double COMPRESSIBLE_ENTROPY = 7.0;
 
-struct stack {
-	struct stack_chunk *top;
-	size_t top_used;
-	struct stack_chunk *free_chunks;
+// A task is a directory which one worker has found and opened but which any
+// worker may scan. Because the worker that eventually scans it needs to check
+// for loops and print paths, the task carries a copy of the ancestors that
+// were on the finding worker’s stack at the time; these are pushed onto the
+// scanning worker’s stack without descriptors, and are simply popped once the
+// scan drops back down to them. All names in a task are allocated separately.
+struct task {
+	struct stack_entry *ancestors;
+	size_t ancestor_count;
+	struct stack_entry entry;
 };
 
-static void stack_init(struct stack *stack) {
-	stack->top = 0;
-	stack->top_used = 0;
-	stack->free_chunks = 0;
+static void task_free(struct task *task) {
+	for(size_t i = 0; i != task->ancestor_count; ++i) {
+		free((char *) task->ancestors[i].name);
+	}
+	free(task->ancestors);
+	if(task->entry.fd >= 0) {
+		close(task->entry.fd);
+	}
+	free((char *) task->entry.name);
+	free(task);
 }
 
-static bool stack_empty(const struct stack *stack) {
-	return !stack->top;
-}
+// Each worker owns a deque of tasks. The owner pushes and pops at the bottom,
+// so it keeps working depth-first; idle workers steal from the top, which
+// tends to be nearer the root and hence carry a bigger subtree.
+struct deque {
+	mtx_t lock;
+	struct task **tasks;
+	size_t capacity;
+	size_t head;
+	size_t count;
+};
 
-static bool stack_push(struct stack *stack, const struct stack_entry *new) {
-	if(!stack->top || stack->top_used == CHUNK_CAPACITY) {
-		if(!stack->free_chunks) {
-			struct stack_chunk *new_chunk = malloc(sizeof(*new_chunk));
-			if(!new_chunk) {
-				perror("malloc");
-				return false;
-			}
-			new_chunk->previous = 0;
-			stack->free_chunks = new_chunk;
-		}
-		struct stack_chunk *new_chunk = stack->free_chunks;
-		stack->free_chunks = new_chunk->previous;
-		new_chunk->previous = stack->top;
-		stack->top = new_chunk;
-		stack->top_used = 0;
+static bool deque_init(struct deque *deque) {
+	if(mtx_init(&deque->lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		return false;
 	}
-
-	stack->top->entries[stack->top_used] = *new;
-	++stack->top_used;
+	deque->tasks = 0;
+	deque->capacity = 0;
+	deque->head = 0;
+	deque->count = 0;
 	return true;
 }
 
-static void stack_pop(struct stack *stack) {
-	struct stack_entry *e = &stack->top->entries[stack->top_used - 1];
-	if(e->dir_handle) {
-		closedir(e->dir_handle);
+static void deque_deinit(struct deque *deque) {
+	for(size_t i = 0; i != deque->count; ++i) {
+		task_free(deque->tasks[deque->head + i]);
 	}
-	free(e->name);
-	--stack->top_used;
-	if(!stack->top_used) {
-		struct stack_chunk *empty_chunk = stack->top;
-		stack->top = empty_chunk->previous;
-		empty_chunk->previous = stack->free_chunks;
-		stack->free_chunks = empty_chunk;
-		if(stack->top) {
-			stack->top_used = CHUNK_CAPACITY;
-		}
-	}
-}
-
-static void stack_deinit(struct stack *stack) {
-	while(!stack_empty(stack)) {
-		stack_pop(stack);
-	}
-	while(stack->free_chunks) {
-		struct stack_chunk *prev = stack->free_chunks->previous;
-		free(stack->free_chunks);
-		stack->free_chunks = prev;
-	}
-}
-
-static struct stack_entry *stack_peek(struct stack *stack) {
-	return &stack->top->entries[stack->top_used - 1];
+	free(deque->tasks);
+	mtx_destroy(&deque->lock);
 }
 
-static void stack_foreach_down(struct stack *stack, bool (*cb)(struct stack_entry *, void *), void *cookie) {
-	struct stack_chunk *chunk = stack->top;
-	size_t next_index = stack->top_used - 1;
-	while(chunk) {
-		if(!cb(&chunk->entries[next_index], cookie)) {
-			break;
-		}
-		if(next_index) {
-			--next_index;
+// Must be called with the lock held.
+static bool deque_push_bottom(struct deque *deque, struct task *task) {
+	if(deque->head + deque->count == deque->capacity) {
+		if(deque->head) {
+			memmove(deque->tasks, deque->tasks + deque->head, deque->count * sizeof(*deque->tasks));
+			deque->head = 0;
 		} else {
-			chunk = chunk->previous;
-			next_index = CHUNK_CAPACITY - 1;
+			size_t new_capacity = deque->capacity ? deque->capacity * 2 : 16;
+			struct task **new_tasks = realloc(deque->tasks, new_capacity * sizeof(*new_tasks));
+			if(!new_tasks) {
+				perror("realloc");
+				return false;
+			}
+			deque->tasks = new_tasks;
+			deque->capacity = new_capacity;
 		}
 	}
+	deque->tasks[deque->head + deque->count] = task;
+	++deque->count;
+	return true;
 }
 
-static void stack_foreach_up(struct stack *stack, bool (*cb)(struct stack_entry *, void *), void *cookie) {
-	struct stack_chunk *chunk = stack->top;
-	while(chunk && chunk->previous) {
-		chunk = chunk->previous;
+// Must be called with the lock held.
+static struct task *deque_pop_bottom(struct deque *deque) {
+	if(!deque->count) {
+		return 0;
 	}
-	size_t next_index = 0;
-	while(chunk) {
-		if(!cb(&chunk->entries[next_index], cookie)) {
-			break;
-		}
-		++next_index;
-		if(chunk == stack->top && next_index == stack->top_used) {
-			break;
-		} else if(next_index == CHUNK_CAPACITY) {
-			next_index = 0;
-			struct stack_chunk *next_chunk = stack->top;
-			while(next_chunk->previous != chunk) {
-				next_chunk = next_chunk->previous;
-			}
-			chunk = next_chunk;
-		}
+	--deque->count;
+	return deque->tasks[deque->head + deque->count];
+}
+
+// Must be called with the lock held.
+static struct task *deque_pop_top(struct deque *deque) {
+	if(!deque->count) {
+		return 0;
 	}
+	struct task *task = deque->tasks[deque->head];
+	--deque->count;
+	deque->head = deque->count ? deque->head + 1 : 0;
+	return task;
 }
 
+// All progress and error output goes through a single reporter so that
+// workers do not interleave partial lines or trample the progress line.
+struct reporter {
+	mtx_t lock;
+	bool verbose;
+	size_t current_line_width;
+	bool progress_shown;
+	struct timespec last_progress_time;
+};
+
 struct print_path_cookie {
 	FILE *dest;
 	size_t width;
@@ -152,8 +180,8 @@ struct print_path_cookie {
 
 static bool print_path_impl(struct stack_entry *e, void *cookie_raw) {
 	struct print_path_cookie *cookie = cookie_raw;
-	fputs(e->name, cookie->dest);
-	cookie->width += strlen(e->name);
+	fwrite(e->name, 1, e->name_len, cookie->dest);
+	cookie->width += e->name_len;
 	putc('/', cookie->dest);
 	++cookie->width;
 	return true;
@@ -183,308 +211,2784 @@ static void clear_line(size_t *width) {
 	*width = 0;
 }
 
-static void show_path_error(struct stack *stack, const char *final_component, size_t *current_line_width, const char *message) {
-	clear_line(current_line_width);
+static void show_path_error(struct stack *stack, const char *final_component, struct reporter *reporter, const char *message) {
+	mtx_lock(&reporter->lock);
+	clear_line(&reporter->current_line_width);
+	print_path(stack, final_component, 0, stderr);
+	fputs(": ", stderr);
+	fputs(message, stderr);
+	putc('\n', stderr);
+	mtx_unlock(&reporter->lock);
+}
+
+static void show_path_errno(struct stack *stack, const char *final_component, struct reporter *reporter) {
+	int err = errno;
+	mtx_lock(&reporter->lock);
+	const char *message = strerror(err);
+	clear_line(&reporter->current_line_width);
 	print_path(stack, final_component, 0, stderr);
 	fputs(": ", stderr);
 	fputs(message, stderr);
 	putc('\n', stderr);
+	mtx_unlock(&reporter->lock);
 }
 
-static void show_path_errno(struct stack *stack, const char *final_component, size_t *current_line_width) {
-	show_path_error(stack, final_component, current_line_width, strerror(errno));
+// Reports an error on a file for which only a descriptor, not a stack, is at
+// hand; the kernel still knows the path, so ask it.
+static void show_fd_error(int fd, struct reporter *reporter, int err) {
+	char link[64];
+	char path[PATH_MAX];
+	sprintf(link, "/proc/self/fd/%d", fd);
+	ssize_t len = readlink(link, path, sizeof(path) - 1);
+	if(len < 0) {
+		len = 0;
+	}
+	path[len] = '\0';
+	mtx_lock(&reporter->lock);
+	clear_line(&reporter->current_line_width);
+	fprintf(stderr, "%s: %s\n", len ? path : link, strerror(err));
+	mtx_unlock(&reporter->lock);
 }
 
-struct loop_check {
-	uint32_t dev_major, dev_minor;
-	uint64_t inode;
-	bool loop_found;
+static void show_progress(struct stack *stack, struct reporter *reporter) {
+	if(!reporter->verbose) {
+		return;
+	}
+
+	// Need to give some kind of progress indication. Just print the
+	// directories as we enter them. But don’t do it too often.
+	struct timespec now;
+	if(clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+		return;
+	}
+	mtx_lock(&reporter->lock);
+	long long elapsed_ms = (now.tv_sec - reporter->last_progress_time.tv_sec) * 1000LL + (now.tv_nsec - reporter->last_progress_time.tv_nsec) / 1000000L;
+	if(!reporter->progress_shown || elapsed_ms >= MILLISECONDS_PER_PROGRESS) {
+		clear_line(&reporter->current_line_width);
+		print_path(stack, 0, &reporter->current_line_width, stdout);
+		putchar('\r');
+		fflush(stdout);
+		reporter->last_progress_time = now;
+		reporter->progress_shown = true;
+	}
+	mtx_unlock(&reporter->lock);
+}
+
+// When pipelining, the scan stage hands open regular files through a bounded
+// queue to a separate set of threads that issue the (slow) defragment ioctls,
+// so that neither kind of work has to wait for the other. The time each side
+// spends blocked on the queue is accumulated for reporting.
+struct file_queue {
+	mtx_t lock;
+	cnd_t not_empty;
+	cnd_t not_full;
+	int *fds;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool closed;
+	uint64_t producer_stall_ns;
+	uint64_t consumer_stall_ns;
 };
 
-static bool check_loop(struct stack_entry *e, void *check_raw) {
-	struct loop_check *check = check_raw;
-	if(check->dev_major == e->dev_major && check->dev_minor == e->dev_minor && check->inode == e->inode) {
-		check->loop_found = true;
+static bool file_queue_init(struct file_queue *queue, size_t capacity) {
+	queue->fds = malloc(capacity * sizeof(*queue->fds));
+	if(!queue->fds) {
+		perror("malloc");
+		return false;
+	}
+	if(mtx_init(&queue->lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		free(queue->fds);
 		return false;
 	}
+	if(cnd_init(&queue->not_empty) != thrd_success) {
+		fputs("cnd_init: failed\n", stderr);
+		mtx_destroy(&queue->lock);
+		free(queue->fds);
+		return false;
+	}
+	if(cnd_init(&queue->not_full) != thrd_success) {
+		fputs("cnd_init: failed\n", stderr);
+		cnd_destroy(&queue->not_empty);
+		mtx_destroy(&queue->lock);
+		free(queue->fds);
+		return false;
+	}
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = false;
+	queue->producer_stall_ns = 0;
+	queue->consumer_stall_ns = 0;
 	return true;
 }
 
-static bool process(int dir_fd, const char *name, struct stack *stack, uint8_t (*fsid)[BTRFS_FSID_SIZE], bool verbose, size_t *current_line_width, clock_t *last_progress_time) {
-	// Start with an O_PATH so that we don’t provoke things like named pipes
-	// and device nodes. Also use O_NOFOLLOW because we are doing a physical
-	// tree traversal, so symlinks should never be followed.
-	int path_fd = openat(dir_fd, name, O_RDONLY | O_PATH | O_NOFOLLOW | O_NOATIME);
-	if(path_fd < 0) {
-		if(errno == ENOENT) {
-			// The file was deleted in between when we found it in the
-			// directory scan and now. This is not an error. It is a normal
-			// occurrence while navigating the filesystem. Ignore it.
-			return true;
-		} else {
-			// Something else weirder went wrong.
-			show_path_errno(stack, name, current_line_width);
-			return false;
+static void file_queue_deinit(struct file_queue *queue) {
+	cnd_destroy(&queue->not_full);
+	cnd_destroy(&queue->not_empty);
+	mtx_destroy(&queue->lock);
+	free(queue->fds);
+}
+
+// Takes ownership of fd, blocking while the queue is full.
+static void file_queue_push(struct file_queue *queue, int fd) {
+	mtx_lock(&queue->lock);
+	if(queue->count == queue->capacity) {
+		uint64_t start = monotonic_ns();
+		do {
+			cnd_wait(&queue->not_full, &queue->lock);
+		} while(queue->count == queue->capacity);
+		queue->producer_stall_ns += monotonic_ns() - start;
+	}
+	queue->fds[(queue->head + queue->count) % queue->capacity] = fd;
+	++queue->count;
+	cnd_signal(&queue->not_empty);
+	mtx_unlock(&queue->lock);
+}
+
+// Returns the next file, blocking while the queue is empty, or -1 once the
+// queue is empty and closed.
+static int file_queue_pop(struct file_queue *queue) {
+	mtx_lock(&queue->lock);
+	if(!queue->count && !queue->closed) {
+		uint64_t start = monotonic_ns();
+		do {
+			cnd_wait(&queue->not_empty, &queue->lock);
+		} while(!queue->count && !queue->closed);
+		queue->consumer_stall_ns += monotonic_ns() - start;
+	}
+	int fd = -1;
+	if(queue->count) {
+		fd = queue->fds[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		--queue->count;
+		cnd_signal(&queue->not_full);
+	}
+	mtx_unlock(&queue->lock);
+	return fd;
+}
+
+static void file_queue_close(struct file_queue *queue) {
+	mtx_lock(&queue->lock);
+	queue->closed = true;
+	cnd_broadcast(&queue->not_empty);
+	mtx_unlock(&queue->lock);
+}
+
+struct walk;
+
+// Regular files found by the scan, waiting to be opened and examined
+// together through io_uring. The names point into the getdents64 buffer of
+// the directory on top of the stack, so the batch must be flushed before that
+// buffer is refilled and before descending into another directory.
+struct file_batch {
+	size_t count;
+	int dir_fd;
+	const char *names[URING_BATCH];
+	int fds[URING_BATCH];
+	int results[URING_BATCH];
+	struct statx stats[URING_BATCH];
+
+	// While the batch is being dealt with, the directory it was read from
+	// must stay on top of the stack, so any entries that turn out to be
+	// directories after all are kept here and only entered afterwards.
+	bool deferring;
+	size_t directory_count;
+	struct stack_entry directories[URING_BATCH];
+};
+
+// What is known about a device number that has already been seen. Each
+// subvolume has its own device number, so there are usually only a handful.
+struct device_info {
+	uint32_t dev_major, dev_minor;
+	bool btrfs;
+
+	// Whether the filesystem ID has been checked (which is only done for
+	// directories), and if so, whether it is the filesystem being walked.
+	bool fsid_known;
+	bool same_filesystem;
+};
+
+struct device_cache {
+	struct device_info *devices;
+	size_t count, capacity;
+};
+
+static struct device_info *device_cache_find(struct device_cache *cache, uint32_t dev_major, uint32_t dev_minor) {
+	for(size_t i = 0; i != cache->count; ++i) {
+		if(cache->devices[i].dev_major == dev_major && cache->devices[i].dev_minor == dev_minor) {
+			return &cache->devices[i];
 		}
 	}
+	return 0;
+}
 
-	// Now that we have a handle to the file which is race-proof and cannot be
-	// swapped out with any other file from under us, get information about the
-	// file.
-	struct statx statbuf;
-	if(statx(path_fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_INO, &statbuf) < 0) {
-		show_path_errno(stack, name, current_line_width);
-		close(path_fd);
+static struct device_info *device_cache_add(struct device_cache *cache, uint32_t dev_major, uint32_t dev_minor, bool btrfs) {
+	if(cache->count == cache->capacity) {
+		size_t new_capacity = cache->capacity ? cache->capacity * 2 : 8;
+		struct device_info *new_devices = realloc(cache->devices, new_capacity * sizeof(*new_devices));
+		if(!new_devices) {
+			return 0;
+		}
+		cache->devices = new_devices;
+		cache->capacity = new_capacity;
+	}
+	struct device_info *info = &cache->devices[cache->count++];
+	*info = (struct device_info) {
+		.dev_major = dev_major,
+		.dev_minor = dev_minor,
+		.btrfs = btrfs,
+		.fsid_known = false,
+		.same_filesystem = false,
+	};
+	return info;
+}
+
+// Counts of the system calls made by a worker while scanning, for the
+// summary. Operations submitted through io_uring are counted only as
+// submissions.
+struct syscall_counts {
+	uint64_t opens;
+	uint64_t reopens;
+	uint64_t statxs;
+	uint64_t fstatfses;
+	uint64_t fs_infos;
+	uint64_t ring_submissions;
+};
+
+struct worker {
+	struct walk *walk;
+	struct stack stack;
+	struct deque deque;
+	bool ok;
+	thrd_t thread;
+	struct device_cache devices;
+	struct syscall_counts calls;
+
+	// If use_ring is set, regular files are opened and examined in batches.
+	bool use_ring;
+	struct uring ring;
+	struct file_batch *batch;
+};
+
+struct defragmenter {
+	struct walk *walk;
+	bool ok;
+	thrd_t thread;
+};
+
+// A file found to be fragmented while building the index for a time-budgeted
+// run, or a subvolume root directory, identified so that it can be reopened by
+// handle later. A root’s fragmentation is not measured.
+struct candidate {
+	uint64_t subvolume;
+	uint64_t inode;
+	uint64_t bytes;
+	uint64_t fragments;
+	uint32_t generation;
+	bool root;
+};
+
+struct candidate_index {
+	mtx_t lock;
+	struct candidate *candidates;
+	size_t count, capacity;
+};
+
+// A writable subvolume to be scanned as a unit, and the path to display for
+// its root directory.
+struct subvolume_unit {
+	uint64_t id;
+	char *path;
+};
+
+struct walk {
+	const struct defrag_options *options;
+	uint8_t fsid[BTRFS_FSID_SIZE];
+	struct reporter reporter;
+	struct worker *workers;
+
+	// An O_PATH descriptor to /proc/self/fd, relative to which O_PATH
+	// descriptors are reopened.
+	int proc_fd_dir;
+
+	// When scanning by subvolume, the writable subvolumes to scan; an idle
+	// worker takes the next one when there is nothing to steal.
+	const char *mountpoint;
+	int mount_fd;
+	struct subvolume_unit *units;
+	size_t unit_count;
+	atomic_size_t next_unit;
+	unsigned int worker_count;
+
+	// If pipelining is enabled, regular files go through this queue rather
+	// than being defragmented by the scanning worker.
+	bool pipelined;
+	struct file_queue files;
+	uint64_t scan_stall_ns;
+	uint64_t defragment_stall_ns;
+
+	// The idle lock protects running and the idle condition variable. idle is
+	// also read without the lock as a hint of whether it is worth publishing
+	// tasks; queued counts tasks sitting in any deque.
+	mtx_t idle_lock;
+	cnd_t idle_cond;
+	unsigned int running;
+	atomic_uint idle;
+	atomic_size_t queued;
+
+	// With a time budget, regular files are only measured and added to the
+	// index during the scan, and defragmented afterwards in priority order
+	// until the deadline.
+	bool indexing;
+	uint64_t deadline_ns;
+
+	// Set when a termination signal arrives, asking everything to stop at
+	// the next file or window. checkpoint_failed is set if progress through
+	// a file could not be saved. rewriting is set once the disks may be kept
+	// busy; see begin_rewriting.
+	atomic_bool cancelled;
+	atomic_bool rewriting;
+	atomic_bool checkpoint_failed;
+
+	// If paced is set, the bytes given to each defragment call are limited
+	// by the pacer; paced_ns is the total time spent waiting for it.
+	bool paced;
+	struct pacer pacer;
+	atomic_uint_least64_t paced_ns;
+	struct candidate_index index;
+	atomic_size_t next_candidate;
+	atomic_uint_least64_t fragments_fixed;
+
+	// Statistics about regular files, for the summary.
+	atomic_uint_least64_t files_examined;
+	atomic_uint_least64_t files_skipped;
+	atomic_uint_least64_t files_defragmented;
+	atomic_uint_least64_t small_extent_bytes;
+
+	// Statistics about recompression, for the summary; the byte counts are
+	// disk space used by recompressed files before and after.
+	// recompress_failed is set, and no more files are recompressed, if the
+	// disk space used by a file cannot be measured; the error has already
+	// been reported.
+	atomic_bool recompress_failed;
+	atomic_uint_least64_t files_recompressed;
+	atomic_uint_least64_t files_incompressible;
+	atomic_uint_least64_t recompress_bytes_before;
+	atomic_uint_least64_t recompress_bytes_after;
+};
+
+struct snapshot_cookie {
+	struct stack_entry *entries;
+	size_t count;
+	bool ok;
+};
+
+static bool snapshot_impl(struct stack_entry *e, void *cookie_raw) {
+	struct snapshot_cookie *cookie = cookie_raw;
+	struct stack_entry *copy = &cookie->entries[cookie->count];
+	copy->dev_major = e->dev_major;
+	copy->dev_minor = e->dev_minor;
+	copy->inode = e->inode;
+	copy->fd = -1;
+	copy->name_len = e->name_len;
+	copy->name = strndup(e->name, e->name_len);
+	if(!copy->name) {
+		perror("strndup");
+		cookie->ok = false;
 		return false;
 	}
-	if((statbuf.stx_mask & (STATX_TYPE | STATX_INO)) != (STATX_TYPE | STATX_INO)) {
-		show_path_error(stack, name, current_line_width, "statx returned with required information missing");
-		close(path_fd);
+	++cookie->count;
+	return true;
+}
+
+static bool count_impl(struct stack_entry *e, void *count_raw) {
+	(void) e;
+	++*(size_t *) count_raw;
+	return true;
+}
+
+static bool should_publish(const struct worker *worker) {
+	const struct walk *walk = worker->walk;
+	return atomic_load(&walk->queued) < atomic_load(&walk->idle);
+}
+
+// Makes a directory, which would otherwise have been pushed onto the worker’s
+// own stack, available to other workers. On success, takes ownership of the
+// entry’s descriptor.
+static bool publish(struct worker *worker, const struct stack_entry *e) {
+	struct walk *walk = worker->walk;
+	struct task *task = malloc(sizeof(*task));
+	if(!task) {
+		perror("malloc");
 		return false;
 	}
-	struct statfs statfsbuf;
-	if(fstatfs(path_fd, &statfsbuf) < 0) {
-		show_path_errno(stack, name, current_line_width);
-		close(path_fd);
+	task->entry = *e;
+	task->entry.name = strndup(e->name, e->name_len);
+	if(!task->entry.name) {
+		perror("strndup");
+		free(task);
 		return false;
 	}
-
-	// If this file isn’t on a btrfs filesystem, skip it. It might be a mount
-	// point of some other filesystem type, an unmounted automount point, or
-	// something like that. In any case, if it’s not btrfs, we can’t defragment
-	// it. But it’s not an error.
-	if(statfsbuf.f_type != BTRFS_SUPER_MAGIC) {
-		close(path_fd);
-		return true;
+	size_t depth = 0;
+	stack_foreach_up(&worker->stack, &count_impl, &depth);
+	struct snapshot_cookie cookie = {
+		.entries = malloc(depth * sizeof(*cookie.entries)),
+		.count = 0,
+		.ok = true,
+	};
+	if(!cookie.entries) {
+		perror("malloc");
+		free((char *) task->entry.name);
+		free(task);
+		return false;
 	}
-
-	// If this is neither a file nor a directory (e.g. it’s a symlink, or a
-	// named pipe, or a device node, or a UNIX-domain socket, or something else
-	// weird), don’t touch it at all. Such things can be problematic or
-	// dangerous to actually open, and anyway they can’t be defragmented.
-	if(!S_ISDIR(statbuf.stx_mode) && !S_ISREG(statbuf.stx_mode)) {
-		close(path_fd);
-		return true;
+	stack_foreach_up(&worker->stack, &snapshot_impl, &cookie);
+	task->ancestors = cookie.entries;
+	task->ancestor_count = cookie.count;
+	if(!cookie.ok) {
+		task->entry.fd = -1;
+		task_free(task);
+		return false;
 	}
 
-	// Now that we know it’s a regular file or directory, it’s safe to actually
-	// open it. We can’t go back to the name, because someone could have
-	// swapped it out after the first openat call. However, we can use
-	// /proc/self/fd/foo to open a non-O_PATH copy of an O_PATH file
-	// descriptor.
-	//
-	// Do not use O_NONBLOCK. For regular files, the only difference relates to
-	// file leases. Since even an O_NONBLOCK open causes initiation of a lease
-	// downgrade, using O_NONBLOCK would not reduce our impact on other
-	// applications; consequently, we might as well do a blocking-open and then
-	// we can actually defragment the file once we get it open.
-	int file_fd;
-	{
-		char buffer[64];
-		sprintf(buffer, "/proc/self/fd/%d", path_fd);
-		file_fd = open(buffer, O_RDONLY | O_NOATIME);
+	mtx_lock(&worker->deque.lock);
+	bool ok = deque_push_bottom(&worker->deque, task);
+	if(ok) {
+		atomic_fetch_add(&walk->queued, 1);
 	}
-	if(file_fd < 0) {
-		show_path_errno(stack, name, current_line_width);
-		close(path_fd);
+	mtx_unlock(&worker->deque.lock);
+	if(!ok) {
+		task->entry.fd = -1;
+		task_free(task);
 		return false;
 	}
 
-	// No need to keep the path FD around any more now that we have a real file
-	// FD.
-	close(path_fd);
+	mtx_lock(&walk->idle_lock);
+	cnd_signal(&walk->idle_cond);
+	mtx_unlock(&walk->idle_lock);
+	return true;
+}
 
-	// Check if we have hit a loop.
-	if(S_ISDIR(statbuf.stx_mode)) {
-		struct loop_check check = {
-			.dev_major = statbuf.stx_dev_major,
-			.dev_minor = statbuf.stx_dev_minor,
-			.inode = statbuf.stx_ino,
-			.loop_found = false,
-		};
-		stack_foreach_down(stack, &check_loop, &check);
-		if(check.loop_found) {
-			show_path_error(stack, name, current_line_width, "filesystem loop detected");
-			close(file_fd);
-			return false;
+// Defragments part of an open file or subvolume root, returning zero on
+// success or an errno value on failure. If compress_type is nonzero, the data
+// is also compressed with that algorithm as it is rewritten, and writeback is
+// started straight away.
+static int defragment_range(int fd, uint64_t start, uint64_t len, uint32_t compress_type) {
+	struct btrfs_ioctl_defrag_range_args args = {
+		.start = start,
+		.len = len,
+		.flags = compress_type ? BTRFS_DEFRAG_RANGE_COMPRESS | BTRFS_DEFRAG_RANGE_START_IO : 0,
+		.extent_thresh = EXTENT_THRESHOLD,
+		.compress_type = compress_type,
+	};
+	if(ioctl(fd, BTRFS_IOC_DEFRAG_RANGE, &args) < 0) {
+		// Defragmentation of files in read-only subvolumes fails with EROFS.
+		// We could check this ahead of time, but just letting the defragment
+		// ioctl fail is harmless. Unfortunately we can’t prune the entire
+		// subtree when we hit the root of a read-only subvolume, because it’s
+		// possible to create a subvolume foo, create a subvolume foo/bar, and
+		// then use “btrfs property” to make foo read-only while leaving
+		// foo/bar read-write, in which case we need to find and defragment
+		// foo/bar and its contents. (With --defrag-subvolumes, read-only
+		// subvolumes are never scanned at all; see run_subvolumes.)
+		//
+		// This does mean we won’t print any error messages if you try to
+		// defragment a read-only mount (i.e. one mounted with the “ro” mount
+		// option), but that’s not going to be a problem in any real-life
+		// scenario (either you know your mount is read-only and probably
+		// aren’t running maintenance on it, or you don’t know and you have
+		// other bigger problems anyway).
+		if(errno != EROFS) {
+			return errno;
 		}
 	}
+	return 0;
+}
 
-	// If this is the top-level directory, populate fsid now that we have an
-	// open descriptor.
-	if(stack_empty(stack)) {
-		struct btrfs_ioctl_fs_info_args args;
-		if(ioctl(file_fd, BTRFS_IOC_FS_INFO, &args) < 0) {
-			show_path_errno(stack, name, current_line_width);
-			close(file_fd);
-			return false;
-		}
-		memcpy(*fsid, args.fsid, BTRFS_FSID_SIZE);
+// Waits, before the first defragment ioctl, until the caller says the disks
+// may be kept busy, so that the scan can run alongside other steps while the
+// defragment stage does not. Returns false if a termination signal arrived
+// meanwhile, in which case everything is asked to stop.
+static bool begin_rewriting(struct walk *walk) {
+	if(!walk->options->wait_for_disks || atomic_load(&walk->rewriting)) {
+		return true;
 	}
-
-	// Check if we are crossing into a different filesystem (*NOT* just a
-	// different subvolume; we want to recur there).
-	bool new_device_number = stack_empty(stack) || statbuf.stx_dev_major != stack_peek(stack)->dev_major || statbuf.stx_dev_minor != stack_peek(stack)->dev_minor;
-	if(S_ISDIR(statbuf.stx_mode) && !stack_empty(stack) && new_device_number) {
-		// Device differs, so this is *either* a new subvolume *or* a new
-		// filesystem.
-		if(statbuf.stx_ino == 2) {
-			// Inode 2 is a special thing called
-			// BTRFS_EMPTY_SUBVOL_DIR_OBJECTID. It is a bit like a subvolume in
-			// that it has a distinct device number, but it can never contain
-			// any files. One way to get an EMPTY_SUBVOL is to snapshot a
-			// subvolume that hierarchically contains a second subvolume;
-			// wherever the inner subvolume appeared in the source, an
-			// EMPTY_SUBVOL will appear in the snapshot.
-			//
-			// Almost nothing works on it in terms of btrfs ioctls, even those
-			// that normally work on any file or directory. However, since it
-			// doesn’t actually contain anything, we’re also totally fine
-			// ignoring it.
-			close(file_fd);
-			return true;
-		}
-		struct btrfs_ioctl_fs_info_args args;
-		if(ioctl(file_fd, BTRFS_IOC_FS_INFO, &args) < 0) {
-			show_path_errno(stack, name, current_line_width);
-			close(file_fd);
-			return false;
-		}
-		if(memcmp(args.fsid, *fsid, BTRFS_FSID_SIZE)) {
-			// We’ve crossed a mount point into a different btrfs filesystem.
-			close(file_fd);
-			return true;
-		}
+	if(atomic_load(&walk->cancelled)) {
+		return false;
+	}
+	if(!walk->options->wait_for_disks(walk->options->wait_for_disks_arg)) {
+		atomic_store(&walk->cancelled, true);
+		return false;
 	}
+	atomic_store(&walk->rewriting, true);
+	return true;
+}
 
-	// If this is a file or the top-level directory of a subvolume (but not any
-	// other directory), defragment it.
-	bool ok = true;
-	if(S_ISREG(statbuf.stx_mode) || new_device_number) {
-		struct btrfs_ioctl_defrag_range_args args = {
-			.len = (uint64_t) -1,
-			.extent_thresh = EXTENT_THRESHOLD,
-		};
-		if(ioctl(file_fd, BTRFS_IOC_DEFRAG_RANGE, &args) < 0) {
-			// Defragmentation of files in read-only subvolumes fails with
-			// EROFS. We could check this ahead of time, but just letting the
-			// defragment ioctl fail is harmless. Unfortunately we can’t prune
-			// the entire subtree when we hit the root of a read-only
-			// subvolume, because it’s possible to create a subvolume foo,
-			// create a subvolume foo/bar, and then use “btrfs property” to
-			// make foo read-only while leaving foo/bar read-write, in which
-			// case we need to find and defragment foo/bar and its contents.
-			//
-			// This does mean we won’t print any error messages if you try to
-			// defragment a read-only mount (i.e. one mounted with the “ro”
-			// mount option), but that’s not going to be a problem in any
-			// real-life scenario (either you know your mount is read-only and
-			// probably aren’t running maintenance on it, or you don’t know and
-			// you have other bigger problems anyway).
-			if(errno != EROFS) {
-				show_path_errno(stack, name, current_line_width);
-				ok = false;
-			}
-		}
+// Defragments all of an open file or subvolume root, unless asked to stop.
+static int defragment(struct walk *walk, int fd) {
+	if(!begin_rewriting(walk)) {
+		return 0;
 	}
+	return defragment_range(fd, 0, (uint64_t) -1, 0);
+}
 
-	// If this is a directory, push it on the stack to scan. Otherwise, close
-	// it.
-	if(S_ISDIR(statbuf.stx_mode)) {
-		struct stack_entry e = {
-			.dev_major = statbuf.stx_dev_major,
-			.dev_minor = statbuf.stx_dev_minor,
-			.inode = statbuf.stx_ino,
-		};
-		e.name = strdup(name);
-		if(e.name) {
-			// Strip trailing slashes, which will only be present for the
-			// top-level (potentially) so the printed path looks nicer.
-			{
-				size_t len = strlen(e.name);
-				while(len && e.name[len - 1] == '/') {
-					--len;
-				}
-				e.name[len] = '\0';
-			}
+struct fragmentation {
+	// The total size of the extents considered.
+	uint64_t bytes;
 
-			e.dir_handle = fdopendir(file_fd);
-			if(e.dir_handle) {
-				if(stack_push(stack, &e)) {
-					// All good.
-					if(verbose) {
-						// Need to give some kind of progress indication. Just
-						// print the directories as we enter them. But don’t do
-						// it too often.
-						clock_t now = clock();
-						if(*last_progress_time == (clock_t) -1 || now == (clock_t) -1 || now - *last_progress_time >= (CLOCKS_PER_SEC / (1000 / MILLISECONDS_PER_PROGRESS))) {
-							clear_line(current_line_width);
-							print_path(stack, 0, current_line_width, stdout);
-							putchar('\r');
-							fflush(stdout);
-							*last_progress_time = now;
-						}
-					}
-				} else {
-					free(e.name);
-					closedir(e.dir_handle);
+	// The number of places where consecutive extents are not physically
+	// adjacent and at least one of them is small enough for defragmentation
+	// to consider moving it.
+	uint64_t fragments;
+
+	// The total size of extents small enough for defragmentation to consider
+	// moving them.
+	uint64_t small_bytes;
+};
+
+// Measures how fragmented a file is using FIEMAP, returning zero on success or
+// an errno value on failure.
+static int measure_fragmentation(int fd, struct fragmentation *result) {
+	uint64_t buffer[(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+	struct fiemap *map = (struct fiemap *) buffer;
+	result->bytes = 0;
+	result->fragments = 0;
+	result->small_bytes = 0;
+	bool have_previous = false;
+	bool previous_small = false;
+	uint64_t previous_end = 0;
+	uint64_t start = 0;
+	for(;;) {
+		memset(map, 0, sizeof(*map));
+		map->fm_start = start;
+		map->fm_length = FIEMAP_MAX_OFFSET - start;
+		map->fm_extent_count = FIEMAP_BATCH;
+		if(ioctl(fd, FS_IOC_FIEMAP, map) < 0) {
+			return errno;
+		}
+		if(!map->fm_mapped_extents) {
+			return 0;
+		}
+		for(uint32_t i = 0; i != map->fm_mapped_extents; ++i) {
+			const struct fiemap_extent *e = &map->fm_extents[i];
+			// Extents that have no location yet (or have it mixed in with
+			// metadata) are not something defragmentation can improve.
+			if(!(e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))) {
+				bool small = e->fe_length < EXTENT_THRESHOLD;
+				result->bytes += e->fe_length;
+				if(small) {
+					result->small_bytes += e->fe_length;
 				}
-			} else {
-				show_path_errno(stack, name, current_line_width);
-				ok = false;
-				free(e.name);
-				close(file_fd);
+				if(have_previous && e->fe_physical != previous_end && (small || previous_small)) {
+					++result->fragments;
+				}
+				have_previous = true;
+				previous_small = small;
+				previous_end = e->fe_physical + e->fe_length;
+			}
+			if(e->fe_flags & FIEMAP_EXTENT_LAST) {
+				return 0;
 			}
-		} else {
-			perror("strdup");
-			ok = false;
-			close(file_fd);
 		}
-	} else {
-		close(file_fd);
+		const struct fiemap_extent *last = &map->fm_extents[map->fm_mapped_extents - 1];
+		start = last->fe_logical + last->fe_length;
 	}
+}
 
-	return ok;
+// Returns whether to stop early, because of a termination signal or because
+// the time budget, if any, has run out.
+static bool should_stop(const struct walk *walk) {
+	return atomic_load(&walk->cancelled) || (walk->deadline_ns && monotonic_ns() >= walk->deadline_ns);
 }
 
-bool do_defrag(const char *mountpoint, bool verbose) {
-	if(verbose) {
-		printf("Defragment %s:\n", mountpoint);
+// Reads the subvolume ID, inode number, and generation of an open file from
+// its file handle, returning zero on success or an errno value on failure.
+static int identify_file(int fd, uint64_t *subvolume, uint64_t *inode, uint32_t *generation) {
+	uint64_t storage[(sizeof(struct file_handle) + BTRFS_FID_SIZE_CONNECTABLE_ROOT + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+	struct file_handle *handle = (struct file_handle *) storage;
+	handle->handle_bytes = BTRFS_FID_SIZE_CONNECTABLE_ROOT;
+	int mount_id;
+	if(name_to_handle_at(fd, "", handle, &mount_id, AT_EMPTY_PATH) < 0) {
+		return errno;
 	}
-	struct stack stack;
-	stack_init(&stack);
-	uint8_t fsid[BTRFS_FSID_SIZE];
-	size_t current_line_width = 0;
-	clock_t last_progress_time = (clock_t) -1;
-	bool ok = process(AT_FDCWD, mountpoint, &stack, &fsid, verbose, &current_line_width, &last_progress_time);
-	while(!stack_empty(&stack)) {
-		struct stack_entry *e = stack_peek(&stack);
-		errno = 0;
-		struct dirent *de = readdir(e->dir_handle);
-		if(de) {
-			// Skip things other than files or directories. This is only an
-			// optimization; process() will also do a proper race-free check.
-			if(de->d_type == DT_DIR || de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
-				// Skip the . and .. entries.
-				if(strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
-					ok &= process(dirfd(e->dir_handle), de->d_name, &stack, &fsid, verbose, &current_line_width, &last_progress_time);
-				}
-			}
-		} else if(errno) {
-			show_path_errno(&stack, 0, &current_line_width);
-			stack_pop(&stack);
-		} else {
-			// No more entries.
-			stack_pop(&stack);
-		}
+	if(handle->handle_type < FILEID_BTRFS_WITHOUT_PARENT || handle->handle_type > FILEID_BTRFS_WITH_PARENT_ROOT || handle->handle_bytes < BTRFS_FID_SIZE_NON_CONNECTABLE) {
+		return EOPNOTSUPP;
 	}
-	stack_deinit(&stack);
+	memcpy(inode, handle->f_handle, sizeof(*inode));
+	memcpy(subvolume, handle->f_handle + 8, sizeof(*subvolume));
+	memcpy(generation, handle->f_handle + 16, sizeof(*generation));
+	return 0;
+}
 
-	// If we were displaying progress, print an empty line to avoid terminal
-	// corruption.
-	if(verbose) {
+// Waits as long as the pacer says before defragmenting a range of the given
+// size, in slices so that a request to stop is noticed. Returns false if asked
+// to stop.
+static bool pace(struct walk *walk, uint64_t bytes) {
+	static const uint64_t SLICE_NS = 100000000;
+	if(!walk->paced) {
+		return true;
+	}
+	uint64_t wait_ns = pacer_charge(&walk->pacer, bytes);
+	atomic_fetch_add(&walk->paced_ns, wait_ns);
+	while(wait_ns) {
+		if(should_stop(walk)) {
+			return false;
+		}
+		uint64_t slice_ns = wait_ns < SLICE_NS ? wait_ns : SLICE_NS;
+		struct timespec delay = {
+			.tv_sec = 0,
+			.tv_nsec = (long) slice_ns,
+		};
+		nanosleep(&delay, 0);
+		wait_ns -= slice_ns;
+	}
+	return true;
+}
+
+// Defragments a regular file, pacing it if asked to, and compressing it if
+// compress_type is nonzero. A file bigger than the window size is done one
+// window at a time, stopping between windows if asked to and remembering in
+// the state file where it got to, so that an interrupted run carries on from
+// there next time. Returns zero on success, ECANCELED if stopped, or another
+// errno value on failure.
+static int defragment_windowed(struct walk *walk, int fd, uint32_t compress_type) {
+	if(!begin_rewriting(walk)) {
+		return ECANCELED;
+	}
+	uint64_t window = (uint64_t) walk->options->window_mib * 1024 * 1024;
+	if(!window && !walk->paced) {
+		return defragment_range(fd, 0, (uint64_t) -1, compress_type);
+	}
+	struct stat statbuf;
+	if(fstat(fd, &statbuf) < 0) {
+		return errno;
+	}
+	uint64_t size = (uint64_t) statbuf.st_size;
+	if(!window || size <= window) {
+		// The pacer is charged with the whole size, since defragmentation
+		// may rewrite any of it.
+		if(!pace(walk, size)) {
+			return ECANCELED;
+		}
+		return defragment_range(fd, 0, (uint64_t) -1, compress_type);
+	}
+
+	uint64_t subvolume, inode;
+	uint32_t generation;
+	int err = identify_file(fd, &subvolume, &inode, &generation);
+	if(err) {
+		return err;
+	}
+	char fsid_string[FSID_STRING_SIZE];
+	format_fsid(walk->fsid, fsid_string);
+	char key[128];
+	sprintf(key, "defrag.offset.%s.%" PRIu64 ".%" PRIu64 ".%" PRIu32, fsid_string, subvolume, inode, generation);
+	uint64_t start = 0;
+	state_get_u64(key, &start);
+	while(start < size) {
+		if(should_stop(walk) || !pace(walk, size - start < window ? size - start : window)) {
+			return ECANCELED;
+		}
+		err = defragment_range(fd, start, window, compress_type);
+		if(err) {
+			return err;
+		}
+		start += window;
+		if(start < size && !atomic_load(&walk->checkpoint_failed)) {
+			if(!state_set_u64(key, start) || !state_save()) {
+				atomic_store(&walk->checkpoint_failed, true);
+			}
+		}
+	}
+	state_remove(key);
+	return 0;
+}
+
+struct extent_usage_cookie {
+	uint64_t inode;
+
+	// The disk space used by the file’s data, counting only the referenced
+	// part of each extent, and how much of it is not compressed.
+	uint64_t disk_bytes;
+	uint64_t uncompressed_bytes;
+};
+
+static bool extent_usage_impl(const struct btrfs_ioctl_search_header *header, const void *item, void *cookie_raw) {
+	static const size_t INLINE_DATA_START = offsetof(struct btrfs_file_extent_item, disk_bytenr);
+	struct extent_usage_cookie *cookie = cookie_raw;
+	if(header->objectid != cookie->inode || header->type != BTRFS_EXTENT_DATA_KEY || header->len < INLINE_DATA_START) {
+		return true;
+	}
+	struct btrfs_file_extent_item extent;
+	memcpy(&extent, item, header->len < sizeof(extent) ? header->len : sizeof(extent));
+	if(extent.type == BTRFS_FILE_EXTENT_INLINE) {
+		cookie->disk_bytes += header->len - INLINE_DATA_START;
+		if(!extent.compression) {
+			cookie->uncompressed_bytes += header->len - INLINE_DATA_START;
+		}
+		return true;
+	}
+	if(header->len < sizeof(extent) || !extent.disk_bytenr) {
+		// A hole takes no space.
+		return true;
+	}
+	uint64_t num_bytes = le64toh(extent.num_bytes);
+	if(extent.compression) {
+		// A compressed extent may be only partly referenced, so count its
+		// disk space in proportion.
+		uint64_t ram_bytes = le64toh(extent.ram_bytes);
+		uint64_t disk_num_bytes = le64toh(extent.disk_num_bytes);
+		cookie->disk_bytes += ram_bytes ? disk_num_bytes * num_bytes / ram_bytes : disk_num_bytes;
+	} else {
+		cookie->disk_bytes += num_bytes;
+		cookie->uncompressed_bytes += num_bytes;
+	}
+	return true;
+}
+
+// Measures the disk space used by a file’s data from its extent items.
+static bool measure_extent_usage(const struct walk *walk, int fd, uint64_t subvolume, uint64_t inode, struct extent_usage_cookie *usage) {
+	const struct btrfs_ioctl_search_key key = {
+		.tree_id = subvolume,
+		.min_objectid = inode,
+		.max_objectid = inode,
+		.min_type = BTRFS_EXTENT_DATA_KEY,
+		.max_type = BTRFS_EXTENT_DATA_KEY,
+		.min_offset = 0,
+		.max_offset = UINT64_MAX,
+		.min_transid = 0,
+		.max_transid = UINT64_MAX,
+	};
+	usage->inode = inode;
+	usage->disk_bytes = 0;
+	usage->uncompressed_bytes = 0;
+	return for_each_tree_item(walk->mountpoint, fd, &key, &extent_usage_impl, usage);
+}
+
+// Estimates whether a file is worth compressing from the byte entropy of a
+// few blocks spread through it, much as the kernel’s own heuristic does for
+// each range it writes. Returns zero on success or an errno value on failure.
+static int estimate_compressible(int fd, uint64_t size, bool *compressible) {
+	unsigned char sample[COMPRESSION_SAMPLE_SIZE];
+	uint64_t counts[256] = {0};
+	uint64_t total = 0;
+	for(unsigned int i = 0; i != COMPRESSION_SAMPLES; ++i) {
+		uint64_t offset = size > sizeof(sample) ? (size - sizeof(sample)) / (COMPRESSION_SAMPLES - 1) * i : 0;
+		ssize_t got = pread(fd, sample, sizeof(sample), (off_t) offset);
+		if(got < 0) {
+			return errno;
+		}
+		for(ssize_t j = 0; j != got; ++j) {
+			++counts[sample[j]];
+		}
+		total += (uint64_t) got;
+	}
+	double entropy = 0;
+	for(unsigned int i = 0; i != 256; ++i) {
+		if(counts[i]) {
+			double p = (double) counts[i] / (double) total;
+			entropy -= p * log2(p);
+		}
+	}
+	*compressible = total && entropy < COMPRESSIBLE_ENTROPY;
+	return 0;
+}
+
+// Whether and how a file is to be recompressed.
+struct recompression {
+	bool chosen;
+	uint64_t subvolume;
+	uint64_t inode;
+	uint64_t disk_bytes;
+};
+
+// Decides whether to recompress a regular file: it must be old and big
+// enough, have some data not yet compressed, and look compressible. Returns
+// zero on success or an errno value on failure.
+static int choose_recompression(struct walk *walk, int fd, struct recompression *result) {
+	const struct defrag_options *options = walk->options;
+	result->chosen = false;
+	if(!options->compress_type || atomic_load(&walk->recompress_failed)) {
+		return 0;
+	}
+	struct stat statbuf;
+	if(fstat(fd, &statbuf) < 0) {
+		return errno;
+	}
+	uint64_t size = (uint64_t) statbuf.st_size;
+	time_t now = time(0);
+	if(size < (uint64_t) options->compress_min_kib * 1024 || (now - statbuf.st_mtime) / (24 * 60 * 60) < (time_t) options->compress_min_age_days) {
+		return 0;
+	}
+	uint32_t generation;
+	int err = identify_file(fd, &result->subvolume, &result->inode, &generation);
+	if(err) {
+		return err;
+	}
+	struct extent_usage_cookie usage;
+	if(!measure_extent_usage(walk, fd, result->subvolume, result->inode, &usage)) {
+		atomic_store(&walk->recompress_failed, true);
+		return 0;
+	}
+	if(!usage.uncompressed_bytes) {
+		return 0;
+	}
+	bool compressible;
+	err = estimate_compressible(fd, size, &compressible);
+	if(err) {
+		return err;
+	}
+	if(!compressible) {
+		atomic_fetch_add(&walk->files_incompressible, 1);
+		return 0;
+	}
+	result->chosen = true;
+	result->disk_bytes = usage.disk_bytes;
+	return 0;
+}
+
+// Defragments a regular file, recompressing it if it was chosen for that and
+// then waiting for the data to reach the disk so that the space saved can be
+// measured. Returns as defragment_windowed does. A file stopped part way is
+// neither waited for nor counted, since only some of it was recompressed.
+static int defragment_recompressing(struct walk *walk, int fd, const struct recompression *recompression) {
+	if(!recompression->chosen) {
+		return defragment_windowed(walk, fd, 0);
+	}
+	int err = defragment_windowed(walk, fd, walk->options->compress_type);
+	if(err) {
+		return err;
+	}
+	if(fdatasync(fd) < 0) {
+		return errno;
+	}
+	struct extent_usage_cookie usage;
+	if(!measure_extent_usage(walk, fd, recompression->subvolume, recompression->inode, &usage)) {
+		atomic_store(&walk->recompress_failed, true);
+		return 0;
+	}
+	atomic_fetch_add(&walk->files_recompressed, 1);
+	atomic_fetch_add(&walk->recompress_bytes_before, recompression->disk_bytes);
+	atomic_fetch_add(&walk->recompress_bytes_after, usage.disk_bytes);
+	return 0;
+}
+
+// Adds a candidate to the index, returning zero on success or an errno value
+// on failure.
+static int add_candidate(struct walk *walk, const struct candidate *c) {
+	struct candidate_index *index = &walk->index;
+	int err = 0;
+	mtx_lock(&index->lock);
+	if(index->count == index->capacity) {
+		size_t new_capacity = index->capacity ? index->capacity * 2 : 1024;
+		struct candidate *new_candidates = realloc(index->candidates, new_capacity * sizeof(*new_candidates));
+		if(new_candidates) {
+			index->candidates = new_candidates;
+			index->capacity = new_capacity;
+		} else {
+			err = errno;
+		}
+	}
+	if(!err) {
+		index->candidates[index->count++] = *c;
+	}
+	mtx_unlock(&index->lock);
+	return err;
+}
+
+// Measures an open regular file and, if it is fragmented enough, adds it to the
+// index, returning zero on success or an errno value on failure.
+static int index_file(struct walk *walk, int fd) {
+	atomic_fetch_add(&walk->files_examined, 1);
+	struct fragmentation frag;
+	int err = measure_fragmentation(fd, &frag);
+	if(err) {
+		return err;
+	}
+	uint64_t min_fragments = walk->options->min_fragments ? walk->options->min_fragments : 1;
+	if(frag.fragments < min_fragments) {
+		atomic_fetch_add(&walk->files_skipped, 1);
+		return 0;
+	}
+
+	// The identity is needed to reopen the file later without keeping a
+	// descriptor or path.
+	struct candidate c = {
+		.bytes = frag.bytes,
+		.fragments = frag.fragments,
+		.root = false,
+	};
+	err = identify_file(fd, &c.subvolume, &c.inode, &c.generation);
+	if(err) {
+		return err;
+	}
+	return add_candidate(walk, &c);
+}
+
+// Defragments an open subvolume root directory or, while building the index,
+// adds it to the index to be defragmented with the files. Returns zero on
+// success or an errno value on failure.
+static int defragment_root(struct walk *walk, int fd) {
+	if(!walk->indexing) {
+		return defragment(walk, fd);
+	}
+	struct candidate c = {
+		.bytes = 0,
+		.fragments = 0,
+		.root = true,
+	};
+	int err = identify_file(fd, &c.subvolume, &c.inode, &c.generation);
+	if(err) {
+		return err;
+	}
+	return add_candidate(walk, &c);
+}
+
+// Defragments an open regular file unless it is already contiguous enough,
+// returning zero on success or an errno value on failure. When building an
+// index, only measures it instead.
+static int defragment_file(struct walk *walk, int fd) {
+	if(walk->indexing) {
+		return index_file(walk, fd);
+	}
+	if(should_stop(walk)) {
+		// The rest of the directory being scanned is left alone.
+		return 0;
+	}
+	atomic_fetch_add(&walk->files_examined, 1);
+	struct recompression recompression;
+	int err = choose_recompression(walk, fd, &recompression);
+	if(err) {
+		return err;
+	}
+	// A file chosen for recompression is rewritten however contiguous it is.
+	uint64_t min_fragments = walk->options->min_fragments;
+	if(min_fragments && !recompression.chosen) {
+		struct fragmentation frag;
+		int err = measure_fragmentation(fd, &frag);
+		if(!err) {
+			if(frag.fragments < min_fragments) {
+				atomic_fetch_add(&walk->files_skipped, 1);
+				return 0;
+			}
+			atomic_fetch_add(&walk->small_extent_bytes, frag.small_bytes);
+		} else if(err != EOPNOTSUPP) {
+			return err;
+		}
+		// If FIEMAP is not supported, just defragment unconditionally.
+	}
+	atomic_fetch_add(&walk->files_defragmented, 1);
+	err = defragment_recompressing(walk, fd, &recompression);
+	return err == ECANCELED ? 0 : err;
+}
+
+// Pushes an open directory on the stack to scan, or hands it to another
+// worker if one is idle or if publish_anyway is set. Takes ownership of the
+// descriptor.
+static bool enter_directory(struct worker *worker, const struct stack_entry *e, bool publish_anyway) {
+	struct stack *stack = &worker->stack;
+	if(!stack_empty(stack) && (publish_anyway || should_publish(worker))) {
+		if(!publish(worker, e)) {
+			close(e->fd);
+			return false;
+		}
+	} else if(stack_push(stack, e)) {
+		show_progress(stack, &worker->walk->reporter);
+	} else {
+		close(e->fd);
+	}
+	return true;
+}
+
+// Handles a directory entry once it has been opened and statx has been called
+// on it, as done by process() or by a batch. Either path_fd is an O_PATH
+// descriptor, which is not closed, and file_fd is −1; or path_fd is −1 and
+// file_fd is a regular file opened directly, which is taken over.
+static bool process_opened(int path_fd, int file_fd, const struct statx *statbuf, const char *name, struct worker *worker) {
+	struct stack *stack = &worker->stack;
+	struct reporter *reporter = &worker->walk->reporter;
+	uint8_t (*fsid)[BTRFS_FSID_SIZE] = &worker->walk->fsid;
+
+	if((statbuf->stx_mask & (STATX_TYPE | STATX_INO)) != (STATX_TYPE | STATX_INO)) {
+		show_path_error(stack, name, reporter, "statx returned with required information missing");
+		if(file_fd >= 0) {
+			close(file_fd);
+		}
+		return false;
+	}
+
+	// If this file is on the same device as its parent directory, it is on
+	// the same (btrfs) filesystem and subvolume, which is nearly always the
+	// case. Otherwise, look the device up, and only if it has never been seen
+	// before, ask the kernel.
+	bool new_device_number = stack_empty(stack) || statbuf->stx_dev_major != stack_peek(stack)->dev_major || statbuf->stx_dev_minor != stack_peek(stack)->dev_minor;
+	struct device_info *device = 0;
+	if(new_device_number) {
+		device = device_cache_find(&worker->devices, statbuf->stx_dev_major, statbuf->stx_dev_minor);
+		if(!device) {
+			struct statfs statfsbuf;
+			++worker->calls.fstatfses;
+			if(fstatfs(path_fd >= 0 ? path_fd : file_fd, &statfsbuf) < 0) {
+				show_path_errno(stack, name, reporter);
+				if(file_fd >= 0) {
+					close(file_fd);
+				}
+				return false;
+			}
+			device = device_cache_add(&worker->devices, statbuf->stx_dev_major, statbuf->stx_dev_minor, statfsbuf.f_type == BTRFS_SUPER_MAGIC);
+			if(!device) {
+				show_path_errno(stack, name, reporter);
+				if(file_fd >= 0) {
+					close(file_fd);
+				}
+				return false;
+			}
+		}
+
+		// If this file isn’t on a btrfs filesystem, skip it. It might be a
+		// mount point of some other filesystem type, an unmounted automount
+		// point, or something like that. In any case, if it’s not btrfs, we
+		// can’t defragment it. But it’s not an error.
+		if(!device->btrfs) {
+			if(file_fd >= 0) {
+				close(file_fd);
+			}
+			return true;
+		}
+	}
+
+	// If this is neither a file nor a directory (e.g. it’s a symlink, or a
+	// named pipe, or a device node, or a UNIX-domain socket, or something else
+	// weird), don’t touch it at all. Such things can be problematic or
+	// dangerous to actually open, and anyway they can’t be defragmented. (One
+	// opened directly was swapped in after the directory was read, and was
+	// opened without blocking, so just close it.)
+	if(!S_ISDIR(statbuf->stx_mode) && !S_ISREG(statbuf->stx_mode)) {
+		if(file_fd >= 0) {
+			close(file_fd);
+		}
+		return true;
+	}
+
+	// Now that we know it’s a regular file or directory on btrfs, it’s safe to
+	// actually open it, unless the caller already has. We can’t go back to the
+	// name, because someone could have swapped it out after the first openat
+	// call. However, we can use /proc/self/fd/foo to open a non-O_PATH copy of
+	// an O_PATH file descriptor.
+	//
+	// Do not use O_NONBLOCK here. For regular files, the only difference relates to
+	// file leases. Since even an O_NONBLOCK open causes initiation of a lease
+	// downgrade, using O_NONBLOCK would not reduce our impact on other
+	// applications; consequently, we might as well do a blocking-open and then
+	// we can actually defragment the file once we get it open.
+	if(file_fd < 0) {
+		char buffer[16];
+		sprintf(buffer, "%d", path_fd);
+		++worker->calls.reopens;
+		file_fd = openat(worker->walk->proc_fd_dir, buffer, O_RDONLY | O_NOATIME);
+		if(file_fd < 0) {
+			show_path_errno(stack, name, reporter);
+			return false;
+		}
+	}
+
+	// Check if we have hit a loop.
+	if(S_ISDIR(statbuf->stx_mode)) {
+		if(stack_contains(stack, statbuf->stx_dev_major, statbuf->stx_dev_minor, statbuf->stx_ino)) {
+			show_path_error(stack, name, reporter, "filesystem loop detected");
+			close(file_fd);
+			return false;
+		}
+	}
+
+	// If this is the top-level directory, populate fsid now that we have an
+	// open descriptor.
+	if(stack_empty(stack)) {
+		struct btrfs_ioctl_fs_info_args args;
+		++worker->calls.fs_infos;
+		if(ioctl(file_fd, BTRFS_IOC_FS_INFO, &args) < 0) {
+			show_path_errno(stack, name, reporter);
+			close(file_fd);
+			return false;
+		}
+		memcpy(*fsid, args.fsid, BTRFS_FSID_SIZE);
+		device->fsid_known = true;
+		device->same_filesystem = true;
+	}
+
+	// Check if we are crossing into a different filesystem (*NOT* just a
+	// different subvolume; we want to recur there).
+	if(S_ISDIR(statbuf->stx_mode) && !stack_empty(stack) && new_device_number) {
+		// Device differs, so this is *either* a new subvolume *or* a new
+		// filesystem.
+		if(statbuf->stx_ino == 2) {
+			// Inode 2 is a special thing called
+			// BTRFS_EMPTY_SUBVOL_DIR_OBJECTID. It is a bit like a subvolume in
+			// that it has a distinct device number, but it can never contain
+			// any files. One way to get an EMPTY_SUBVOL is to snapshot a
+			// subvolume that hierarchically contains a second subvolume;
+			// wherever the inner subvolume appeared in the source, an
+			// EMPTY_SUBVOL will appear in the snapshot.
+			//
+			// Almost nothing works on it in terms of btrfs ioctls, even those
+			// that normally work on any file or directory. However, since it
+			// doesn’t actually contain anything, we’re also totally fine
+			// ignoring it.
+			close(file_fd);
+			return true;
+		}
+		if(worker->walk->options->by_subvolume) {
+			// Every subvolume is scanned as a unit of its own, and another
+			// filesystem would be skipped anyway.
+			close(file_fd);
+			return true;
+		}
+		if(!device->fsid_known) {
+			struct btrfs_ioctl_fs_info_args args;
+			++worker->calls.fs_infos;
+			if(ioctl(file_fd, BTRFS_IOC_FS_INFO, &args) < 0) {
+				show_path_errno(stack, name, reporter);
+				close(file_fd);
+				return false;
+			}
+			device->fsid_known = true;
+			device->same_filesystem = !memcmp(args.fsid, *fsid, BTRFS_FSID_SIZE);
+		}
+		if(!device->same_filesystem) {
+			// We’ve crossed a mount point into a different btrfs filesystem.
+			close(file_fd);
+			return true;
+		}
+	}
+
+	// If this is a file, either defragment it or pass it to the defragment
+	// stage, which then owns the descriptor.
+	if(S_ISREG(statbuf->stx_mode)) {
+		if(worker->walk->pipelined) {
+			file_queue_push(&worker->walk->files, file_fd);
+			return true;
+		}
+		int err = defragment_file(worker->walk, file_fd);
+		close(file_fd);
+		if(err) {
+			errno = err;
+			show_path_errno(stack, name, reporter);
+			return false;
+		}
+		return true;
+	}
+
+	// If this is the top-level directory of a subvolume (but not any other
+	// directory), defragment it. This is done inline even when pipelining,
+	// since it is rare and the descriptor is still needed for scanning.
+	bool ok = true;
+	if(new_device_number) {
+		int err = defragment_root(worker->walk, file_fd);
+		if(err) {
+			errno = err;
+			show_path_errno(stack, name, reporter);
+			ok = false;
+		}
+	}
+
+	// This is a directory, so push it on the stack to scan, or hand it to
+	// another worker if one is idle. Strip trailing slashes, which will only
+	// be present for the top-level (potentially) so the printed path looks
+	// nicer.
+	size_t name_len = strlen(name);
+	while(name_len && name[name_len - 1] == '/') {
+		--name_len;
+	}
+	struct stack_entry e = {
+		.dev_major = statbuf->stx_dev_major,
+		.dev_minor = statbuf->stx_dev_minor,
+		.inode = statbuf->stx_ino,
+		.name = name,
+		.name_len = name_len,
+		.fd = file_fd,
+	};
+	if(worker->batch && worker->batch->deferring) {
+		worker->batch->directories[worker->batch->directory_count++] = e;
+		return ok;
+	}
+	return enter_directory(worker, &e, false) && ok;
+}
+
+static bool process(int dir_fd, const char *name, bool regular, struct worker *worker) {
+	struct stack *stack = &worker->stack;
+	struct reporter *reporter = &worker->walk->reporter;
+	struct statx statbuf;
+
+	// A directory entry said to be a regular file is opened for reading
+	// straight away, which saves the O_PATH open and the reopen through /proc
+	// below. Use O_NONBLOCK and O_NOCTTY in case it was swapped for a named
+	// pipe or device node since the directory was read; process_opened()
+	// closes anything that is not a regular file. For a regular file,
+	// O_NONBLOCK only makes a difference if it has a lease, in which case the
+	// open fails with EWOULDBLOCK and we fall back to the blocking route. Any
+	// other failure falls back too, so that errors are reported as they
+	// always were.
+	if(regular) {
+		++worker->calls.opens;
+		int file_fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_NONBLOCK | O_NOCTTY);
+		if(file_fd >= 0) {
+			++worker->calls.statxs;
+			if(statx(file_fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_INO, &statbuf) < 0) {
+				show_path_errno(stack, name, reporter);
+				close(file_fd);
+				return false;
+			}
+			return process_opened(-1, file_fd, &statbuf, name, worker);
+		} else if(errno == ENOENT) {
+			return true;
+		}
+	}
+
+	// Otherwise start with an O_PATH so that we don’t provoke things like
+	// named pipes, device nodes, and unmounted automount points, the last of
+	// which even an O_DIRECTORY open would mount. Also use O_NOFOLLOW because
+	// we are doing a physical tree traversal, so symlinks should never be
+	// followed.
+	++worker->calls.opens;
+	int path_fd = openat(dir_fd, name, O_RDONLY | O_PATH | O_NOFOLLOW | O_NOATIME);
+	if(path_fd < 0) {
+		if(errno == ENOENT) {
+			// The file was deleted in between when we found it in the
+			// directory scan and now. This is not an error. It is a normal
+			// occurrence while navigating the filesystem. Ignore it.
+			return true;
+		} else {
+			// Something else weirder went wrong.
+			show_path_errno(stack, name, reporter);
+			return false;
+		}
+	}
+
+	// Now that we have a handle to the file which is race-proof and cannot be
+	// swapped out with any other file from under us, get information about the
+	// file.
+	bool ok;
+	++worker->calls.statxs;
+	if(statx(path_fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_INO, &statbuf) >= 0) {
+		ok = process_opened(path_fd, -1, &statbuf, name, worker);
+	} else {
+		show_path_errno(stack, name, reporter);
+		ok = false;
+	}
+	close(path_fd);
+	return ok;
+}
+
+// Stores the result of each completion waiting on the worker’s ring at the
+// index given by its user data, returning how many there were.
+static unsigned int reap_ring(struct worker *worker, int *results) {
+	unsigned int count = 0;
+	const struct io_uring_cqe *cqe;
+	while((cqe = uring_peek_cqe(&worker->ring))) {
+		results[cqe->user_data] = cqe->res;
+		uring_cqe_seen(&worker->ring);
+		++count;
+	}
+	return count;
+}
+
+// Submits the count operations prepared on the worker’s ring and waits for
+// them all, storing each result at the index given by its user data. If the
+// ring fails, it is not used again, and false is returned; some results may
+// then not have been filled in, so the caller must have set those to INT_MIN
+// beforehand and must do those operations itself.
+static bool run_ring(struct worker *worker, unsigned int count, int *results) {
+	struct uring *ring = &worker->ring;
+	++worker->calls.ring_submissions;
+	bool ok = uring_submit_and_wait(ring, count);
+	unsigned int reaped = reap_ring(worker, results);
+	if(!ok) {
+		perror("io_uring_enter");
+		worker->use_ring = false;
+
+		// Operations the kernel has already taken will still complete, and
+		// an open whose result went unseen would leak its descriptor, so wait
+		// for them before giving up on the ring. Those it never took will
+		// never run.
+		unsigned int taken = count - uring_unsubmitted(ring);
+		if(reaped < taken && uring_submit_and_wait(ring, taken - reaped)) {
+			reap_ring(worker, results);
+		}
+	}
+	return ok;
+}
+
+// Returns a submission queue entry for one of count operations being prepared
+// on the worker’s ring, first running those already prepared if the ring is
+// full. Returns null if the ring is no longer to be used, in which case the
+// caller must do the operation itself.
+static struct io_uring_sqe *get_sqe(struct worker *worker, unsigned int *count, int *results) {
+	if(!worker->use_ring) {
+		return 0;
+	}
+	struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+	if(!sqe && *count) {
+		bool ok = run_ring(worker, *count, results);
+		*count = 0;
+		if(!ok) {
+			return 0;
+		}
+		sqe = uring_get_sqe(&worker->ring);
+	}
+	if(!sqe) {
+		worker->use_ring = false;
+		return 0;
+	}
+	++*count;
+	return sqe;
+}
+
+// Runs whatever is left prepared on the worker’s ring.
+static void finish_ring(struct worker *worker, unsigned int count, int *results) {
+	if(count) {
+		run_ring(worker, count, results);
+	}
+}
+
+// Opens, examines, and closes the batched regular files using one submission
+// for each step, instead of one system call per file per step. If the ring
+// fails part way through, the remaining work is done synchronously and the
+// ring is not used again.
+static bool flush_batch(struct worker *worker) {
+	struct file_batch *batch = worker->batch;
+	if(!batch->count) {
+		return true;
+	}
+
+	// Open the files directly, as in process().
+	unsigned int count = 0;
+	for(size_t i = 0; i != batch->count; ++i) {
+		batch->results[i] = INT_MIN;
+	}
+	for(size_t i = 0; i != batch->count; ++i) {
+		struct io_uring_sqe *sqe = get_sqe(worker, &count, batch->results);
+		if(!sqe) {
+			break;
+		}
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = batch->dir_fd;
+		sqe->addr = (uintptr_t) batch->names[i];
+		sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_NOATIME | O_NONBLOCK | O_NOCTTY;
+		sqe->user_data = i;
+	}
+	finish_ring(worker, count, batch->results);
+	for(size_t i = 0; i != batch->count; ++i) {
+		if(batch->results[i] == INT_MIN) {
+			++worker->calls.opens;
+			int fd = openat(batch->dir_fd, batch->names[i], O_RDONLY | O_NOFOLLOW | O_NOATIME | O_NONBLOCK | O_NOCTTY);
+			batch->results[i] = fd >= 0 ? fd : -errno;
+		}
+		batch->fds[i] = batch->results[i];
+	}
+
+	// Call statx on each one that opened.
+	count = 0;
+	for(size_t i = 0; i != batch->count; ++i) {
+		batch->results[i] = INT_MIN;
+	}
+	for(size_t i = 0; i != batch->count; ++i) {
+		if(batch->fds[i] < 0) {
+			continue;
+		}
+		struct io_uring_sqe *sqe = get_sqe(worker, &count, batch->results);
+		if(!sqe) {
+			break;
+		}
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = batch->fds[i];
+		sqe->addr = (uintptr_t) "";
+		sqe->len = STATX_TYPE | STATX_INO;
+		sqe->off = (uintptr_t) &batch->stats[i];
+		sqe->statx_flags = AT_EMPTY_PATH;
+		sqe->user_data = i;
+	}
+	finish_ring(worker, count, batch->results);
+
+	// Carry on with each file in order, as process() would, but leave any
+	// directories until the batch is finished. process_opened() takes over
+	// the descriptors.
+	bool ok = true;
+	batch->deferring = true;
+	batch->directory_count = 0;
+	for(size_t i = 0; i != batch->count; ++i) {
+		if(batch->fds[i] < 0) {
+			// As in process(), a file deleted since the directory was read
+			// is not an error, and one that could not be opened directly is
+			// tried again through an O_PATH descriptor.
+			if(batch->fds[i] != -ENOENT) {
+				ok &= process(batch->dir_fd, batch->names[i], false, worker);
+			}
+			continue;
+		}
+		if(batch->results[i] == INT_MIN) {
+			++worker->calls.statxs;
+			batch->results[i] = statx(batch->fds[i], "", AT_EMPTY_PATH, STATX_TYPE | STATX_INO, &batch->stats[i]) >= 0 ? 0 : -errno;
+		}
+		if(batch->results[i] < 0) {
+			errno = -batch->results[i];
+			show_path_errno(&worker->stack, batch->names[i], &worker->walk->reporter);
+			close(batch->fds[i]);
+			ok = false;
+			continue;
+		}
+		ok &= process_opened(-1, batch->fds[i], &batch->stats[i], batch->names[i], worker);
+	}
+	batch->deferring = false;
+	batch->count = 0;
+
+	// Now enter the directories. Siblings cannot all go on the stack at once,
+	// so all but the last are handed out as tasks.
+	for(size_t i = 0; i != batch->directory_count; ++i) {
+		ok &= enter_directory(worker, &batch->directories[i], i + 1 != batch->directory_count);
+	}
+	batch->directory_count = 0;
+	return ok;
+}
+
+// Scans directories depth-first until the worker’s stack is empty.
+static void scan(struct worker *worker) {
+	struct stack *stack = &worker->stack;
+	while(!stack_empty(stack)) {
+		struct stack_entry *e = stack_peek(stack);
+		if(e->fd < 0) {
+			// This is an ancestor copied from a task; it is being scanned by
+			// whoever published the task, not by us.
+			stack_pop(stack);
+			continue;
+		}
+		if(e->buffer_pos == e->buffer_len) {
+			if(worker->batch) {
+				worker->ok &= flush_batch(worker);
+			}
+			if(should_stop(worker->walk)) {
+				// There is no time left to defragment, or with a time budget
+				// to measure, anything else that might be found, so abandon
+				// the rest of the scan.
+				while(!stack_empty(stack)) {
+					stack_pop(stack);
+				}
+				return;
+			}
+		}
+		const struct dirent64 *de = stack_entry_read(e);
+		if(de) {
+			// Skip things other than files or directories. This is only an
+			// optimization; process() will also do a proper race-free check.
+			if(de->d_type == DT_DIR || de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
+				// Skip the . and .. entries.
+				if(strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+					if(de->d_type == DT_REG && worker->use_ring) {
+						struct file_batch *batch = worker->batch;
+						batch->dir_fd = e->fd;
+						batch->names[batch->count++] = de->d_name;
+						if(batch->count == URING_BATCH) {
+							worker->ok &= flush_batch(worker);
+						}
+					} else {
+						if(worker->batch) {
+							worker->ok &= flush_batch(worker);
+						}
+						worker->ok &= process(e->fd, de->d_name, de->d_type == DT_REG, worker);
+					}
+				}
+			}
+		} else if(errno) {
+			show_path_errno(stack, 0, &worker->walk->reporter);
+			stack_pop(stack);
+		} else {
+			// No more entries.
+			stack_pop(stack);
+		}
+	}
+}
+
+// Moves a task onto the worker’s (empty) stack and frees the task.
+static void resume(struct worker *worker, struct task *task) {
+	struct stack *stack = &worker->stack;
+	bool ok = true;
+	for(size_t i = 0; ok && i != task->ancestor_count; ++i) {
+		ok = stack_push(stack, &task->ancestors[i]);
+	}
+	if(ok && stack_push(stack, &task->entry)) {
+		task->entry.fd = -1;
+		show_progress(stack, &worker->walk->reporter);
+	} else {
+		// Out of memory. Undo and drop the directory.
+		worker->ok = false;
+		while(!stack_empty(stack)) {
+			stack_pop(stack);
+		}
+	}
+	task_free(task);
+}
+
+static struct task *steal(struct worker *worker) {
+	struct walk *walk = worker->walk;
+	size_t self = (size_t) (worker - walk->workers);
+	for(unsigned int i = 0; i != walk->worker_count; ++i) {
+		struct worker *victim = &walk->workers[(self + i) % walk->worker_count];
+		mtx_lock(&victim->deque.lock);
+		struct task *task = victim == worker ? deque_pop_bottom(&victim->deque) : deque_pop_top(&victim->deque);
+		if(task) {
+			atomic_fetch_sub(&walk->queued, 1);
+		}
+		mtx_unlock(&victim->deque.lock);
+		if(task) {
+			return task;
+		}
+	}
+	return 0;
+}
+
+// Waits until either a task or subvolume might be available, in which case true is
+// returned, or every running worker is idle with nothing queued, in which case
+// the walk is finished and false is returned.
+static bool wait_for_work(struct walk *walk) {
+	mtx_lock(&walk->idle_lock);
+	atomic_fetch_add(&walk->idle, 1);
+	for(;;) {
+		if(atomic_load(&walk->queued) || atomic_load(&walk->next_unit) < walk->unit_count) {
+			atomic_fetch_sub(&walk->idle, 1);
+			mtx_unlock(&walk->idle_lock);
+			return true;
+		}
+		if(atomic_load(&walk->idle) >= walk->running) {
+			cnd_broadcast(&walk->idle_cond);
+			mtx_unlock(&walk->idle_lock);
+			return false;
+		}
+		cnd_wait(&walk->idle_cond, &walk->idle_lock);
+	}
+}
+
+// Defragments an open regular file found other than by scanning, or hands it
+// to the defragment stage. Takes ownership of the descriptor.
+static bool submit_file(struct walk *walk, int fd) {
+	if(walk->pipelined) {
+		file_queue_push(&walk->files, fd);
+		return true;
+	}
+	int err = defragment_file(walk, fd);
+	if(err) {
+		show_fd_error(fd, &walk->reporter, err);
+	}
+	close(fd);
+	return !err;
+}
+
+struct subvolume {
+	uint64_t id;
+	uint64_t generation;
+	bool read_only;
+
+	// The subvolume it is linked into, or zero for the top-level subvolume.
+	uint64_t parent;
+};
+
+struct list_subvolumes_cookie {
+	struct subvolume *subvolumes;
+	size_t count;
+	size_t capacity;
+	bool ok;
+};
+
+static bool list_subvolumes_impl(const struct btrfs_ioctl_search_header *header, const void *item, void *cookie_raw) {
+	struct list_subvolumes_cookie *cookie = cookie_raw;
+	if(header->type == BTRFS_ROOT_BACKREF_KEY) {
+		// The backref follows the root item with the same ID, if that was
+		// listed.
+		if(cookie->count && cookie->subvolumes[cookie->count - 1].id == header->objectid) {
+			cookie->subvolumes[cookie->count - 1].parent = header->offset;
+		}
+		return true;
+	}
+	if(header->type != BTRFS_ROOT_ITEM_KEY) {
+		return true;
+	}
+	if(header->objectid != BTRFS_FS_TREE_OBJECTID && header->objectid < BTRFS_FIRST_FREE_OBJECTID) {
+		return true;
+	}
+
+	// Old root items are shorter than the current structure, but always long
+	// enough to hold the fields used here.
+	struct btrfs_root_item root;
+	memset(&root, 0, sizeof(root));
+	memcpy(&root, item, header->len < sizeof(root) ? header->len : sizeof(root));
+
+	// A subvolume with no references has been deleted and is waiting to be
+	// cleaned up.
+	if(!le32toh(root.refs)) {
+		return true;
+	}
+
+	if(cookie->count == cookie->capacity) {
+		size_t new_capacity = cookie->capacity ? cookie->capacity * 2 : 16;
+		struct subvolume *new_subvolumes = realloc(cookie->subvolumes, new_capacity * sizeof(*new_subvolumes));
+		if(!new_subvolumes) {
+			perror("realloc");
+			cookie->ok = false;
+			return false;
+		}
+		cookie->subvolumes = new_subvolumes;
+		cookie->capacity = new_capacity;
+	}
+	struct subvolume *subvolume = &cookie->subvolumes[cookie->count++];
+	subvolume->id = header->objectid;
+	subvolume->generation = le64toh(root.generation);
+	subvolume->read_only = le64toh(root.flags) & BTRFS_ROOT_SUBVOL_RDONLY;
+	subvolume->parent = 0;
+	return true;
+}
+
+// Lists every subvolume of the filesystem from the root tree, in order of ID,
+// with the subvolume each is linked into. On success, the caller must free
+// the returned array.
+static bool list_subvolumes(const char *mountpoint, int fd, struct subvolume **subvolumes, size_t *count) {
+	const struct btrfs_ioctl_search_key key = {
+		.tree_id = BTRFS_ROOT_TREE_OBJECTID,
+		.min_objectid = BTRFS_FS_TREE_OBJECTID,
+		.max_objectid = BTRFS_LAST_FREE_OBJECTID,
+		.min_type = BTRFS_ROOT_ITEM_KEY,
+		.max_type = BTRFS_ROOT_BACKREF_KEY,
+		.min_offset = 0,
+		.max_offset = UINT64_MAX,
+		.min_transid = 0,
+		.max_transid = UINT64_MAX,
+	};
+	struct list_subvolumes_cookie cookie = { .subvolumes = 0, .count = 0, .capacity = 0, .ok = true };
+	if(!for_each_tree_item(mountpoint, fd, &key, &list_subvolumes_impl, &cookie) || !cookie.ok) {
+		free(cookie.subvolumes);
+		return false;
+	}
+	*subvolumes = cookie.subvolumes;
+	*count = cookie.count;
+	return true;
+}
+
+static int compare_subvolume_id(const void *id_raw, const void *subvolume_raw) {
+	uint64_t id = *(const uint64_t *) id_raw;
+	const struct subvolume *subvolume = subvolume_raw;
+	return id < subvolume->id ? -1 : id > subvolume->id;
+}
+
+// Returns whether a subvolume is ancestor or is nested within it, following
+// the parents through a list returned by list_subvolumes.
+static bool subvolume_within(const struct subvolume *subvolumes, size_t count, const struct subvolume *subvolume, uint64_t ancestor) {
+	// Following no more parents than there are subvolumes guards against a
+	// cycle, should the list be inconsistent.
+	for(size_t i = 0; subvolume && i <= count; ++i) {
+		if(subvolume->id == ancestor) {
+			return true;
+		}
+		if(!subvolume->parent) {
+			return false;
+		}
+		subvolume = bsearch(&subvolume->parent, subvolumes, count, sizeof(*subvolumes), &compare_subvolume_id);
+	}
+	return false;
+}
+
+// Opens an inode by subvolume ID, inode number, and generation, without
+// needing to know any path to it. Returns -1 with errno set on failure.
+static int open_inode(int mount_fd, uint64_t subvolume, uint64_t inode, uint32_t generation) {
+	uint64_t storage[(sizeof(struct file_handle) + BTRFS_FID_SIZE_NON_CONNECTABLE + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+	struct file_handle *handle = (struct file_handle *) storage;
+	handle->handle_bytes = BTRFS_FID_SIZE_NON_CONNECTABLE;
+	handle->handle_type = FILEID_BTRFS_WITHOUT_PARENT;
+	memcpy(handle->f_handle, &inode, sizeof(inode));
+	memcpy(handle->f_handle + 8, &subvolume, sizeof(subvolume));
+	memcpy(handle->f_handle + 16, &generation, sizeof(generation));
+	return open_by_handle_at(mount_fd, handle, O_RDONLY | O_NOATIME);
+}
+
+static bool inode_generation_impl(const struct btrfs_ioctl_search_header *header, const void *item, void *cookie_raw) {
+	uint64_t *generation = cookie_raw;
+	if(header->type != BTRFS_INODE_ITEM_KEY || header->len < sizeof(struct btrfs_inode_item)) {
+		return true;
+	}
+	struct btrfs_inode_item inode;
+	memcpy(&inode, item, sizeof(inode));
+	*generation = le64toh(inode.generation);
+	return false;
+}
+
+// Returns the generation of a subvolume’s root directory, which is needed to
+// open it by handle, or zero on failure.
+static uint64_t root_directory_generation(const char *mountpoint, int fd, uint64_t subvolume) {
+	const struct btrfs_ioctl_search_key key = {
+		.tree_id = subvolume,
+		.min_objectid = BTRFS_FIRST_FREE_OBJECTID,
+		.max_objectid = BTRFS_FIRST_FREE_OBJECTID,
+		.min_type = BTRFS_INODE_ITEM_KEY,
+		.max_type = BTRFS_INODE_ITEM_KEY,
+		.min_offset = 0,
+		.max_offset = UINT64_MAX,
+		.min_transid = 0,
+		.max_transid = UINT64_MAX,
+	};
+	uint64_t generation = 0;
+	if(!for_each_tree_item(mountpoint, fd, &key, &inode_generation_impl, &generation)) {
+		return 0;
+	}
+	return generation;
+}
+
+// Takes the next subvolume to scan, if any, and pushes its root directory onto
+// the worker’s (empty) stack. Returns false once there are none left.
+static bool start_subvolume(struct worker *worker) {
+	struct walk *walk = worker->walk;
+	if(should_stop(walk)) {
+		// Abandon the subvolumes not yet started.
+		atomic_store(&walk->next_unit, walk->unit_count);
+		return false;
+	}
+	size_t index = atomic_fetch_add(&walk->next_unit, 1);
+	if(index >= walk->unit_count) {
+		return false;
+	}
+	const struct subvolume_unit *unit = &walk->units[index];
+	struct stack *stack = &worker->stack;
+	struct reporter *reporter = &walk->reporter;
+
+	uint64_t generation = root_directory_generation(walk->mountpoint, walk->mount_fd, unit->id);
+	if(!generation) {
+		worker->ok = false;
+		return true;
+	}
+	int fd = open_inode(walk->mount_fd, unit->id, BTRFS_FIRST_FREE_OBJECTID, (uint32_t) generation);
+	if(fd < 0) {
+		// The subvolume may have been deleted since it was listed.
+		if(errno != ESTALE && errno != ENOENT) {
+			show_path_errno(stack, unit->path, reporter);
+			worker->ok = false;
+		}
+		return true;
+	}
+	struct statx statbuf;
+	if(statx(fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_INO, &statbuf) < 0) {
+		show_path_errno(stack, unit->path, reporter);
+		close(fd);
+		worker->ok = false;
+		return true;
+	}
+
+	// Defragment the root directory itself, as is done for any subvolume root
+	// found while scanning.
+	int err = defragment_root(worker->walk, fd);
+	if(err) {
+		errno = err;
+		show_path_errno(stack, unit->path, reporter);
+		worker->ok = false;
+	}
+
+	struct stack_entry e = {
+		.dev_major = statbuf.stx_dev_major,
+		.dev_minor = statbuf.stx_dev_minor,
+		.inode = statbuf.stx_ino,
+		.name = unit->path,
+		.name_len = strlen(unit->path),
+		.fd = fd,
+	};
+	if(stack_push(stack, &e)) {
+		show_progress(stack, reporter);
+	} else {
+		close(fd);
+		worker->ok = false;
+	}
+	return true;
+}
+
+static void run_worker(struct worker *worker) {
+	for(;;) {
+		scan(worker);
+		struct task *task = steal(worker);
+		if(task) {
+			resume(worker, task);
+		} else if(!start_subvolume(worker) && !wait_for_work(worker->walk)) {
+			break;
+		}
+	}
+}
+
+struct root_backref {
+	uint64_t parent;
+	uint64_t directory;
+	size_t name_len;
+	char name[NAME_MAX + 1];
+	bool found;
+};
+
+static bool root_backref_impl(const struct btrfs_ioctl_search_header *header, const void *item, void *cookie_raw) {
+	struct root_backref *backref = cookie_raw;
+	if(header->type != BTRFS_ROOT_BACKREF_KEY || header->len < sizeof(struct btrfs_root_ref)) {
+		return true;
+	}
+	struct btrfs_root_ref ref;
+	memcpy(&ref, item, sizeof(ref));
+	size_t name_len = le16toh(ref.name_len);
+	if(name_len > NAME_MAX || sizeof(ref) + name_len > header->len) {
+		return true;
+	}
+	backref->parent = header->offset;
+	backref->directory = le64toh(ref.dirid);
+	backref->name_len = name_len;
+	memcpy(backref->name, (const char *) item + sizeof(ref), name_len);
+	backref->name[name_len] = '\0';
+	backref->found = true;
+	return false;
+}
+
+// Returns a newly allocated string consisting of prefix, a slash if both
+// prefix and suffix are nonempty, and suffix.
+static char *join_path(const char *prefix, size_t prefix_len, const char *suffix) {
+	size_t suffix_len = strlen(suffix);
+	char *path = malloc(prefix_len + 1 + suffix_len + 1);
+	if(!path) {
+		perror("malloc");
+		return 0;
+	}
+	memcpy(path, prefix, prefix_len);
+	size_t len = prefix_len;
+	if(prefix_len && suffix_len) {
+		path[len++] = '/';
+	}
+	memcpy(path + len, suffix, suffix_len + 1);
+	return path;
+}
+
+// Works out the path to display for a subvolume: its path under the mount
+// point if it is visible there, or otherwise its path from the top-level
+// subvolume, written as in “btrfs subvolume list -a”. Returns null, having
+// printed why, on failure.
+static char *subvolume_path(const char *mountpoint, int fd, uint64_t mount_subvolume, uint64_t subvolume) {
+	char *path = strdup("");
+	if(!path) {
+		perror("strdup");
+		return 0;
+	}
+	while(subvolume != mount_subvolume && subvolume != BTRFS_FS_TREE_OBJECTID) {
+		const struct btrfs_ioctl_search_key key = {
+			.tree_id = BTRFS_ROOT_TREE_OBJECTID,
+			.min_objectid = subvolume,
+			.max_objectid = subvolume,
+			.min_type = BTRFS_ROOT_BACKREF_KEY,
+			.max_type = BTRFS_ROOT_BACKREF_KEY,
+			.min_offset = 0,
+			.max_offset = UINT64_MAX,
+			.min_transid = 0,
+			.max_transid = UINT64_MAX,
+		};
+		struct root_backref backref = { .found = false };
+		if(!for_each_tree_item(mountpoint, fd, &key, &root_backref_impl, &backref)) {
+			free(path);
+			return 0;
+		}
+		if(!backref.found) {
+			fprintf(stderr, "%s: subvolume %" PRIu64 ": not linked into any directory\n", mountpoint, subvolume);
+			free(path);
+			return 0;
+		}
+
+		// The lookup gives the directory’s path within the parent subvolume,
+		// with a trailing slash unless it is the root directory.
+		struct btrfs_ioctl_ino_lookup_args lookup = {
+			.treeid = backref.parent,
+			.objectid = backref.directory,
+		};
+		if(ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) < 0) {
+			perror(mountpoint);
+			free(path);
+			return 0;
+		}
+		char component[sizeof(lookup.name) + NAME_MAX + 1];
+		size_t component_len = strnlen(lookup.name, sizeof(lookup.name));
+		memcpy(component, lookup.name, component_len);
+		memcpy(component + component_len, backref.name, backref.name_len);
+		component_len += backref.name_len;
+		char *new_path = join_path(component, component_len, path);
+		free(path);
+		if(!new_path) {
+			return 0;
+		}
+		path = new_path;
+		subvolume = backref.parent;
+	}
+
+	const char *prefix = "<FS_TREE>";
+	size_t prefix_len = strlen(prefix);
+	if(subvolume == mount_subvolume) {
+		prefix = mountpoint;
+		prefix_len = strlen(mountpoint);
+		while(prefix_len > 1 && mountpoint[prefix_len - 1] == '/') {
+			--prefix_len;
+		}
+	}
+	char *full_path = join_path(prefix, prefix_len, path);
+	free(path);
+	return full_path;
+}
+
+struct changed_inodes_cookie {
+	struct walk *walk;
+	const char *mountpoint;
+	int mount_fd;
+	uint64_t subvolume;
+	uint64_t min_transid;
+	uint64_t changed;
+	bool ok;
+};
+
+static bool changed_inodes_impl(const struct btrfs_ioctl_search_header *header, const void *item, void *cookie_raw) {
+	struct changed_inodes_cookie *cookie = cookie_raw;
+	if(atomic_load(&cookie->walk->cancelled)) {
+		// Leave the markers alone so that the rest is found next time.
+		cookie->ok = false;
+		return false;
+	}
+	if(header->type != BTRFS_INODE_ITEM_KEY || header->len < sizeof(struct btrfs_inode_item)) {
+		return true;
+	}
+
+	// The search only filters by the transaction that last wrote each tree
+	// block, so unchanged inodes that share a block with changed ones also
+	// show up here.
+	struct btrfs_inode_item inode;
+	memcpy(&inode, item, sizeof(inode));
+	if(le64toh(inode.transid) < cookie->min_transid) {
+		return true;
+	}
+
+	// Only regular files and the subvolume’s root directory get
+	// defragmented, just as when scanning.
+	bool root_dir = header->objectid == BTRFS_FIRST_FREE_OBJECTID;
+	if(!S_ISREG(le32toh(inode.mode)) && !root_dir) {
+		return true;
+	}
+
+	++cookie->changed;
+	int fd = open_inode(cookie->mount_fd, cookie->subvolume, header->objectid, (uint32_t) le64toh(inode.generation));
+	if(fd < 0) {
+		// ESTALE means the inode was deleted after the search found it,
+		// which is a normal occurrence on a live filesystem.
+		if(errno != ESTALE && errno != ENOENT) {
+			int err = errno;
+			mtx_lock(&cookie->walk->reporter.lock);
+			clear_line(&cookie->walk->reporter.current_line_width);
+			fprintf(stderr, "%s: subvolume %" PRIu64 " inode %" PRIu64 ": %s\n", cookie->mountpoint, cookie->subvolume, (uint64_t) header->objectid, strerror(err));
+			mtx_unlock(&cookie->walk->reporter.lock);
+			cookie->ok = false;
+		}
+		return true;
+	}
+	if(root_dir) {
+		int err = defragment(cookie->walk, fd);
+		if(err) {
+			show_fd_error(fd, &cookie->walk->reporter, err);
+			cookie->ok = false;
+		}
+		close(fd);
+	} else {
+		cookie->ok &= submit_file(cookie->walk, fd);
+	}
+	return true;
+}
+
+// Instead of scanning directories, asks the kernel which inodes in each
+// subvolume have changed since the transaction recorded in the state file at
+// the end of the previous run, and defragments only those.
+static bool run_incremental(struct walk *walk, const char *mountpoint) {
+	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		perror(mountpoint);
+		return false;
+	}
+	struct btrfs_ioctl_fs_info_args fs_info;
+	if(ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+		perror(mountpoint);
+		close(fd);
+		return false;
+	}
+	memcpy(walk->fsid, fs_info.fsid, BTRFS_FSID_SIZE);
+	char fsid_string[FSID_STRING_SIZE];
+	format_fsid(walk->fsid, fsid_string);
+
+	// As with a scan, only the subvolume containing the path and those nested
+	// within it are covered.
+	struct btrfs_ioctl_ino_lookup_args lookup = {
+		.treeid = 0,
+		.objectid = BTRFS_FIRST_FREE_OBJECTID,
+	};
+	if(ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) < 0) {
+		perror(mountpoint);
+		close(fd);
+		return false;
+	}
+	uint64_t top = lookup.treeid;
+
+	struct subvolume *subvolumes;
+	size_t subvolume_count;
+	if(!list_subvolumes(mountpoint, fd, &subvolumes, &subvolume_count)) {
+		close(fd);
+		return false;
+	}
+
+	bool ok = true;
+	char key_prefix[64];
+	sprintf(key_prefix, "defrag.transid.%s.", fsid_string);
+	size_t covered = 0;
+	for(size_t i = 0; i != subvolume_count; ++i) {
+		// Files in read-only subvolumes cannot be defragmented anyway.
+		if(subvolumes[i].read_only || !subvolume_within(subvolumes, subvolume_count, &subvolumes[i], top)) {
+			continue;
+		}
+		++covered;
+		char key[96];
+		sprintf(key, "%s%" PRIu64, key_prefix, subvolumes[i].id);
+		uint64_t min_transid = 0;
+		state_get_u64(key, &min_transid);
+		const struct btrfs_ioctl_search_key search_key = {
+			.tree_id = subvolumes[i].id,
+			.min_objectid = BTRFS_FIRST_FREE_OBJECTID,
+			.max_objectid = BTRFS_LAST_FREE_OBJECTID,
+			.min_type = BTRFS_INODE_ITEM_KEY,
+			.max_type = BTRFS_INODE_ITEM_KEY,
+			.min_offset = 0,
+			.max_offset = UINT64_MAX,
+			.min_transid = min_transid,
+			.max_transid = UINT64_MAX,
+		};
+		struct changed_inodes_cookie cookie = {
+			.walk = walk,
+			.mountpoint = mountpoint,
+			.mount_fd = fd,
+			.subvolume = subvolumes[i].id,
+			.min_transid = min_transid,
+			.changed = 0,
+			.ok = true,
+		};
+		ok &= for_each_tree_item(mountpoint, fd, &search_key, &changed_inodes_impl, &cookie) && cookie.ok;
+		if(walk->reporter.verbose) {
+			mtx_lock(&walk->reporter.lock);
+			clear_line(&walk->reporter.current_line_width);
+			printf("%s: subvolume %" PRIu64 ": %" PRIu64 " changed inodes since transaction %" PRIu64 "\n", mountpoint, subvolumes[i].id, cookie.changed, min_transid);
+			mtx_unlock(&walk->reporter.lock);
+		}
+	}
+	close(fd);
+	if(walk->reporter.verbose) {
+		mtx_lock(&walk->reporter.lock);
+		clear_line(&walk->reporter.current_line_width);
+		printf("%s: checked %zu writable subvolumes within subvolume %" PRIu64 " of %zu in the filesystem\n", mountpoint, covered, top, subvolume_count);
+		mtx_unlock(&walk->reporter.lock);
+	}
+
+	// Only move the markers forward if everything succeeded, so that files
+	// which failed are retried next time. The markers are the generations
+	// read before searching, so anything changed during this run is found
+	// again next time (including, unavoidably, the files this run
+	// defragmented). The markers of subvolumes not covered are kept as they
+	// were, and those of subvolumes which no longer exist are forgotten.
+	if(ok) {
+		uint64_t *markers = calloc(subvolume_count ? subvolume_count : 1, sizeof(*markers));
+		if(!markers) {
+			perror("calloc");
+			free(subvolumes);
+			return false;
+		}
+		for(size_t i = 0; i != subvolume_count; ++i) {
+			char key[96];
+			sprintf(key, "%s%" PRIu64, key_prefix, subvolumes[i].id);
+			if(!subvolume_within(subvolumes, subvolume_count, &subvolumes[i], top)) {
+				state_get_u64(key, &markers[i]);
+			} else if(!subvolumes[i].read_only) {
+				markers[i] = subvolumes[i].generation;
+			}
+		}
+		state_remove_prefix(key_prefix);
+		for(size_t i = 0; i != subvolume_count; ++i) {
+			if(markers[i]) {
+				char key[96];
+				sprintf(key, "%s%" PRIu64, key_prefix, subvolumes[i].id);
+				ok &= state_set_u64(key, markers[i]);
+			}
+		}
+		free(markers);
+	}
+	free(subvolumes);
+	return ok;
+}
+
+static int worker_thread_proc(void *worker_raw) {
+	run_worker(worker_raw);
+	return 0;
+}
+
+static int defragmenter_thread_proc(void *defragmenter_raw) {
+	struct defragmenter *defragmenter = defragmenter_raw;
+	struct walk *walk = defragmenter->walk;
+	int fd;
+	while((fd = file_queue_pop(&walk->files)) >= 0) {
+		if(atomic_load(&walk->cancelled)) {
+			// Just drain the queue.
+			close(fd);
+			continue;
+		}
+		int err = defragment_file(walk, fd);
+		if(err) {
+			show_fd_error(fd, &walk->reporter, err);
+			defragmenter->ok = false;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static bool create_thread(thrd_t *thread, thrd_start_t proc, void *arg) {
+	switch(thrd_create(thread, proc, arg)) {
+		case thrd_success:
+			return true;
+
+		case thrd_nomem:
+			fprintf(stderr, "thrd_create: %s\n", strerror(ENOMEM));
+			return false;
+
+		case thrd_error:
+			fputs("thrd_create: failed\n", stderr);
+			return false;
+
+		default:
+			fputs("thrd_create: unknown error\n", stderr);
+			return false;
+	}
+}
+
+static void join_thread(thrd_t thread) {
+	if(thrd_join(thread, 0) == thrd_error) {
+		fputs("thrd_join: error\n", stderr);
+		abort();
+	}
+}
+
+// Runs the first worker on the calling thread and the rest on threads of
+// their own, until there is no work left.
+static bool run_workers(struct walk *walk) {
+	bool ok = true;
+	unsigned int started = 1;
+	while(started != walk->worker_count) {
+		if(!create_thread(&walk->workers[started].thread, &worker_thread_proc, &walk->workers[started])) {
+			ok = false;
+			mtx_lock(&walk->idle_lock);
+			walk->running = started;
+			cnd_broadcast(&walk->idle_cond);
+			mtx_unlock(&walk->idle_lock);
+			break;
+		}
+		++started;
+	}
+	run_worker(&walk->workers[0]);
+	for(unsigned int i = 1; i != started; ++i) {
+		join_thread(walk->workers[i].thread);
+	}
+	return ok;
+}
+
+// Runs the scan stage over the whole tree, starting with the top-level
+// directory on the calling thread.
+static bool run_scan(struct walk *walk, const char *mountpoint) {
+	// The first worker starts with the top-level directory; the others start
+	// out idle and steal from it.
+	bool ok = process(AT_FDCWD, mountpoint, false, &walk->workers[0]);
+	ok &= run_workers(walk);
+	return ok;
+}
+
+// Runs the scan stage over each writable subvolume listed in the root tree,
+// as separate units shared among the workers, so that read-only subvolumes
+// (such as snapshots) are never walked at all.
+static bool run_subvolumes(struct walk *walk, const char *mountpoint) {
+	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		perror(mountpoint);
+		return false;
+	}
+	struct btrfs_ioctl_fs_info_args fs_info;
+	if(ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+		perror(mountpoint);
+		close(fd);
+		return false;
+	}
+	memcpy(walk->fsid, fs_info.fsid, BTRFS_FSID_SIZE);
+
+	// Subvolumes visible under the mount point are displayed by their path
+	// there, which needs to know which subvolume is mounted. That only makes
+	// sense if the mount point is the root directory of a subvolume.
+	uint64_t mount_subvolume = 0;
+	struct statx statbuf;
+	if(statx(fd, "", AT_EMPTY_PATH, STATX_INO, &statbuf) >= 0 && (statbuf.stx_mask & STATX_INO) && statbuf.stx_ino == BTRFS_FIRST_FREE_OBJECTID) {
+		struct btrfs_ioctl_ino_lookup_args lookup = {
+			.treeid = 0,
+			.objectid = BTRFS_FIRST_FREE_OBJECTID,
+		};
+		if(ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) >= 0) {
+			mount_subvolume = lookup.treeid;
+		}
+	}
+
+	struct subvolume *subvolumes;
+	size_t subvolume_count;
+	if(!list_subvolumes(mountpoint, fd, &subvolumes, &subvolume_count)) {
+		close(fd);
+		return false;
+	}
+	bool ok = true;
+	struct subvolume_unit *units = calloc(subvolume_count ? subvolume_count : 1, sizeof(*units));
+	if(!units) {
+		perror("calloc");
+		free(subvolumes);
+		close(fd);
+		return false;
+	}
+	size_t unit_count = 0;
+	for(size_t i = 0; i != subvolume_count; ++i) {
+		if(!subvolumes[i].read_only) {
+			char *path = subvolume_path(mountpoint, fd, mount_subvolume, subvolumes[i].id);
+			if(path) {
+				units[unit_count].id = subvolumes[i].id;
+				units[unit_count].path = path;
+				++unit_count;
+			} else {
+				ok = false;
+			}
+		}
+	}
+	if(walk->reporter.verbose) {
+		printf("%s: scanning %zu writable subvolumes, skipping %zu read-only\n", mountpoint, unit_count, subvolume_count - unit_count);
+	}
+	free(subvolumes);
+
+	walk->mount_fd = fd;
+	walk->units = units;
+	walk->unit_count = unit_count;
+	ok &= run_workers(walk);
+	walk->unit_count = 0;
+	walk->units = 0;
+	walk->mount_fd = -1;
+
+	for(size_t i = 0; i != unit_count; ++i) {
+		free(units[i].path);
+	}
+	free(units);
+	close(fd);
+	return ok;
+}
+
+// Orders candidates with the most fragments per byte first.
+static int compare_candidates(const void *x_raw, const void *y_raw) {
+	const struct candidate *x = x_raw, *y = y_raw;
+	if(x->root || y->root) {
+		return y->root - x->root;
+	}
+	double x_density = (double) x->fragments / (double) x->bytes;
+	double y_density = (double) y->fragments / (double) y->bytes;
+	return x_density < y_density ? 1 : x_density > y_density ? -1 : 0;
+}
+
+// Defragments indexed candidates in order until there are none left or the
+// time budget runs out.
+static bool defragment_candidates(struct walk *walk) {
+	bool ok = true;
+	while(!should_stop(walk)) {
+		size_t i = atomic_fetch_add(&walk->next_candidate, 1);
+		if(i >= walk->index.count) {
+			break;
+		}
+		const struct candidate *c = &walk->index.candidates[i];
+		int fd = open_inode(walk->mount_fd, c->subvolume, c->inode, c->generation);
+		if(fd < 0) {
+			// As in incremental mode, the file may have been deleted since it
+			// was found.
+			if(errno != ESTALE && errno != ENOENT) {
+				int err = errno;
+				mtx_lock(&walk->reporter.lock);
+				clear_line(&walk->reporter.current_line_width);
+				fprintf(stderr, "%s: subvolume %" PRIu64 " inode %" PRIu64 ": %s\n", walk->mountpoint, c->subvolume, c->inode, strerror(err));
+				mtx_unlock(&walk->reporter.lock);
+				ok = false;
+			}
+			continue;
+		}
+		int err;
+		if(c->root) {
+			err = defragment(walk, fd);
+		} else {
+			struct recompression recompression;
+			err = choose_recompression(walk, fd, &recompression);
+			if(!err) {
+				atomic_fetch_add(&walk->files_defragmented, 1);
+				err = defragment_recompressing(walk, fd, &recompression);
+			}
+		}
+		if(!err) {
+			atomic_fetch_add(&walk->fragments_fixed, c->fragments);
+		} else if(err != ECANCELED) {
+			show_fd_error(fd, &walk->reporter, err);
+			ok = false;
+		}
+		close(fd);
+	}
+	return ok;
+}
+
+static int candidate_thread_proc(void *defragmenter_raw) {
+	struct defragmenter *defragmenter = defragmenter_raw;
+	defragmenter->ok = defragment_candidates(defragmenter->walk);
+	return 0;
+}
+
+// Defragments the files in the index, worst first, using as many threads as
+// there are workers.
+static bool run_candidates(struct walk *walk, const char *mountpoint) {
+	struct candidate_index *index = &walk->index;
+	qsort(index->candidates, index->count, sizeof(*index->candidates), &compare_candidates);
+	walk->mount_fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+	if(walk->mount_fd < 0) {
+		perror(mountpoint);
+		return false;
+	}
+	struct defragmenter *defragmenters = calloc(walk->worker_count, sizeof(*defragmenters));
+	if(!defragmenters) {
+		perror("calloc");
+		close(walk->mount_fd);
+		walk->mount_fd = -1;
+		return false;
+	}
+	bool ok = true;
+	unsigned int started = 1;
+	while(started != walk->worker_count) {
+		defragmenters[started].walk = walk;
+		if(!create_thread(&defragmenters[started].thread, &candidate_thread_proc, &defragmenters[started])) {
+			ok = false;
+			break;
+		}
+		++started;
+	}
+	ok &= defragment_candidates(walk);
+	for(unsigned int i = 1; i != started; ++i) {
+		join_thread(defragmenters[i].thread);
+		ok &= defragmenters[i].ok;
+	}
+	free(defragmenters);
+	close(walk->mount_fd);
+	walk->mount_fd = -1;
+	return ok;
+}
+
+// Runs the scan stage with the defragment stage on its own threads, if
+// possible.
+static bool run_pipeline(struct walk *walk, const char *mountpoint, const struct defrag_options *options, bool (*produce)(struct walk *, const char *)) {
+	if(!file_queue_init(&walk->files, options->queue_depth)) {
+		return false;
+	}
+	struct defragmenter *defragmenters = calloc(walk->worker_count, sizeof(*defragmenters));
+	if(!defragmenters) {
+		perror("calloc");
+		file_queue_deinit(&walk->files);
+		return false;
+	}
+	bool ok = true;
+	unsigned int started = 0;
+	while(started != walk->worker_count) {
+		defragmenters[started].walk = walk;
+		defragmenters[started].ok = true;
+		if(!create_thread(&defragmenters[started].thread, &defragmenter_thread_proc, &defragmenters[started])) {
+			ok = false;
+			break;
+		}
+		++started;
+	}
+
+	// If no defragment threads could be started at all, nothing would drain
+	// the queue, so fall back to defragmenting inline.
+	walk->pipelined = started != 0;
+	ok &= produce(walk, mountpoint);
+	file_queue_close(&walk->files);
+	for(unsigned int i = 0; i != started; ++i) {
+		join_thread(defragmenters[i].thread);
+		ok &= defragmenters[i].ok;
+	}
+	free(defragmenters);
+
+	walk->scan_stall_ns = walk->files.producer_stall_ns;
+	walk->defragment_stall_ns = walk->files.consumer_stall_ns;
+	file_queue_deinit(&walk->files);
+	return ok;
+}
+
+// Sets up a worker to batch file examination through io_uring. On failure,
+// errno is set and the worker carries on with ordinary system calls.
+static bool init_ring(struct worker *worker) {
+	static const uint8_t OPCODES[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_CLOSE };
+	struct file_batch *batch = malloc(sizeof(*batch));
+	if(!batch) {
+		return false;
+	}
+	if(!uring_init(&worker->ring, URING_BATCH, OPCODES, sizeof(OPCODES) / sizeof(*OPCODES))) {
+		int err = errno;
+		free(batch);
+		errno = err;
+		return false;
+	}
+	batch->count = 0;
+	batch->deferring = false;
+	batch->directory_count = 0;
+	worker->batch = batch;
+	worker->use_ring = true;
+	return true;
+}
+
+// Sets up the pacer for --max-defrag-rate and, if asked for, adaptive pacing.
+static bool init_pacer(struct walk *walk, const char *mountpoint) {
+	if(!pacer_init(&walk->pacer, (uint64_t) walk->options->max_rate_mib * 1024 * 1024)) {
+		return false;
+	}
+	walk->paced = true;
+	if(walk->options->adaptive_rate) {
+		// The devices are found through the filesystem ID. If they cannot be,
+		// carry on at the fixed rate rather than not at all.
+		int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+		if(fd < 0) {
+			perror(mountpoint);
+			return false;
+		}
+		struct btrfs_ioctl_fs_info_args fs_info;
+		if(ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+			perror(mountpoint);
+			close(fd);
+			return false;
+		}
+		close(fd);
+		char fsid_string[FSID_STRING_SIZE];
+		format_fsid(fs_info.fsid, fsid_string);
+		if(!pacer_adapt(&walk->pacer, fsid_string)) {
+			fprintf(stderr, "%s: adaptive pacing unavailable, using a fixed rate\n", mountpoint);
+		}
+	}
+	return true;
+}
+
+// Watches for termination signals while defragmenting.
+struct monitor {
+	struct walk *walk;
+	int sigfd;
+	int efd;
+	thrd_t thread;
+};
+
+static int monitor_thread_proc(void *monitor_raw) {
+	struct monitor *monitor = monitor_raw;
+	for(;;) {
+		struct pollfd pfds[] = {
+			{ .fd = monitor->sigfd, .events = POLLIN, .revents = 0 },
+			{ .fd = monitor->efd, .events = POLLIN, .revents = 0 },
+		};
+		if(poll(pfds, sizeof(pfds) / sizeof(*pfds), -1) < 0) {
+			perror("poll");
+			return 0;
+		}
+		if(pfds[0].revents & POLLIN) {
+			// A signal was received. Ask everything to stop. The signal is
+			// left pending, to take effect once it is unblocked.
+			atomic_store(&monitor->walk->cancelled, true);
+			return 0;
+		}
+		if(pfds[1].revents & POLLIN) {
+			// Defragmentation finished.
+			return 0;
+		}
+	}
+}
+
+// Defragments, watching sigfd for termination signals.
+static bool do_defrag_sigfd(const char *mountpoint, bool verbose, const struct defrag_options *options, int sigfd) {
+	if(verbose) {
+		printf("Defragment %s:\n", mountpoint);
+	}
+
+	struct walk walk = {
+		.options = options,
+		.reporter = {
+			.verbose = verbose,
+			.current_line_width = 0,
+			.progress_shown = false,
+		},
+		.worker_count = options->jobs ? options->jobs : 1,
+		.pipelined = false,
+	};
+	walk.proc_fd_dir = open("/proc/self/fd", O_RDONLY | O_PATH | O_DIRECTORY);
+	if(walk.proc_fd_dir < 0) {
+		perror("/proc/self/fd");
+		return false;
+	}
+	walk.running = walk.worker_count;
+	atomic_init(&walk.idle, 0);
+	atomic_init(&walk.queued, 0);
+	walk.mountpoint = mountpoint;
+	walk.mount_fd = -1;
+	walk.units = 0;
+	walk.unit_count = 0;
+	atomic_init(&walk.next_unit, 0);
+	walk.indexing = options->time_budget != 0;
+	uint64_t budget_start_ns = monotonic_ns();
+	walk.deadline_ns = walk.indexing ? budget_start_ns + options->time_budget * (UINT64_C(10000000) * SCAN_BUDGET_PERCENT) : 0;
+	walk.index.candidates = 0;
+	walk.index.count = 0;
+	walk.index.capacity = 0;
+	atomic_init(&walk.next_candidate, 0);
+	atomic_init(&walk.fragments_fixed, 0);
+	atomic_init(&walk.cancelled, false);
+	atomic_init(&walk.rewriting, false);
+	atomic_init(&walk.checkpoint_failed, false);
+	walk.paced = false;
+	atomic_init(&walk.paced_ns, 0);
+	atomic_init(&walk.files_examined, 0);
+	atomic_init(&walk.files_skipped, 0);
+	atomic_init(&walk.files_defragmented, 0);
+	atomic_init(&walk.small_extent_bytes, 0);
+	atomic_init(&walk.recompress_failed, false);
+	atomic_init(&walk.files_recompressed, 0);
+	atomic_init(&walk.files_incompressible, 0);
+	atomic_init(&walk.recompress_bytes_before, 0);
+	atomic_init(&walk.recompress_bytes_after, 0);
+	if(mtx_init(&walk.reporter.lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		close(walk.proc_fd_dir);
+		return false;
+	}
+	if(mtx_init(&walk.idle_lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		mtx_destroy(&walk.reporter.lock);
+		close(walk.proc_fd_dir);
+		return false;
+	}
+	if(cnd_init(&walk.idle_cond) != thrd_success) {
+		fputs("cnd_init: failed\n", stderr);
+		mtx_destroy(&walk.idle_lock);
+		mtx_destroy(&walk.reporter.lock);
+		close(walk.proc_fd_dir);
+		return false;
+	}
+	if(mtx_init(&walk.index.lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		cnd_destroy(&walk.idle_cond);
+		mtx_destroy(&walk.idle_lock);
+		mtx_destroy(&walk.reporter.lock);
+		close(walk.proc_fd_dir);
+		return false;
+	}
+	walk.workers = calloc(walk.worker_count, sizeof(*walk.workers));
+	if(!walk.workers) {
+		perror("calloc");
+		mtx_destroy(&walk.index.lock);
+		cnd_destroy(&walk.idle_cond);
+		mtx_destroy(&walk.idle_lock);
+		mtx_destroy(&walk.reporter.lock);
+		close(walk.proc_fd_dir);
+		return false;
+	}
+	bool ok = true;
+	bool scan_finished = true;
+	bool try_ring = options->io_uring;
+	unsigned int initialized = 0;
+	while(initialized != walk.worker_count) {
+		struct worker *worker = &walk.workers[initialized];
+		worker->walk = &walk;
+		stack_init(&worker->stack);
+		worker->ok = true;
+		worker->use_ring = false;
+		worker->batch = 0;
+		if(!deque_init(&worker->deque)) {
+			ok = false;
+			break;
+		}
+		++initialized;
+		if(try_ring && !init_ring(worker)) {
+			// io_uring may be missing, or disabled by something like seccomp
+			// or the io_uring_disabled sysctl, in which case ordinary system
+			// calls work just as well.
+			if(verbose) {
+				printf("%s: io_uring unavailable (%s), using ordinary system calls\n", mountpoint, strerror(errno));
+			}
+			try_ring = false;
+		}
+	}
+
+	if(ok && options->max_rate_mib) {
+		ok = init_pacer(&walk, mountpoint);
+	}
+
+	struct monitor monitor = {
+		.walk = &walk,
+		.sigfd = sigfd,
+		.efd = -1,
+	};
+	bool monitoring = false;
+	if(ok) {
+		monitor.efd = eventfd(0, 0);
+		if(monitor.efd < 0) {
+			perror("eventfd");
+			ok = false;
+		} else if(create_thread(&monitor.thread, &monitor_thread_proc, &monitor)) {
+			monitoring = true;
+		} else {
+			ok = false;
+		}
+	}
+
+	if(ok) {
+		bool (*produce)(struct walk *, const char *) = options->incremental ? &run_incremental : options->by_subvolume ? &run_subvolumes : &run_scan;
+		if(options->queue_depth) {
+			ok = run_pipeline(&walk, mountpoint, options, produce);
+		} else {
+			ok = produce(&walk, mountpoint);
+		}
+		if(walk.indexing) {
+			// Defragment what was found, even if the scan ran out of its
+			// share of the time, in whatever time is left.
+			scan_finished = !should_stop(&walk);
+			walk.indexing = false;
+			walk.deadline_ns = budget_start_ns + options->time_budget * UINT64_C(1000000000);
+			ok &= run_candidates(&walk, mountpoint);
+		}
+		if(options->incremental || options->window_mib) {
+			ok &= state_save();
+		}
+		ok &= !walk.checkpoint_failed && !walk.cancelled && !walk.recompress_failed;
+	}
+
+	if(monitoring) {
+		if(eventfd_write(monitor.efd, 1) < 0) {
+			perror("eventfd_write");
+			abort();
+		}
+		join_thread(monitor.thread);
+	}
+	if(monitor.efd >= 0) {
+		close(monitor.efd);
+	}
+	uint64_t final_rate = walk.paced ? walk.pacer.rate : 0;
+	unsigned int backoffs = walk.paced ? walk.pacer.backoffs : 0;
+	if(walk.paced) {
+		pacer_deinit(&walk.pacer);
+	}
+
+	struct syscall_counts calls = {0};
+	for(unsigned int i = 0; i != initialized; ++i) {
+		ok &= walk.workers[i].ok;
+		calls.opens += walk.workers[i].calls.opens;
+		calls.reopens += walk.workers[i].calls.reopens;
+		calls.statxs += walk.workers[i].calls.statxs;
+		calls.fstatfses += walk.workers[i].calls.fstatfses;
+		calls.fs_infos += walk.workers[i].calls.fs_infos;
+		calls.ring_submissions += walk.workers[i].calls.ring_submissions;
+		free(walk.workers[i].devices.devices);
+		stack_deinit(&walk.workers[i].stack);
+		deque_deinit(&walk.workers[i].deque);
+		if(walk.workers[i].batch) {
+			uring_deinit(&walk.workers[i].ring);
+			free(walk.workers[i].batch);
+		}
+	}
+	free(walk.workers);
+	uint64_t fragments_found = 0;
+	for(size_t i = 0; i != walk.index.count; ++i) {
+		fragments_found += walk.index.candidates[i].fragments;
+	}
+	size_t candidates_left = walk.index.count - (walk.next_candidate < walk.index.count ? walk.next_candidate : walk.index.count);
+	free(walk.index.candidates);
+	mtx_destroy(&walk.index.lock);
+	cnd_destroy(&walk.idle_cond);
+	mtx_destroy(&walk.idle_lock);
+	mtx_destroy(&walk.reporter.lock);
+	close(walk.proc_fd_dir);
+
+	// If we were displaying progress, print an empty line to avoid terminal
+	// corruption.
+	if(verbose) {
 		putchar('\n');
+		printf("%s: examined %" PRIu64 " files, skipped %" PRIu64 " as already contiguous, defragmented %" PRIu64 "\n", mountpoint, (uint64_t) walk.files_examined, (uint64_t) walk.files_skipped, (uint64_t) walk.files_defragmented);
+		if(options->min_fragments) {
+			printf("%s: defragmented files had %" PRIu64 " bytes in extents small enough to be rewritten\n", mountpoint, (uint64_t) walk.small_extent_bytes);
+		}
+		if(walk.pipelined) {
+			printf("%s: scan stage stalled %.3f s waiting for queue space; defragment stage stalled %.3f s waiting for files\n", mountpoint, walk.scan_stall_ns / 1e9, walk.defragment_stall_ns / 1e9);
+		}
+		if(options->time_budget) {
+			double fixed = fragments_found ? 100.0 * walk.fragments_fixed / fragments_found : 100.0;
+			printf("%s: fixed %" PRIu64 " of %" PRIu64 " fragments found (%.1f%%)", mountpoint, (uint64_t) walk.fragments_fixed, fragments_found, fixed);
+			if(!scan_finished) {
+				printf("; stopped before the scan finished");
+			} else if(candidates_left) {
+				printf("; stopped with %zu files left", candidates_left);
+			}
+			putchar('\n');
+		}
+		if(options->compress_type) {
+			// Files written to while being recompressed can end up bigger,
+			// so show no saving rather than a negative one.
+			uint64_t before = walk.recompress_bytes_before, after = walk.recompress_bytes_after;
+			uint64_t saved = before > after ? before - after : 0;
+			printf("%s: recompressed %" PRIu64 " files, skipped %" PRIu64 " as incompressible; %" PRIu64 " bytes on disk became %" PRIu64 ", saving %" PRIu64 "\n", mountpoint, (uint64_t) walk.files_recompressed, (uint64_t) walk.files_incompressible, before, after, saved);
+		}
+		if(walk.paced) {
+			printf("%s: waited %.3f s for the rate limit", mountpoint, walk.paced_ns / 1e9);
+			if(options->adaptive_rate) {
+				printf("; backed off %u times, ending at %.1f MiB/s", backoffs, final_rate / (1024.0 * 1024.0));
+			}
+			putchar('\n');
+		}
+		if(!options->incremental) {
+			printf("%s: scan made %" PRIu64 " openat, %" PRIu64 " reopen, %" PRIu64 " statx, %" PRIu64 " fstatfs, %" PRIu64 " FS_INFO, and %" PRIu64 " io_uring_enter calls\n", mountpoint, calls.opens, calls.reopens, calls.statxs, calls.fstatfses, calls.fs_infos, calls.ring_submissions);
+		}
 	}
 
 	return ok;
 }
+
+bool do_defrag(const char *mountpoint, bool verbose, const struct defrag_options *options) {
+	// As in scrub and balance, the termination signals are blocked and
+	// watched with a signalfd, so that the walk stops after the current file
+	// or window, finishes its summary, and saves its checkpoints, rather than
+	// the process dying part way through; putting back the signal mask
+	// afterwards then lets the still-pending signal terminate the process as
+	// usual. This also covers a caller that has already blocked them, as
+	// when maintaining filesystems in parallel, since otherwise nothing would
+	// stop the walk.
+	sigset_t sigs, old_sigs;
+	termination_signals(&sigs);
+	if(sigprocmask(SIG_BLOCK, &sigs, &old_sigs) < 0) {
+		perror("sigprocmask");
+		return false;
+	}
+	bool ret;
+	int sigfd = signalfd(-1, &sigs, 0);
+	if(sigfd >= 0) {
+		ret = do_defrag_sigfd(mountpoint, verbose, options, sigfd);
+		close(sigfd);
+	} else {
+		perror("signalfd");
+		ret = false;
+	}
+	fflush(stdout);
+	if(sigprocmask(SIG_SETMASK, &old_sigs, 0) < 0) {
+		perror("sigprocmask");
+		abort();
+	}
+	return ret;
+}
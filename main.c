@@ -1,9 +1,14 @@
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "ops.h"
+#include "state.h"
+#include "util.h"
 
 #define VERSION "dev"
 
@@ -13,21 +18,84 @@ int main(int argc, char **argv) {
 	static int defrag = 1;
 	static int balance = 1;
 	static int trim = 1;
+	static int parallel_filesystems = 0;
+	static int scrub_order_by_health = 0;
+	static int defrag_incremental = 0;
+	static int defrag_subvolumes = 0;
+	static int defrag_rate_adaptive = 0;
+	static int io_uring = 0;
 	static const struct option options[] = {
 		{ .name = "no-scrub", .has_arg = no_argument, .flag = &scrub, .val = 0 },
 		{ .name = "no-defragment", .has_arg = no_argument, .flag = &defrag, .val = 0 },
 		{ .name = "no-balance", .has_arg = no_argument, .flag = &balance, .val = 0 },
 		{ .name = "no-trim", .has_arg = no_argument, .flag = &trim, .val = 0 },
+		{ .name = "parallel-filesystems", .has_arg = no_argument, .flag = &parallel_filesystems, .val = 1 },
+		{ .name = "scrub-parallelism", .has_arg = required_argument, .flag = 0, .val = 'P' },
+		{ .name = "scrub-speed-max", .has_arg = required_argument, .flag = 0, .val = 'X' },
+		{ .name = "scrub-order-by-health", .has_arg = no_argument, .flag = &scrub_order_by_health, .val = 1 },
+		{ .name = "scrub-stats-file", .has_arg = required_argument, .flag = 0, .val = 'M' },
+		{ .name = "scrub-stats-interval", .has_arg = required_argument, .flag = 0, .val = 'I' },
+		{ .name = "balance-target", .has_arg = required_argument, .flag = 0, .val = 'B' },
+		{ .name = "balance-budget", .has_arg = required_argument, .flag = 0, .val = 'U' },
+		{ .name = "balance-min-unallocated", .has_arg = required_argument, .flag = 0, .val = 'L' },
+		{ .name = "balance-max-slack", .has_arg = required_argument, .flag = 0, .val = 'K' },
+		{ .name = "trim-batch", .has_arg = required_argument, .flag = 0, .val = 'G' },
+		{ .name = "trim-pause", .has_arg = required_argument, .flag = 0, .val = 'H' },
+		{ .name = "trim-minlen", .has_arg = required_argument, .flag = 0, .val = 'N' },
+		{ .name = "jobs", .has_arg = required_argument, .flag = 0, .val = 'j' },
+		{ .name = "defrag-queue-depth", .has_arg = required_argument, .flag = 0, .val = 'Q' },
+		{ .name = "defrag-min-fragments", .has_arg = required_argument, .flag = 0, .val = 'F' },
+		{ .name = "defrag-incremental", .has_arg = no_argument, .flag = &defrag_incremental, .val = 1 },
+		{ .name = "defrag-subvolumes", .has_arg = no_argument, .flag = &defrag_subvolumes, .val = 1 },
+		{ .name = "defrag-time-budget", .has_arg = required_argument, .flag = 0, .val = 'T' },
+		{ .name = "defrag-window", .has_arg = required_argument, .flag = 0, .val = 'W' },
+		{ .name = "max-defrag-rate", .has_arg = required_argument, .flag = 0, .val = 'R' },
+		{ .name = "defrag-rate-adaptive", .has_arg = no_argument, .flag = &defrag_rate_adaptive, .val = 1 },
+		{ .name = "defrag-compress", .has_arg = required_argument, .flag = 0, .val = 'C' },
+		{ .name = "defrag-compress-age", .has_arg = required_argument, .flag = 0, .val = 'A' },
+		{ .name = "defrag-compress-min-size", .has_arg = required_argument, .flag = 0, .val = 'Z' },
+		{ .name = "io-uring", .has_arg = no_argument, .flag = &io_uring, .val = 1 },
+		{ .name = "state-file", .has_arg = required_argument, .flag = 0, .val = 'S' },
 		{ .name = "verbose", .has_arg = no_argument, .flag = 0, .val = 'v' },
 		{ .name = "help", .has_arg = no_argument, .flag = 0, .val = 'h' },
 		{ .name = "version", .has_arg = no_argument, .flag = 0, .val = 'V' },
 		{ .name = 0, .has_arg = 0, .flag = 0, .val = 0 },
 	};
 	bool verbose = false;
+	const char *state_file = 0;
+	struct scrub_options scrub_options = {
+		.stats_file = 0,
+		.stats_interval_ms = 1000,
+		.parallelism = 0,
+		.speed_max_mib = 0,
+	};
+	struct balance_options balance_options = {
+		.target_mib = 0,
+		.budget_seconds = 0,
+		.budget_bytes = 0,
+		.min_unallocated_percent = 10,
+		.max_slack_percent = 20,
+	};
+	struct trim_options trim_options = {
+		.batch_mib = 0,
+		.pause_ms = 0,
+		.minlen_kib = 0,
+	};
+	struct defrag_options defrag_options = {
+		.jobs = 1,
+		.queue_depth = 0,
+		.min_fragments = 0,
+		.time_budget = 0,
+		.window_mib = 0,
+		.max_rate_mib = 0,
+		.compress_type = 0,
+		.compress_min_age_days = 30,
+		.compress_min_kib = 128,
+	};
 	{
 		bool done = false;
 		while(!done) {
-			switch(getopt_long(argc, argv, "vhV", options, 0)) {
+			switch(getopt_long(argc, argv, "vhVj:", options, 0)) {
 				case '?':
 					return EXIT_FAILURE;
 
@@ -40,17 +108,264 @@ int main(int argc, char **argv) {
 
 				case 'h':
 					fprintf(stderr, "Usage:\n\n"
-							"%s [--no-scrub] [--no-defragment] [--no-balance] [--no-trim] [--help] mountpoint ...\n\n"
+							"%s [--no-scrub] [--no-defragment] [--no-balance] [--no-trim] [--parallel-filesystems] [--scrub-parallelism N] [--scrub-speed-max MIB] [--scrub-order-by-health] [--scrub-stats-file FILE] [--scrub-stats-interval MS] [--balance-target MIB] [--balance-budget LIMIT] [--balance-min-unallocated PERCENT] [--balance-max-slack PERCENT] [--trim-batch MIB] [--trim-pause MS] [--trim-minlen KIB] [--jobs N] [--defrag-queue-depth N] [--defrag-min-fragments N] [--defrag-incremental] [--defrag-subvolumes] [--defrag-time-budget SECONDS] [--defrag-window MIB] [--max-defrag-rate MIB] [--defrag-rate-adaptive] [--defrag-compress ALGORITHM] [--defrag-compress-age DAYS] [--defrag-compress-min-size KIB] [--io-uring] [--state-file FILE] [--help] mountpoint ...\n\n"
 							"--no-scrub: do not scrub the filesystem(s)\n"
 							"--no-defragment: do not defragment the filesystem(s)\n"
 							"--no-balance: do not balance the filesystem(s)\n"
 							"--no-trim: do not trim unused space\n"
+							"--parallel-filesystems: maintain the filesystems at the same time, except those sharing a disk\n"
+							"--scrub-parallelism N: scrub at most N devices at a time (default 0, meaning all)\n"
+							"--scrub-speed-max MIB: limit each device’s scrub to MIB MiB per second, where the kernel supports it (default 0, meaning no change)\n"
+							"--scrub-order-by-health: scrub devices whose errors have risen first and alone, then the slowest, using history from the state file\n"
+							"--scrub-stats-file FILE: publish per-device scrub progress, throughput, ETA, and errors in FILE\n"
+							"--scrub-stats-interval MS: update the scrub statistics file every MS milliseconds (default 1000)\n"
+							"--balance-target MIB: relocate the emptiest chunks until about MIB MiB of unallocated space is freed (default 0, meaning as much as relocating data chunks under 30%% and metadata chunks under 10%% full would free)\n"
+							"--balance-budget LIMIT: stop balancing after LIMIT, a time ending in s, m, or h or an amount of data ending in K, M, G, or T, pausing the balance for the next run to resume\n"
+							"--balance-min-unallocated PERCENT: skip balancing if at least PERCENT%% of every device is unallocated and --balance-max-slack holds (default 10)\n"
+							"--balance-max-slack PERCENT: skip balancing if at most PERCENT%% of allocated space is unused and --balance-min-unallocated holds (default 20)\n"
+							"--trim-batch MIB: trim MIB MiB of the filesystem at a time (default 0, meaning all at once)\n"
+							"--trim-pause MS: pause for MS milliseconds between trim batches (default 0)\n"
+							"--trim-minlen KIB: do not trim free extents smaller than KIB KiB (default 0, meaning the devices’ discard granularity)\n"
+							"--jobs/-j N: defragment using N threads (default 1)\n"
+							"--defrag-queue-depth N: scan and defragment on separate threads, with up to N files waiting between them (default 0, meaning the same thread)\n"
+							"--defrag-min-fragments N: skip files with fewer than N fragments (default 0, meaning defragment every file without checking)\n"
+							"--defrag-incremental: defragment only files changed since the previous run (requires --state-file)\n"
+							"--defrag-subvolumes: defragment each writable subvolume as a separate unit, skipping read-only subvolumes\n"
+							"--defrag-time-budget SECONDS: measure files first, then defragment the most fragmented first, stopping after SECONDS\n"
+							"--defrag-window MIB: defragment bigger files MIB MiB at a time, remembering progress in the state file (default 0, meaning whole files)\n"
+							"--max-defrag-rate MIB: defragment at most MIB MiB per second, across all threads (default 0, meaning no limit)\n"
+							"--defrag-rate-adaptive: go below --max-defrag-rate while the filesystem’s devices are slow to respond\n"
+							"--defrag-compress ALGORITHM: recompress cold, compressible files with zlib, lzo, or zstd while defragmenting them\n"
+							"--defrag-compress-age DAYS: count files unmodified for DAYS days as cold (default 30)\n"
+							"--defrag-compress-min-size KIB: do not recompress files smaller than KIB KiB (default 128)\n"
+							"--io-uring: open and examine files for defragmentation in batches using io_uring, if available\n"
+							"--state-file FILE: remember progress between runs in FILE\n"
 							"--verbose/-v: show verbose output during operations\n"
 							"--help/-h: display this message\n"
 							"--version/-V: show version number\n\n"
 							"mountpoint ...: one or more btrfs filesystem mount points to maintain\n", argv[0]);
 					return EXIT_SUCCESS;
 
+				case 'P':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("scrub-parallelism", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						scrub_options.parallelism = (unsigned int) value;
+					}
+					break;
+
+				case 'X':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("scrub-speed-max", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						scrub_options.speed_max_mib = (unsigned int) value;
+					}
+					break;
+
+				case 'M':
+					scrub_options.stats_file = optarg;
+					break;
+
+				case 'I':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("scrub-stats-interval", optarg, 1, INT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						scrub_options.stats_interval_ms = (unsigned int) value;
+					}
+					break;
+
+				case 'B':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("balance-target", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						balance_options.target_mib = (unsigned int) value;
+					}
+					break;
+
+				case 'U':
+					{
+						char *end;
+						errno = 0;
+						unsigned long long value = strtoull(optarg, &end, 10);
+						unsigned long long scale = 0;
+						bool bytes = false;
+						if(!strcmp(end, "s")) {
+							scale = 1;
+						} else if(!strcmp(end, "m")) {
+							scale = 60;
+						} else if(!strcmp(end, "h")) {
+							scale = 60 * 60;
+						} else if(strlen(end) == 1 && strchr("KMGT", *end)) {
+							scale = 1ULL << (10 * (strchr("KMGT", *end) - "KMGT" + 1));
+							bytes = true;
+						}
+						if(optarg[0] < '1' || optarg[0] > '9' || !scale || errno == ERANGE || value > (bytes ? UINT64_MAX : UINT_MAX / 1000) / scale) {
+							fprintf(stderr, "--balance-budget: expected a positive integer followed by s, m, h, K, M, G, or T, got “%s”\n", optarg);
+							return EXIT_FAILURE;
+						}
+						if(bytes) {
+							balance_options.budget_bytes = value * scale;
+						} else {
+							balance_options.budget_seconds = (unsigned int) (value * scale);
+						}
+					}
+					break;
+
+				case 'L':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("balance-min-unallocated", optarg, 0, 100, &value)) {
+							return EXIT_FAILURE;
+						}
+						balance_options.min_unallocated_percent = (unsigned int) value;
+					}
+					break;
+
+				case 'K':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("balance-max-slack", optarg, 0, 100, &value)) {
+							return EXIT_FAILURE;
+						}
+						balance_options.max_slack_percent = (unsigned int) value;
+					}
+					break;
+
+				case 'G':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("trim-batch", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						trim_options.batch_mib = (unsigned int) value;
+					}
+					break;
+
+				case 'H':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("trim-pause", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						trim_options.pause_ms = (unsigned int) value;
+					}
+					break;
+
+				case 'N':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("trim-minlen", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						trim_options.minlen_kib = (unsigned int) value;
+					}
+					break;
+
+				case 'j':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("jobs", optarg, 1, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.jobs = (unsigned int) value;
+					}
+					break;
+
+				case 'Q':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("defrag-queue-depth", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.queue_depth = (unsigned int) value;
+					}
+					break;
+
+				case 'F':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("defrag-min-fragments", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.min_fragments = (unsigned int) value;
+					}
+					break;
+
+				case 'T':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("defrag-time-budget", optarg, 1, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.time_budget = (unsigned int) value;
+					}
+					break;
+
+				case 'W':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("defrag-window", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.window_mib = (unsigned int) value;
+					}
+					break;
+
+				case 'R':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("max-defrag-rate", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.max_rate_mib = (unsigned int) value;
+					}
+					break;
+
+				case 'C':
+					if(!strcmp(optarg, "zlib")) {
+						defrag_options.compress_type = 1;
+					} else if(!strcmp(optarg, "lzo")) {
+						defrag_options.compress_type = 2;
+					} else if(!strcmp(optarg, "zstd")) {
+						defrag_options.compress_type = 3;
+					} else {
+						fprintf(stderr, "--defrag-compress: expected zlib, lzo, or zstd, got “%s”\n", optarg);
+						return EXIT_FAILURE;
+					}
+					break;
+
+				case 'A':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("defrag-compress-age", optarg, 0, UINT_MAX, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.compress_min_age_days = (unsigned int) value;
+					}
+					break;
+
+				case 'Z':
+					{
+						unsigned long long value;
+						if(!parse_unsigned("defrag-compress-min-size", optarg, 0, UINT_MAX / 1024, &value)) {
+							return EXIT_FAILURE;
+						}
+						defrag_options.compress_min_kib = (unsigned int) value;
+					}
+					break;
+
+				case 'S':
+					state_file = optarg;
+					break;
+
 				case 'v':
 					verbose = true;
 					break;
@@ -73,32 +388,84 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	if(parallel_filesystems && scrub_options.stats_file) {
+		fputs("--parallel-filesystems and --scrub-stats-file cannot be used together.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(scrub_order_by_health && !state_file) {
+		fputs("--scrub-order-by-health requires --state-file.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(defrag_incremental && !state_file) {
+		fputs("--defrag-incremental requires --state-file.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(defrag_incremental && defrag_subvolumes) {
+		fputs("--defrag-incremental and --defrag-subvolumes cannot be used together.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(defrag_options.time_budget && defrag_options.queue_depth) {
+		fputs("--defrag-time-budget and --defrag-queue-depth cannot be used together.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(defrag_options.time_budget && defrag_incremental) {
+		fputs("--defrag-time-budget and --defrag-incremental cannot be used together.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(defrag_rate_adaptive && !defrag_options.max_rate_mib) {
+		fputs("--defrag-rate-adaptive requires --max-defrag-rate.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	scrub_options.order_by_health = scrub_order_by_health;
+	defrag_options.incremental = defrag_incremental;
+	defrag_options.adaptive_rate = defrag_rate_adaptive;
+	defrag_options.by_subvolume = defrag_subvolumes;
+	defrag_options.io_uring = io_uring;
+	if(!state_open(state_file)) {
+		return EXIT_FAILURE;
+	}
+
 	// Do work.
 	bool ok = true;
-	if(scrub) {
-		for(int i = optind; i != argc; ++i) {
-			ok &= do_scrub(argv[i], verbose);
+	if(parallel_filesystems) {
+		const struct steps steps = {
+			.scrub = scrub,
+			.defrag = defrag,
+			.balance = balance,
+			.trim = trim,
+			.scrub_options = &scrub_options,
+			.defrag_options = &defrag_options,
+			.balance_options = &balance_options,
+			.trim_options = &trim_options,
+		};
+		ok = do_parallel(argv + optind, (size_t) (argc - optind), verbose, &steps);
+	} else {
+		if(scrub) {
+			for(int i = optind; i != argc; ++i) {
+				ok &= do_scrub(argv[i], verbose, &scrub_options);
+			}
 		}
-	}
-	for(int i = optind; i != argc; ++i) {
-		ok &= do_devstats(argv[i], verbose);
-	}
-	if(defrag) {
 		for(int i = optind; i != argc; ++i) {
-			ok &= do_defrag(argv[i], verbose);
+			ok &= do_devstats(argv[i], verbose);
 		}
-	}
-	if(balance) {
-		for(int i = optind; i != argc; ++i) {
-			ok &= do_balance(argv[i], verbose);
+		if(defrag) {
+			for(int i = optind; i != argc; ++i) {
+				ok &= do_defrag(argv[i], verbose, &defrag_options);
+			}
 		}
-	}
-	if(trim) {
-		for(int i = optind; i != argc; ++i) {
-			ok &= do_trim(argv[i], verbose);
+		if(balance) {
+			for(int i = optind; i != argc; ++i) {
+				ok &= do_balance(argv[i], verbose, &balance_options);
+			}
+		}
+		if(trim) {
+			for(int i = optind; i != argc; ++i) {
+				ok &= do_trim(argv[i], verbose, &trim_options);
+			}
 		}
 	}
 
 	// Done.
+	state_close();
 	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -2,11 +2,138 @@
 #define OPS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-bool do_scrub(const char *mountpoint, bool verbose);
+struct scrub_options {
+	// The file through which to publish scrub statistics, or null not to,
+	// and how many milliseconds apart to update it.
+	const char *stats_file;
+	unsigned int stats_interval_ms;
+
+	// The maximum number of devices to scrub at once, or zero for all of
+	// them.
+	unsigned int parallelism;
+
+	// The per-device scrub speed limit in MiB per second to set for the
+	// duration of the scrub, where the kernel supports one, or zero to leave
+	// the limits alone.
+	unsigned int speed_max_mib;
+
+	// Whether to scrub devices whose error counters have risen since the
+	// previous run first and alone, followed by those that were slowest, using
+	// the history kept in the state file.
+	bool order_by_health;
+};
+
+struct defrag_options {
+	// The number of worker threads to scan and defragment with.
+	unsigned int jobs;
+
+	// The number of opened files that may wait between the scan stage and the
+	// defragment stage, or zero to defragment each file as it is found.
+	unsigned int queue_depth;
+
+	// The minimum number of discontiguities involving small extents a file
+	// must have to be defragmented, or zero to defragment every file without
+	// checking.
+	unsigned int min_fragments;
+
+	// Whether to defragment only files changed since the previous run, as
+	// recorded in the state file, rather than scanning the whole tree.
+	bool incremental;
+
+	// The number of seconds to spend on defragmentation, or zero for no limit.
+	// With a limit, files are measured first and the most fragmented per byte
+	// are defragmented first.
+	unsigned int time_budget;
+
+	// The size in MiB of the byte ranges in which files bigger than that are
+	// defragmented, with progress remembered in the state file after each, or
+	// zero to defragment each file in one go.
+	unsigned int window_mib;
+
+	// The maximum number of MiB per second to give to the defragment ioctl,
+	// or zero for no limit, and whether to go below it while the devices are
+	// busy.
+	unsigned int max_rate_mib;
+	bool adaptive_rate;
+
+	// The compression algorithm (as in btrfs_ioctl_defrag_range_args) with
+	// which to recompress cold files while defragmenting them, or zero not to;
+	// and how many days since it was last modified and how many KiB big a
+	// file must be to count as cold.
+	unsigned int compress_type;
+	unsigned int compress_min_age_days;
+	unsigned int compress_min_kib;
+
+	// Whether to list the subvolumes up front and scan each writable one as
+	// a separate unit, rather than finding subvolumes during the scan.
+	bool by_subvolume;
+
+	// Whether to open and examine files in batches through io_uring, where
+	// the kernel allows it.
+	bool io_uring;
+
+	// If not null, called with wait_for_disks_arg before the first defragment
+	// ioctl, to wait until the disks may be kept busy; returns false if a
+	// termination signal arrived meanwhile. It may be called from several
+	// threads and more than once, so must return straight away once it has
+	// returned true. Used with --parallel-filesystems, where the scan runs
+	// alongside other steps but rewriting file data does not.
+	bool (*wait_for_disks)(void *arg);
+	void *wait_for_disks_arg;
+};
+
+struct balance_options {
+	// The unallocated space in MiB to aim to free by relocating the emptiest
+	// chunks, or zero for as much as relocating every chunk below the fixed
+	// usage thresholds would free.
+	unsigned int target_mib;
+
+	// The number of seconds or bytes of data to spend on relocation, or zero
+	// for no limit. With a limit, each pass runs in rounds, and a round still
+	// running when the time runs out is paused for the next run to resume.
+	unsigned int budget_seconds;
+	uint64_t budget_bytes;
+
+	// The bounds within which allocation counts as healthy, so that the
+	// balance is skipped: the least share of each device that must be
+	// unallocated, and the most share of the space allocated to chunks that
+	// may be unused, in percent.
+	unsigned int min_unallocated_percent;
+	unsigned int max_slack_percent;
+};
+
+struct trim_options {
+	// The size in MiB of the logical address ranges to trim one at a time, or
+	// zero to trim the whole filesystem at once, and the number of
+	// milliseconds to pause between them.
+	unsigned int batch_mib;
+	unsigned int pause_ms;
+
+	// The length in KiB below which free extents are not trimmed, or zero to
+	// use the largest discard granularity of the filesystem’s devices.
+	unsigned int minlen_kib;
+};
+
+// The steps to run on each filesystem, for running them on several at once.
+struct steps {
+	bool scrub;
+	bool defrag;
+	bool balance;
+	bool trim;
+	const struct scrub_options *scrub_options;
+	const struct defrag_options *defrag_options;
+	const struct balance_options *balance_options;
+	const struct trim_options *trim_options;
+};
+
+bool do_scrub(const char *mountpoint, bool verbose, const struct scrub_options *options);
 bool do_devstats(const char *mountpoint, bool verbose);
-bool do_defrag(const char *mountpoint, bool verbose);
-bool do_balance(const char *mountpoint, bool verbose);
-bool do_trim(const char *mountpoint, bool verbose);
+bool do_defrag(const char *mountpoint, bool verbose, const struct defrag_options *options);
+bool do_balance(const char *mountpoint, bool verbose, const struct balance_options *options);
+bool do_trim(const char *mountpoint, bool verbose, const struct trim_options *options);
+bool do_parallel(char *const *mountpoints, size_t count, bool verbose, const struct steps *steps);
 
 #endif
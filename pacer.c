@@ -0,0 +1,159 @@
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pacer.h"
+#include "util.h"
+
+static const uint64_t NANOSECONDS_PER_SECOND = 1000000000;
+
+// How much higher than the baseline the average latency of an I/O must be for
+// the pacer to back off, and how slowly the baseline follows latency upwards.
+static const double LATENCY_FACTOR = 2.0;
+static const double LATENCY_FLOOR_MS = 1.0;
+static const double BASELINE_DRIFT = 1.0 / 32.0;
+
+bool pacer_init(struct pacer *pacer, uint64_t max_rate) {
+	if(mtx_init(&pacer->lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		return false;
+	}
+	pacer->max_rate = max_rate;
+	pacer->rate = max_rate;
+	pacer->tokens = (int64_t) max_rate;
+	pacer->last_refill_ns = monotonic_ns();
+	pacer->devices = 0;
+	pacer->device_count = 0;
+	pacer->last_sample_ns = 0;
+	pacer->last_ios = 0;
+	pacer->last_ticks = 0;
+	pacer->baseline_latency = 0;
+	pacer->backoffs = 0;
+	return true;
+}
+
+// Turns on adaptive mode, using the devices listed for the filesystem in
+// sysfs.
+bool pacer_adapt(struct pacer *pacer, const char *fsid) {
+	char path[64 + FSID_STRING_SIZE];
+	sprintf(path, "/sys/fs/btrfs/%s/devices", fsid);
+	DIR *dir = opendir(path);
+	if(!dir) {
+		perror(path);
+		return false;
+	}
+	bool ok = true;
+	size_t capacity = 0;
+	const struct dirent *de;
+	while(ok && (de = readdir(dir))) {
+		if(de->d_name[0] == '.') {
+			continue;
+		}
+		if(pacer->device_count == capacity) {
+			size_t new_capacity = capacity ? capacity * 2 : 4;
+			char **new_devices = realloc(pacer->devices, new_capacity * sizeof(*new_devices));
+			if(!new_devices) {
+				perror("realloc");
+				ok = false;
+				break;
+			}
+			pacer->devices = new_devices;
+			capacity = new_capacity;
+		}
+		pacer->devices[pacer->device_count] = strdup(de->d_name);
+		if(pacer->devices[pacer->device_count]) {
+			++pacer->device_count;
+		} else {
+			perror("strdup");
+			ok = false;
+		}
+	}
+	closedir(dir);
+	return ok;
+}
+
+void pacer_deinit(struct pacer *pacer) {
+	for(size_t i = 0; i != pacer->device_count; ++i) {
+		free(pacer->devices[i]);
+	}
+	free(pacer->devices);
+	mtx_destroy(&pacer->lock);
+}
+
+static bool is_paced_device(const struct pacer *pacer, const char *name) {
+	for(size_t i = 0; i != pacer->device_count; ++i) {
+		if(!strcmp(pacer->devices[i], name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads the completed I/Os and the milliseconds spent on them for the
+// filesystem’s devices, and adjusts the rate based on the average latency
+// since the previous sample. Must be called with the lock held.
+static void sample(struct pacer *pacer, uint64_t now) {
+	FILE *fp = fopen("/proc/diskstats", "r");
+	if(!fp) {
+		return;
+	}
+	uint64_t ios = 0, ticks = 0;
+	char line[256];
+	while(fgets(line, sizeof(line), fp)) {
+		char name[64];
+		uint64_t reads, read_ticks, writes, write_ticks;
+		if(sscanf(line, "%*u %*u %63s %" SCNu64 " %*u %*u %" SCNu64 " %" SCNu64 " %*u %*u %" SCNu64, name, &reads, &read_ticks, &writes, &write_ticks) == 5 && is_paced_device(pacer, name)) {
+			ios += reads + writes;
+			ticks += read_ticks + write_ticks;
+		}
+	}
+	fclose(fp);
+
+	if(pacer->last_sample_ns && ios > pacer->last_ios) {
+		double latency = (double) (ticks - pacer->last_ticks) / (double) (ios - pacer->last_ios);
+		if(!pacer->baseline_latency || latency < pacer->baseline_latency) {
+			pacer->baseline_latency = latency;
+		} else {
+			pacer->baseline_latency += (latency - pacer->baseline_latency) * BASELINE_DRIFT;
+		}
+		uint64_t min_rate = pacer->max_rate / 64 ? pacer->max_rate / 64 : 1;
+		if(latency > pacer->baseline_latency * LATENCY_FACTOR && latency > LATENCY_FLOOR_MS) {
+			pacer->rate = pacer->rate / 2 > min_rate ? pacer->rate / 2 : min_rate;
+			++pacer->backoffs;
+		} else {
+			uint64_t step = pacer->max_rate / 16;
+			pacer->rate = pacer->max_rate - pacer->rate > step ? pacer->rate + step : pacer->max_rate;
+		}
+	}
+	pacer->last_sample_ns = now;
+	pacer->last_ios = ios;
+	pacer->last_ticks = ticks;
+}
+
+// Charges bytes against the bucket and returns how many nanoseconds the
+// caller should wait before going ahead.
+uint64_t pacer_charge(struct pacer *pacer, uint64_t bytes) {
+	mtx_lock(&pacer->lock);
+	uint64_t now = monotonic_ns();
+	if(pacer->device_count && now - pacer->last_sample_ns >= NANOSECONDS_PER_SECOND) {
+		sample(pacer, now);
+	}
+
+	// Refill, letting at most one second’s worth build up while idle.
+	double refill = (double) (now - pacer->last_refill_ns) * (double) pacer->rate / (double) NANOSECONDS_PER_SECOND;
+	if(pacer->tokens + refill > (double) pacer->rate) {
+		pacer->tokens = (int64_t) pacer->rate;
+	} else {
+		pacer->tokens += (int64_t) refill;
+	}
+	pacer->last_refill_ns = now;
+
+	pacer->tokens -= (int64_t) bytes;
+	uint64_t wait_ns = 0;
+	if(pacer->tokens < 0) {
+		wait_ns = (uint64_t) ((double) -pacer->tokens * (double) NANOSECONDS_PER_SECOND / (double) pacer->rate);
+	}
+	mtx_unlock(&pacer->lock);
+	return wait_ns;
+}
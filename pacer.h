@@ -0,0 +1,40 @@
+#if !defined(PACER_H)
+#define PACER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
+
+// A token bucket limiting how many bytes per second are handed to some
+// operation, shared by any number of threads. Callers charge the bytes they
+// are about to use and then wait as long as they are told to; time owed is
+// carried forward, so callers that arrive together queue up behind each
+// other.
+//
+// In adaptive mode, the pacer also samples the I/O latency of a filesystem’s
+// devices from /proc/diskstats at most once a second, halving the rate when
+// latency rises well above the lowest seen recently and creeping back up to
+// the maximum while it stays low.
+struct pacer {
+	mtx_t lock;
+	uint64_t max_rate;
+	uint64_t rate;
+	int64_t tokens;
+	uint64_t last_refill_ns;
+
+	char **devices;
+	size_t device_count;
+	uint64_t last_sample_ns;
+	uint64_t last_ios;
+	uint64_t last_ticks;
+	double baseline_latency;
+	unsigned int backoffs;
+};
+
+bool pacer_init(struct pacer *pacer, uint64_t max_rate);
+bool pacer_adapt(struct pacer *pacer, const char *fsid);
+void pacer_deinit(struct pacer *pacer);
+uint64_t pacer_charge(struct pacer *pacer, uint64_t bytes);
+
+#endif
@@ -0,0 +1,578 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <linux/btrfs.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include "ops.h"
+#include "util.h"
+
+// The maintenance steps, each run on each filesystem as a separate job.
+enum phase {
+	PHASE_SCRUB,
+	PHASE_DEVSTATS,
+	PHASE_DEFRAG,
+	PHASE_BALANCE,
+	PHASE_TRIM,
+	PHASE_COUNT,
+};
+
+struct phase_info {
+	const char *name;
+
+	// Whether the step keeps the filesystem’s disks busy, so that no other
+	// such step may run on any of those disks at the same time. A light step
+	// may still keep them busy for part of its run; see wait_for_disks.
+	bool heavy;
+
+	// The steps on the same filesystem that must finish first, as a mask of
+	// 1 << phase bits.
+	unsigned int after;
+};
+
+// The statistics check comes after scrub, which can raise the counters, and
+// trim comes last. Defragmentation follows scrub, as it does when the steps
+// run one after another, and balance follows defragmentation, which can leave
+// partly used chunks behind for it to compact. Defragmentation’s scan is
+// mostly bound by metadata, so it starts as a light step, but its defragment
+// stage rewrites file data and waits for the disks like the heavy steps do.
+static const struct phase_info PHASES[PHASE_COUNT] = {
+	[PHASE_SCRUB] = { .name = "scrub", .heavy = true, .after = 0, },
+	[PHASE_DEVSTATS] = { .name = "statistics", .heavy = false, .after = 1U << PHASE_SCRUB, },
+	[PHASE_DEFRAG] = { .name = "defragment", .heavy = false, .after = 1U << PHASE_SCRUB, },
+	[PHASE_BALANCE] = { .name = "balance", .heavy = true, .after = 1U << PHASE_DEFRAG, },
+	[PHASE_TRIM] = { .name = "trim", .heavy = true, .after = (1U << PHASE_SCRUB) | (1U << PHASE_DEVSTATS) | (1U << PHASE_DEFRAG) | (1U << PHASE_BALANCE), },
+};
+
+enum job_state {
+	JOB_WAITING,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+// One step on one filesystem. A step that is not to be run at all starts out
+// done, without having been started.
+struct job {
+	struct filesystem *fs;
+	enum phase phase;
+	enum job_state state;
+	bool started;
+	bool ok;
+	thrd_t thread;
+
+	// When the job started and finished, and the job whose finishing let it
+	// start, if it did not start straight away, for the timeline.
+	uint64_t start_ns;
+	uint64_t end_ns;
+	struct job *blocker;
+	bool critical;
+
+	// For a light step, whether it is waiting to keep the disks busy and
+	// whether it is doing so, and since when.
+	bool awaiting_disks;
+	bool holding_disks;
+	uint64_t holding_ns;
+
+	// The next job in the list of those finished but not yet handled.
+	struct job *next_finished;
+};
+
+// One filesystem being maintained alongside others.
+struct filesystem {
+	const char *mountpoint;
+	struct parallel *parallel;
+
+	// The disks underneath the filesystem’s devices, as sysfs directories,
+	// or as device paths where those cannot be found.
+	char **disks;
+	size_t disk_count;
+	size_t disk_capacity;
+
+	struct job jobs[PHASE_COUNT];
+};
+
+struct parallel {
+	bool verbose;
+	const struct steps *steps;
+	struct filesystem *filesystems;
+	size_t count;
+	uint64_t start_ns;
+
+	// Protects the jobs, running, and finished; finished_cond is broadcast
+	// when a job is added to finished.
+	mtx_t lock;
+	cnd_t finished_cond;
+	size_t running;
+	struct job *finished;
+};
+
+static bool add_disk(struct filesystem *fs, const char *disk) {
+	for(size_t i = 0; i != fs->disk_count; ++i) {
+		if(!strcmp(fs->disks[i], disk)) {
+			return true;
+		}
+	}
+	if(fs->disk_count == fs->disk_capacity) {
+		size_t new_capacity = fs->disk_capacity ? fs->disk_capacity * 2 : 4;
+		char **new_disks = realloc(fs->disks, new_capacity * sizeof(*new_disks));
+		if(!new_disks) {
+			perror("realloc");
+			return false;
+		}
+		fs->disks = new_disks;
+		fs->disk_capacity = new_capacity;
+	}
+	fs->disks[fs->disk_count] = strdup(disk);
+	if(!fs->disks[fs->disk_count]) {
+		perror("strdup");
+		return false;
+	}
+	++fs->disk_count;
+	return true;
+}
+
+// Adds the disks underneath the block device whose sysfs directory is path. A
+// device-mapper or MD device lists the devices it is built on in its slaves
+// directory; a partition’s directory lies within its disk’s and has a
+// partition file.
+static bool add_disks_under(struct filesystem *fs, char *path) {
+	char slaves[PATH_MAX];
+	snprintf(slaves, sizeof(slaves), "%s/slaves", path);
+	DIR *dir = opendir(slaves);
+	if(dir) {
+		bool ok = true, found = false;
+		const struct dirent *de;
+		while(ok && (de = readdir(dir))) {
+			if(de->d_name[0] == '.') {
+				continue;
+			}
+			char slave[PATH_MAX + 256];
+			snprintf(slave, sizeof(slave), "%s/%s", slaves, de->d_name);
+			char *slave_path = realpath(slave, 0);
+			if(slave_path) {
+				ok = add_disks_under(fs, slave_path);
+				free(slave_path);
+				found = true;
+			}
+		}
+		closedir(dir);
+		if(found || !ok) {
+			return ok;
+		}
+	}
+
+	char partition[PATH_MAX];
+	snprintf(partition, sizeof(partition), "%s/partition", path);
+	if(!access(partition, F_OK)) {
+		*strrchr(path, '/') = '\0';
+	}
+	return add_disk(fs, path);
+}
+
+static bool add_device_disks(const struct btrfs_ioctl_fs_info_args *fs_info, const struct btrfs_ioctl_dev_info_args *dev_info, void *fs_raw) {
+	(void) fs_info;
+
+	struct filesystem *fs = fs_raw;
+	const char *device = (const char *) dev_info->path;
+	struct stat st;
+	if(stat(device, &st) < 0 || !S_ISBLK(st.st_mode)) {
+		return add_disk(fs, device);
+	}
+	char link[64];
+	sprintf(link, "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	char *path = realpath(link, 0);
+	if(!path) {
+		return add_disk(fs, device);
+	}
+	bool ok = add_disks_under(fs, path);
+	free(path);
+	return ok;
+}
+
+// Finds the disks underneath a filesystem’s devices.
+static bool find_disks(struct filesystem *fs) {
+	int fd = open(fs->mountpoint, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		perror(fs->mountpoint);
+		return false;
+	}
+	bool ok = for_each_device(fs->mountpoint, fd, &add_device_disks, fs);
+	close(fd);
+	return ok;
+}
+
+// Returns a disk underneath both filesystems, or null if there is none.
+static const char *shared_disk(const struct filesystem *x, const struct filesystem *y) {
+	for(size_t i = 0; i != x->disk_count; ++i) {
+		for(size_t j = 0; j != y->disk_count; ++j) {
+			if(!strcmp(x->disks[i], y->disks[j])) {
+				return x->disks[i];
+			}
+		}
+	}
+	return 0;
+}
+
+// Returns whether a job may keep its disks busy now: no running job keeping
+// the disks busy shares one with it, nor does a job of an earlier step
+// waiting to do so, since earlier steps go first. Must be called with the
+// lock held.
+static bool disks_free(const struct parallel *parallel, const struct job *job) {
+	for(size_t i = 0; i != parallel->count; ++i) {
+		const struct filesystem *other = &parallel->filesystems[i];
+		if(!shared_disk(job->fs, other)) {
+			continue;
+		}
+		for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+			const struct job *o = &other->jobs[phase];
+			if(o == job) {
+				continue;
+			}
+			if(o->state == JOB_RUNNING && (PHASES[phase].heavy || o->holding_disks)) {
+				return false;
+			}
+			if(o->awaiting_disks && phase < job->phase) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Returns whether a waiting job may start now: the steps it comes after on its
+// filesystem are done and, if it is heavy, its disks are free. Must be called
+// with the lock held.
+static bool may_start(const struct parallel *parallel, const struct job *job) {
+	for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+		if((PHASES[job->phase].after & (1U << phase)) && job->fs->jobs[phase].state != JOB_DONE) {
+			return false;
+		}
+	}
+	return !PHASES[job->phase].heavy || disks_free(parallel, job);
+}
+
+// Called by a running light job, through its options, before it starts
+// keeping the disks busy: waits until its disks are free and then counts the
+// job as heavy until it finishes. Returns false if a termination signal
+// arrived while waiting. The wait is in slices, since the signal is only left
+// pending rather than waking anything.
+static bool wait_for_disks(void *job_raw) {
+	static const long SLICE_NS = 100000000;
+	struct job *job = job_raw;
+	struct parallel *parallel = job->fs->parallel;
+	mtx_lock(&parallel->lock);
+	job->awaiting_disks = !job->holding_disks;
+	while(job->awaiting_disks) {
+		if(termination_pending()) {
+			job->awaiting_disks = false;
+			mtx_unlock(&parallel->lock);
+			return false;
+		}
+		if(disks_free(parallel, job)) {
+			break;
+		}
+		struct timespec until;
+		timespec_get(&until, TIME_UTC);
+		until.tv_nsec += SLICE_NS;
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_nsec -= 1000000000;
+			++until.tv_sec;
+		}
+		cnd_timedwait(&parallel->finished_cond, &parallel->lock, &until);
+	}
+	if(job->awaiting_disks) {
+		job->awaiting_disks = false;
+		job->holding_disks = true;
+		job->holding_ns = monotonic_ns();
+	}
+	mtx_unlock(&parallel->lock);
+	return true;
+}
+
+static int job_thread_proc(void *job_raw) {
+	struct job *job = job_raw;
+	struct filesystem *fs = job->fs;
+	struct parallel *parallel = fs->parallel;
+	const struct steps *steps = parallel->steps;
+	struct defrag_options defrag_options;
+	bool ok = true;
+	switch(job->phase) {
+		case PHASE_SCRUB:
+			ok = do_scrub(fs->mountpoint, parallel->verbose, steps->scrub_options);
+			break;
+
+		case PHASE_DEVSTATS:
+			ok = do_devstats(fs->mountpoint, parallel->verbose);
+			break;
+
+		case PHASE_DEFRAG:
+			// The scan runs alongside anything, but the defragment stage waits
+			// for the disks.
+			defrag_options = *steps->defrag_options;
+			defrag_options.wait_for_disks = &wait_for_disks;
+			defrag_options.wait_for_disks_arg = job;
+			ok = do_defrag(fs->mountpoint, parallel->verbose, &defrag_options);
+			break;
+
+		case PHASE_BALANCE:
+			ok = do_balance(fs->mountpoint, parallel->verbose, steps->balance_options);
+			break;
+
+		case PHASE_TRIM:
+			ok = do_trim(fs->mountpoint, parallel->verbose, steps->trim_options);
+			break;
+
+		case PHASE_COUNT:
+			abort();
+	}
+
+	mtx_lock(&parallel->lock);
+	job->ok = ok;
+	job->end_ns = monotonic_ns();
+	job->next_finished = parallel->finished;
+	parallel->finished = job;
+	cnd_broadcast(&parallel->finished_cond);
+	mtx_unlock(&parallel->lock);
+	return 0;
+}
+
+// Starts every waiting job that may start now, recording trigger as what each
+// was waiting for. Earlier steps go first, as in the sequential mode, so that
+// one filesystem’s scrub gets a shared disk before another’s balance; then
+// filesystems go in the order given. Must be called with the lock held.
+static bool start_jobs(struct parallel *parallel, struct job *trigger) {
+	for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+		for(size_t i = 0; i != parallel->count; ++i) {
+			struct job *job = &parallel->filesystems[i].jobs[phase];
+			if(job->state != JOB_WAITING || !may_start(parallel, job)) {
+				continue;
+			}
+			job->start_ns = monotonic_ns();
+			job->blocker = trigger;
+			int rc = thrd_create(&job->thread, &job_thread_proc, job);
+			if(rc == thrd_nomem) {
+				fprintf(stderr, "thrd_create: %s\n", strerror(ENOMEM));
+				return false;
+			} else if(rc == thrd_error) {
+				fputs("thrd_create: failed\n", stderr);
+				return false;
+			} else if(rc != thrd_success) {
+				fputs("thrd_create: unknown error\n", stderr);
+				return false;
+			}
+			job->state = JOB_RUNNING;
+			job->started = true;
+			++parallel->running;
+		}
+	}
+	return true;
+}
+
+// Waits for a job to finish and marks it done, returning it, or returns null
+// if none is running. Must be called with the lock held.
+static struct job *wait_job(struct parallel *parallel) {
+	while(!parallel->finished && parallel->running) {
+		cnd_wait(&parallel->finished_cond, &parallel->lock);
+	}
+	struct job *job = parallel->finished;
+	if(job) {
+		parallel->finished = job->next_finished;
+		job->state = JOB_DONE;
+		--parallel->running;
+
+		// A job waiting for its disks may now find them free.
+		cnd_broadcast(&parallel->finished_cond);
+	}
+	return job;
+}
+
+// Shows when each job ran, marking the critical path: the chain of jobs, each
+// waiting for the one before, that ends with the last to finish.
+static void show_timeline(struct parallel *parallel) {
+	size_t started = 0;
+	struct job *last = 0;
+	for(size_t i = 0; i != parallel->count; ++i) {
+		for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+			struct job *job = &parallel->filesystems[i].jobs[phase];
+			if(job->started) {
+				++started;
+				if(!last || job->end_ns > last->end_ns) {
+					last = job;
+				}
+			}
+		}
+	}
+	if(!last) {
+		return;
+	}
+	size_t critical = 0;
+	for(struct job *job = last; job; job = job->blocker) {
+		job->critical = true;
+		++critical;
+	}
+
+	// Show the jobs in the order they started. There are only a handful.
+	const struct job **order = malloc(started * sizeof(*order));
+	if(!order) {
+		perror("malloc");
+		return;
+	}
+	size_t n = 0;
+	for(size_t i = 0; i != parallel->count; ++i) {
+		for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+			const struct job *job = &parallel->filesystems[i].jobs[phase];
+			if(job->started) {
+				size_t j = n++;
+				while(j && order[j - 1]->start_ns > job->start_ns) {
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = job;
+			}
+		}
+	}
+	puts("Timeline (start, end, and duration in seconds; * marks the critical path):");
+	for(size_t i = 0; i != n; ++i) {
+		const struct job *job = order[i];
+		printf("%c %8.1f %8.1f %8.1f  %s %s", job->critical ? '*' : ' ', (double) (job->start_ns - parallel->start_ns) / 1e9, (double) (job->end_ns - parallel->start_ns) / 1e9, (double) (job->end_ns - job->start_ns) / 1e9, job->fs->mountpoint, PHASES[job->phase].name);
+		if(job->holding_disks) {
+			printf(" (disks busy from %.1f)", (double) (job->holding_ns - parallel->start_ns) / 1e9);
+		}
+		putchar('\n');
+	}
+	printf("Critical path: %zu step(s), finishing after %.1f s\n", critical, (double) (last->end_ns - parallel->start_ns) / 1e9);
+	free(order);
+}
+
+static bool do_parallel_jobs(struct parallel *parallel) {
+	bool ok = true;
+	for(size_t i = 0; i != parallel->count; ++i) {
+		ok &= find_disks(&parallel->filesystems[i]);
+	}
+	if(!ok) {
+		return false;
+	}
+	if(parallel->verbose) {
+		for(size_t i = 0; i != parallel->count; ++i) {
+			for(size_t j = i + 1; j != parallel->count; ++j) {
+				const char *disk = shared_disk(&parallel->filesystems[i], &parallel->filesystems[j]);
+				if(disk) {
+					printf("%s and %s share %s, so their scrubs, defragmentation, balances, and trims will take turns\n", parallel->filesystems[i].mountpoint, parallel->filesystems[j].mountpoint, disk);
+				}
+			}
+		}
+		fflush(stdout);
+	}
+
+	// Start jobs as the jobs they wait for finish, until all are done or a
+	// termination signal means no more should start.
+	parallel->start_ns = monotonic_ns();
+	mtx_lock(&parallel->lock);
+	struct job *trigger = 0;
+	for(;;) {
+		if(!termination_pending() && !start_jobs(parallel, trigger)) {
+			ok = false;
+			break;
+		}
+		if(!(trigger = wait_job(parallel))) {
+			break;
+		}
+	}
+	while(wait_job(parallel));
+	mtx_unlock(&parallel->lock);
+
+	// A job not started because of a termination signal is not a failure,
+	// just as in the sequential mode the signal simply ends the process.
+	for(size_t i = 0; i != parallel->count; ++i) {
+		for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+			struct job *job = &parallel->filesystems[i].jobs[phase];
+			if(job->started) {
+				if(thrd_join(job->thread, 0) == thrd_error) {
+					fputs("thrd_join: error\n", stderr);
+					abort();
+				}
+				ok &= job->ok;
+			}
+		}
+	}
+	if(parallel->verbose) {
+		show_timeline(parallel);
+	}
+	return ok;
+}
+
+bool do_parallel(char *const *mountpoints, size_t count, bool verbose, const struct steps *steps) {
+	// Each filesystem’s steps stop on termination signals by watching for
+	// them, as scrub and balance do anyway. For that to work on every thread,
+	// the signals are blocked before any are started; once all have stopped,
+	// unblocking a pending signal terminates the process as usual.
+	sigset_t sigs, old_sigs;
+	termination_signals(&sigs);
+	if(sigprocmask(SIG_BLOCK, &sigs, &old_sigs) < 0) {
+		perror("sigprocmask");
+		return false;
+	}
+
+	bool ok = false;
+	struct parallel parallel = {
+		.verbose = verbose,
+		.steps = steps,
+		.count = count,
+		.running = 0,
+	};
+	parallel.filesystems = calloc(count, sizeof(*parallel.filesystems));
+	if(parallel.filesystems) {
+		const bool enabled[PHASE_COUNT] = {
+			[PHASE_SCRUB] = steps->scrub,
+			[PHASE_DEVSTATS] = true,
+			[PHASE_DEFRAG] = steps->defrag,
+			[PHASE_BALANCE] = steps->balance,
+			[PHASE_TRIM] = steps->trim,
+		};
+		for(size_t i = 0; i != count; ++i) {
+			struct filesystem *fs = &parallel.filesystems[i];
+			fs->mountpoint = mountpoints[i];
+			fs->parallel = &parallel;
+			for(enum phase phase = 0; phase != PHASE_COUNT; ++phase) {
+				fs->jobs[phase].fs = fs;
+				fs->jobs[phase].phase = phase;
+				fs->jobs[phase].state = enabled[phase] ? JOB_WAITING : JOB_DONE;
+			}
+		}
+		if(mtx_init(&parallel.lock, mtx_plain) == thrd_success) {
+			if(cnd_init(&parallel.finished_cond) == thrd_success) {
+				ok = do_parallel_jobs(&parallel);
+				cnd_destroy(&parallel.finished_cond);
+			} else {
+				fputs("cnd_init: failed\n", stderr);
+			}
+			mtx_destroy(&parallel.lock);
+		} else {
+			fputs("mtx_init: failed\n", stderr);
+		}
+		for(size_t i = 0; i != count; ++i) {
+			for(size_t j = 0; j != parallel.filesystems[i].disk_count; ++j) {
+				free(parallel.filesystems[i].disks[j]);
+			}
+			free(parallel.filesystems[i].disks);
+		}
+		free(parallel.filesystems);
+	} else {
+		perror("calloc");
+	}
+
+	fflush(stdout);
+	if(sigprocmask(SIG_SETMASK, &old_sigs, 0) < 0) {
+		perror("sigprocmask");
+		abort();
+	}
+	return ok;
+}
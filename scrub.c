@@ -3,58 +3,440 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
-#include <poll.h>
-#include <signal.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <threads.h>
 #include <unistd.h>
 #include <linux/btrfs.h>
-#include <sys/eventfd.h>
 #include <sys/ioctl.h>
-#include <sys/signalfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "ops.h"
+#include "state.h"
 #include "util.h"
 
-static const int PROGRESS_INTERVAL = 5000;
+static const unsigned int PROGRESS_INTERVAL = 5000;
+
+// How many runs of throughput history to keep for each device.
+#define HISTORY_RUNS 16
+
+// How often to save each running device’s position in the state file, so that
+// a run that is killed outright still loses little work.
+static const unsigned int CHECKPOINT_INTERVAL = 60000;
+
+// The width of every number in the statistics file, enough for any uint64_t,
+// and the size of the sequence number lines at its start and end.
+#define STATS_NUMBER_WIDTH 20
+#define STATS_SEQUENCE_SIZE (sizeof("sequence ") - 1 + STATS_NUMBER_WIDTH + 1)
 
 struct thread_info {
 	int fd;
-	int efd;
 	uint64_t bytes_used;
 	struct btrfs_ioctl_scrub_args args;
-	atomic_bool done;
-	int ioctl_ret;
-	int ioctl_errno;
-	thrd_t thread;
+	struct runner_task task;
+
+	// The device’s scrub_speed_max before it was changed, if it was.
+	bool speed_changed;
+	uint64_t old_speed_max;
+
+	// When ordering by health: how much the device’s error counters have
+	// risen since the previous run, in which case it is scrubbed alone, and
+	// its throughput in the previous run, or zero if unknown.
+	uint64_t error_rise;
+	uint64_t previous_rate;
+	bool alone;
+
+	// Whether the device’s results have been reported.
+	bool reported;
 };
 
+// The devices found, each of which waits until fewer than the allowed number
+// of scrubs are running before it is started.
 struct cookie {
+	const char *mountpoint;
+	bool verbose;
+	const struct scrub_options *options;
 	int fd;
-	int efd;
+	uint8_t fsid[BTRFS_FSID_SIZE];
+	char fsid_string[FSID_STRING_SIZE];
 	struct thread_info *threads;
 	size_t thread_count;
+	size_t threads_found;
+
+	// The indices of the devices in the order to start them.
+	size_t *order;
 	size_t threads_started;
+	size_t limit;
+
+	// While scrubbing: the runner, the statistics file if there is one, and
+	// whether anything has gone wrong.
+	struct runner *runner;
+	struct stats_file *stats;
+	bool ok;
 };
 
+// Returns the progress of one device’s scrub: the final figures if it has
+// finished, or otherwise the current ones, fetched into buffer. Returns null if
+// neither is available.
+static const struct btrfs_scrub_progress *get_progress(int fd, const struct thread_info *ti, struct btrfs_ioctl_scrub_args *buffer) {
+	if(atomic_load_explicit(&ti->task.done, memory_order_acquire)) {
+		return &ti->args.progress;
+	}
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->devid = ti->args.devid;
+	if(!ti->task.started) {
+		return &buffer->progress;
+	}
+	if(ioctl(fd, BTRFS_IOC_SCRUB_PROGRESS, buffer) >= 0) {
+		return &buffer->progress;
+	}
+	// This can happen if the scrub is finished but the thread has not
+	// updated “done” yet.
+	return 0;
+}
+
+// Scrub statistics published through a memory-mapped file, so that
+// monitoring tools can follow a scrub without running ioctls of their own.
+// The file is text with fixed-width numbers, so its size never changes while
+// the scrub runs. It starts and ends with a sequence number. An update sets
+// the last one to an odd number, rewrites the body, and then sets both to the
+// next even number; so a reader that sees the same even number at both ends
+// has a consistent snapshot.
+struct stats_file {
+	char *map;
+	size_t size;
+	size_t body_size;
+	uint64_t sequence;
+	char *body;
+};
+
+static size_t format_stats_body(int fd, const char *mountpoint, const struct cookie *cookie, char *buffer, size_t size) {
+	uint64_t now = monotonic_ns();
+	size_t used = (size_t) snprintf(buffer, size, "mountpoint %s\ndevices %*zu\n", mountpoint, STATS_NUMBER_WIDTH, cookie->thread_count);
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		const struct thread_info *ti = &cookie->threads[i];
+		struct btrfs_ioctl_scrub_args args;
+		const struct btrfs_scrub_progress *progress = buffer ? get_progress(fd, ti, &args) : 0;
+		static const struct btrfs_scrub_progress no_progress;
+		if(!progress) {
+			progress = &no_progress;
+		}
+		const char *state = "pending";
+		uint64_t elapsed_ns = 0;
+		if(atomic_load_explicit(&ti->task.done, memory_order_acquire)) {
+			state = ti->task.ret >= 0 ? "finished" : ti->task.error == ECANCELED ? "cancelled" : "failed";
+			elapsed_ns = ti->task.end_ns - ti->task.start_ns;
+		} else if(ti->task.started) {
+			state = "running";
+			elapsed_ns = now - ti->task.start_ns;
+		}
+		uint64_t scrubbed = progress->data_bytes_scrubbed + progress->tree_bytes_scrubbed;
+		uint64_t rate = elapsed_ns ? (uint64_t) ((double) scrubbed * 1e9 / (double) elapsed_ns) : 0;
+		int64_t eta = -1;
+		if(atomic_load_explicit(&ti->task.done, memory_order_acquire)) {
+			eta = 0;
+		} else if(rate) {
+			eta = scrubbed < ti->bytes_used ? (int64_t) ((ti->bytes_used - scrubbed) / rate) : 0;
+		}
+#define W STATS_NUMBER_WIDTH
+		used += (size_t) snprintf(buffer ? buffer + used : 0, buffer ? size - used : 0,
+				"devid %*" PRIu64 " state %-9s bytes_used %*" PRIu64 " bytes_scrubbed %*" PRIu64 " bytes_per_second %*" PRIu64 " eta_seconds %*" PRId64
+				" read_errors %*" PRIu64 " csum_errors %*" PRIu64 " verify_errors %*" PRIu64 " super_errors %*" PRIu64 " malloc_errors %*" PRIu64
+				" uncorrectable_errors %*" PRIu64 " corrected_errors %*" PRIu64 " unverified_errors %*" PRIu64 "\n",
+				W, (uint64_t) ti->args.devid, state, W, ti->bytes_used, W, scrubbed, W, rate, W, eta,
+				W, (uint64_t) progress->read_errors, W, (uint64_t) progress->csum_errors, W, (uint64_t) progress->verify_errors, W, (uint64_t) progress->super_errors, W, (uint64_t) progress->malloc_errors,
+				W, (uint64_t) progress->uncorrectable_errors, W, (uint64_t) progress->corrected_errors, W, (uint64_t) progress->unverified_errors);
+#undef W
+	}
+	return used;
+}
+
+static void write_stats_sequence(char *dest, uint64_t sequence) {
+	char buffer[STATS_SEQUENCE_SIZE + 1];
+	sprintf(buffer, "sequence %*" PRIu64 "\n", STATS_NUMBER_WIDTH, sequence);
+	memcpy(dest, buffer, STATS_SEQUENCE_SIZE);
+}
+
+// Rewrites the statistics with the devices’ current progress.
+static void update_stats_file(struct stats_file *stats, int fd, const char *mountpoint, const struct cookie *cookie) {
+	format_stats_body(fd, mountpoint, cookie, stats->body, stats->body_size + 1);
+	write_stats_sequence(stats->map + stats->size - STATS_SEQUENCE_SIZE, stats->sequence + 1);
+	atomic_thread_fence(memory_order_release);
+	memcpy(stats->map + STATS_SEQUENCE_SIZE, stats->body, stats->body_size);
+	atomic_thread_fence(memory_order_release);
+	stats->sequence += 2;
+	write_stats_sequence(stats->map, stats->sequence);
+	atomic_thread_fence(memory_order_release);
+	write_stats_sequence(stats->map + stats->size - STATS_SEQUENCE_SIZE, stats->sequence);
+}
+
+// Creates the statistics file, sized for the filesystem’s devices, and fills
+// it in.
+static bool open_stats_file(struct stats_file *stats, const char *path, int fd, const char *mountpoint, const struct cookie *cookie) {
+	stats->body_size = format_stats_body(fd, mountpoint, cookie, 0, 0);
+	stats->size = STATS_SEQUENCE_SIZE + stats->body_size + STATS_SEQUENCE_SIZE;
+	stats->sequence = 0;
+	stats->body = malloc(stats->body_size + 1);
+	if(!stats->body) {
+		perror("malloc");
+		return false;
+	}
+	int stats_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(stats_fd < 0) {
+		perror(path);
+		free(stats->body);
+		return false;
+	}
+	if(ftruncate(stats_fd, (off_t) stats->size) < 0) {
+		perror(path);
+		close(stats_fd);
+		free(stats->body);
+		return false;
+	}
+	stats->map = mmap(0, stats->size, PROT_READ | PROT_WRITE, MAP_SHARED, stats_fd, 0);
+	close(stats_fd);
+	if(stats->map == MAP_FAILED) {
+		perror(path);
+		free(stats->body);
+		return false;
+	}
+	write_stats_sequence(stats->map, 0);
+	write_stats_sequence(stats->map + stats->size - STATS_SEQUENCE_SIZE, 0);
+	update_stats_file(stats, fd, mountpoint, cookie);
+	return true;
+}
+
+static void close_stats_file(struct stats_file *stats) {
+	munmap(stats->map, stats->size);
+	free(stats->body);
+}
+
 static int thread_proc(void *ti_raw) {
 	struct thread_info *ti = ti_raw;
-	ti->ioctl_ret = ioctl(ti->fd, BTRFS_IOC_SCRUB, &ti->args);
-	ti->ioctl_errno = errno;
-	atomic_store_explicit(&ti->done, true, memory_order_release);
-	if(eventfd_write(ti->efd, 1) < 0) {
-		perror("eventfd_write");
-		abort();
+	return ioctl(ti->fd, BTRFS_IOC_SCRUB, &ti->args);
+}
+
+// Formats the state file key under which a device’s scrub position is kept.
+static void scrub_state_key(const struct cookie *cookie, uint64_t devid, char *buffer) {
+	sprintf(buffer, "scrub.position.%s.%" PRIu64, cookie->fsid_string, devid);
+}
+
+// Records in the state file where each started device’s scrub has reached,
+// or forgets the position of a device that has finished, and saves the file.
+static bool save_positions(int fd, const struct cookie *cookie) {
+	bool ok = true;
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		const struct thread_info *ti = &cookie->threads[i];
+		if(!ti->task.started) {
+			continue;
+		}
+		char key[64 + FSID_STRING_SIZE];
+		scrub_state_key(cookie, ti->args.devid, key);
+		if(atomic_load_explicit(&ti->task.done, memory_order_acquire) && ti->task.ret >= 0) {
+			state_remove(key);
+			continue;
+		}
+		// A failed scrub keeps whatever position was saved last.
+		if(atomic_load_explicit(&ti->task.done, memory_order_acquire) && ti->task.error != ECANCELED) {
+			continue;
+		}
+		struct btrfs_ioctl_scrub_args args;
+		const struct btrfs_scrub_progress *progress = get_progress(fd, ti, &args);
+		if(progress && progress->last_physical > ti->args.start) {
+			ok &= state_set_u64(key, progress->last_physical);
+		}
 	}
-	return 0;
+	return state_save() && ok;
+}
+
+// Adds up a device’s error counters, as shown by device statistics.
+static bool read_dev_errors(const char *mountpoint, int fd, uint64_t devid, uint64_t *total) {
+	struct btrfs_ioctl_get_dev_stats dev_stats = {
+		.devid = devid,
+		.nr_items = BTRFS_DEV_STAT_VALUES_MAX,
+	};
+	if(ioctl(fd, BTRFS_IOC_GET_DEV_STATS, &dev_stats) < 0) {
+		perror(mountpoint);
+		return false;
+	}
+	*total = 0;
+	for(uint64_t i = 0; i != dev_stats.nr_items && i != BTRFS_DEV_STAT_VALUES_MAX; ++i) {
+		*total += dev_stats.values[i];
+	}
+	return true;
+}
+
+// Returns whether device x should be scrubbed before device y: devices whose
+// errors rose come first, most first; then devices that were slowest last
+// time; then devices with no history.
+static bool scrub_before(const struct thread_info *x, const struct thread_info *y) {
+	if(x->error_rise != y->error_rise) {
+		return x->error_rise > y->error_rise;
+	}
+	if(!x->previous_rate || !y->previous_rate) {
+		return x->previous_rate && !y->previous_rate;
+	}
+	return x->previous_rate < y->previous_rate;
+}
+
+// Decides the order in which to start the devices: the order found or, when
+// ordering by health, worst first, using the history in the state file.
+static bool plan_order(const char *mountpoint, bool verbose, int fd, struct cookie *cookie, bool by_health) {
+	cookie->order = calloc(cookie->thread_count, sizeof(*cookie->order));
+	if(!cookie->order) {
+		perror("calloc");
+		return false;
+	}
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		cookie->order[i] = i;
+	}
+	if(!by_health) {
+		return true;
+	}
+
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		struct thread_info *ti = &cookie->threads[i];
+		uint64_t errors, previous_errors;
+		char key[64 + FSID_STRING_SIZE];
+		sprintf(key, "scrub.errors.%s.%" PRIu64, cookie->fsid_string, (uint64_t) ti->args.devid);
+		if(!read_dev_errors(mountpoint, fd, ti->args.devid, &errors)) {
+			return false;
+		}
+		if(state_get_u64(key, &previous_errors) && errors > previous_errors) {
+			ti->error_rise = errors - previous_errors;
+			ti->alone = true;
+		}
+		uint64_t runs;
+		sprintf(key, "scrub.runs.%s.%" PRIu64, cookie->fsid_string, (uint64_t) ti->args.devid);
+		if(state_get_u64(key, &runs) && runs) {
+			sprintf(key, "scrub.rate.%s.%" PRIu64 ".%" PRIu64, cookie->fsid_string, (uint64_t) ti->args.devid, (runs - 1) % HISTORY_RUNS);
+			state_get_u64(key, &ti->previous_rate);
+		}
+	}
+
+	// There are only ever a handful of devices.
+	for(size_t i = 1; i != cookie->thread_count; ++i) {
+		size_t index = cookie->order[i];
+		size_t j = i;
+		while(j && scrub_before(&cookie->threads[index], &cookie->threads[cookie->order[j - 1]])) {
+			cookie->order[j] = cookie->order[j - 1];
+			--j;
+		}
+		cookie->order[j] = index;
+	}
+
+	if(verbose) {
+		printf("%s: scrub order:", mountpoint);
+		for(size_t i = 0; i != cookie->thread_count; ++i) {
+			const struct thread_info *ti = &cookie->threads[cookie->order[i]];
+			printf(" %" PRIu64, (uint64_t) ti->args.devid);
+			if(ti->alone) {
+				printf(" (alone, %" PRIu64 " new error(s))", ti->error_rise);
+			} else if(ti->previous_rate) {
+				printf(" (%.1f MiB/s last time)", ti->previous_rate / (1024.0 * 1024.0));
+			}
+		}
+		putchar('\n');
+	}
+	return true;
+}
+
+// Adds each device’s throughput in this run to its history in the state file,
+// along with its error counters for the next run to compare against. With
+// verbose output, shows the history.
+static bool record_history(const char *mountpoint, bool verbose, int fd, const struct cookie *cookie) {
+	bool ok = true;
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		const struct thread_info *ti = &cookie->threads[i];
+		uint64_t devid = ti->args.devid;
+		char key[64 + FSID_STRING_SIZE];
+		uint64_t errors;
+		if(read_dev_errors(mountpoint, fd, devid, &errors)) {
+			sprintf(key, "scrub.errors.%s.%" PRIu64, cookie->fsid_string, devid);
+			ok &= state_set_u64(key, errors);
+		} else {
+			ok = false;
+		}
+
+		// A run too short to measure, or one that failed, is not counted.
+		if(!ti->task.started || (ti->task.ret < 0 && ti->task.error != ECANCELED)) {
+			continue;
+		}
+		uint64_t elapsed_ns = ti->task.end_ns - ti->task.start_ns;
+		uint64_t bytes = ti->args.progress.data_bytes_scrubbed + ti->args.progress.tree_bytes_scrubbed;
+		if(elapsed_ns < UINT64_C(1000000000) || !bytes) {
+			continue;
+		}
+		uint64_t runs = 0;
+		sprintf(key, "scrub.runs.%s.%" PRIu64, cookie->fsid_string, devid);
+		state_get_u64(key, &runs);
+		ok &= state_set_u64(key, runs + 1);
+		sprintf(key, "scrub.rate.%s.%" PRIu64 ".%" PRIu64, cookie->fsid_string, devid, runs % HISTORY_RUNS);
+		ok &= state_set_u64(key, (uint64_t) ((double) bytes * 1e9 / (double) elapsed_ns));
+		++runs;
+
+		if(verbose) {
+			printf("%s: device ID %" PRIu64 ": scrub throughput over the last %" PRIu64 " run(s), oldest first:", mountpoint, devid, runs < HISTORY_RUNS ? runs : HISTORY_RUNS);
+			for(uint64_t run = runs < HISTORY_RUNS ? 0 : runs - HISTORY_RUNS; run != runs; ++run) {
+				uint64_t rate = 0;
+				sprintf(key, "scrub.rate.%s.%" PRIu64 ".%" PRIu64, cookie->fsid_string, devid, run % HISTORY_RUNS);
+				state_get_u64(key, &rate);
+				printf(" %.1f", rate / (1024.0 * 1024.0));
+			}
+			puts(" MiB/s");
+		}
+	}
+	return ok;
+}
+
+// Shows the results of one device’s scrub, returning false if it found errors
+// or failed.
+static bool report_device(const char *mountpoint, bool verbose, struct thread_info *ti, bool cancelled) {
+	bool ok = true;
+	ti->reported = true;
+	if(!ti->task.started) {
+		if(!cancelled) {
+			fprintf(stderr, "%s: device ID %" PRIu64 ": scrub not started\n", mountpoint, (uint64_t) ti->args.devid);
+			ok = false;
+		}
+	} else if(ti->task.ret >= 0) {
+#define CHECK_ERROR(field_name, error_name) \
+		do { \
+			if(verbose || ti->args.progress.field_name) { \
+				fprintf(ti->args.progress.field_name ? stderr : stdout, "%s: device ID %" PRIu64 ": scrub detected %" PRIu64 " " error_name " error(s)\n", mountpoint, (uint64_t) ti->args.devid, (uint64_t) ti->args.progress.field_name); \
+				if(ti->args.progress.field_name) { \
+					ok = false; \
+				} \
+			} \
+		} while(0)
+		CHECK_ERROR(read_errors, "read");
+		CHECK_ERROR(csum_errors, "checksum");
+		CHECK_ERROR(verify_errors, "verify");
+		CHECK_ERROR(super_errors, "superblock");
+		CHECK_ERROR(malloc_errors, "malloc");
+		CHECK_ERROR(uncorrectable_errors, "uncorrectable");
+		CHECK_ERROR(corrected_errors, "corrected");
+		CHECK_ERROR(unverified_errors, "unverified");
+#undef CHECK_ERROR
+		if(verbose) {
+			if(ti->args.progress.no_csum) {
+				printf("%s: device ID %" PRIu64 ": scrub skipped %" PRIu64 " blocks without checksum\n", mountpoint, (uint64_t) ti->args.devid, (uint64_t) ti->args.progress.no_csum);
+			}
+			if(ti->args.progress.csum_discards) {
+				printf("%s: device ID %" PRIu64 ": scrub ignored %" PRIu64 " checksums without data\n", mountpoint, (uint64_t) ti->args.devid, (uint64_t) ti->args.progress.csum_discards);
+			}
+		}
+	} else if(!(cancelled && ti->task.error == ECANCELED)) {
+		fprintf(stderr, "%s: device ID %" PRIu64 ": scrub failed: %s\n", mountpoint, (uint64_t) ti->args.devid, strerror(ti->task.error));
+		ok = false;
+	}
+	return ok;
 }
 
-static bool start_thread(const struct btrfs_ioctl_fs_info_args *fs_info, const struct btrfs_ioctl_dev_info_args *dev_info, void *cookie_raw) {
+static bool add_device(const struct btrfs_ioctl_fs_info_args *fs_info, const struct btrfs_ioctl_dev_info_args *dev_info, void *cookie_raw) {
 	struct cookie *cookie = cookie_raw;
 
 	if(!cookie->threads) {
@@ -63,6 +445,8 @@ static bool start_thread(const struct btrfs_ioctl_fs_info_args *fs_info, const s
 			return false;
 		}
 		cookie->thread_count = (size_t) fs_info->num_devices;
+		memcpy(cookie->fsid, fs_info->fsid, sizeof(cookie->fsid));
+		format_fsid(cookie->fsid, cookie->fsid_string);
 		cookie->threads = calloc(cookie->thread_count, sizeof(*cookie->threads));
 		if(!cookie->threads) {
 			perror("calloc");
@@ -70,230 +454,289 @@ static bool start_thread(const struct btrfs_ioctl_fs_info_args *fs_info, const s
 		}
 	}
 
-	if(cookie->threads_started == cookie->thread_count) {
+	if(cookie->threads_found == cookie->thread_count) {
 		fprintf(stderr, "expected to find %zu devices but found another one\n", cookie->thread_count);
 		return false;
 	}
 
-	struct thread_info *ti = &cookie->threads[cookie->threads_started];
+	struct thread_info *ti = &cookie->threads[cookie->threads_found++];
 	ti->fd = cookie->fd;
-	ti->efd = cookie->efd;
 	ti->bytes_used = dev_info->bytes_used;
 	ti->args.devid = dev_info->devid;
 	ti->args.end = (uint64_t) -1;
-	atomic_init(&ti->done, false);
-	int rc = thrd_create(&ti->thread, &thread_proc, ti);
-	if(rc == thrd_nomem) {
-		fprintf(stderr, "thrd_create: %s\n", strerror(ENOMEM));
-		return false;
-	} else if(rc == thrd_error) {
-		fputs("thrd_create: failed\n", stderr);
-		return false;
-	} else if(rc != thrd_success) {
-		fputs("thrd_create: unknown error\n", stderr);
-		return false;
+	char key[64 + FSID_STRING_SIZE];
+	scrub_state_key(cookie, dev_info->devid, key);
+	uint64_t start;
+	if(state_get_u64(key, &start)) {
+		ti->args.start = start;
 	}
+	ti->task.started = false;
+	atomic_init(&ti->task.done, false);
+	return true;
+}
 
-	++cookie->threads_started;
+// Starts scrubs on waiting devices, in the planned order, until the limit
+// are running or none are left waiting.
+static bool start_scrubs(struct cookie *cookie) {
+	while(cookie->threads_started != cookie->thread_count && cookie->runner->running < cookie->limit) {
+		// A device to be scrubbed alone waits for everything before it, and
+		// everything after it waits for it.
+		struct thread_info *ti = &cookie->threads[cookie->order[cookie->threads_started]];
+		bool after_alone = cookie->threads_started && cookie->threads[cookie->order[cookie->threads_started - 1]].alone;
+		if(cookie->runner->running && (ti->alone || after_alone)) {
+			break;
+		}
+		if(!runner_start(cookie->runner, &ti->task, &thread_proc, ti)) {
+			return false;
+		}
+		++cookie->threads_started;
+	}
 	return true;
 }
 
-static bool do_scrub_fd_auxfds(const char *mountpoint, bool verbose, int fd, int sigfd, int efd) {
-	struct cookie cookie = { .fd = fd, .efd = efd, };
-	if(!for_each_device(mountpoint, fd, &start_thread, &cookie)) {
-		// Forking a thread or allocating memory failed. A scrub might or might
-		// not have gotten started. If one did, issue a cancel, join any
-		// threads that were successfully forked, and free the array.
-		if(cookie.threads) {
-			ioctl(fd, BTRFS_IOC_SCRUB_CANCEL, (void *) 0);
-			for(size_t i = 0; i != cookie.threads_started; ++i) {
-				// Ignore errors; this is a best-effort cleanup attempt
-				// when something else has already gone badly wrong.
-				thrd_join(cookie.threads[i].thread, 0);
+// Sets each device’s scrub_speed_max in sysfs, where the kernel has it,
+// remembering the old value. Returns false if a value that exists could not
+// be read or set.
+static bool limit_speeds(const char *mountpoint, struct cookie *cookie, uint64_t speed_max) {
+	char fsid_string[FSID_STRING_SIZE];
+	format_fsid(cookie->fsid, fsid_string);
+	bool ok = true;
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		struct thread_info *ti = &cookie->threads[i];
+		char path[64 + FSID_STRING_SIZE];
+		sprintf(path, "/sys/fs/btrfs/%s/devinfo/%" PRIu64 "/scrub_speed_max", fsid_string, (uint64_t) ti->args.devid);
+		FILE *fp = fopen(path, "r+");
+		if(!fp) {
+			if(errno == ENOENT) {
+				// Kernels before 5.14 have no per-device limit.
+				fprintf(stderr, "%s: scrub speed limits are not supported by this kernel\n", mountpoint);
+			} else {
+				perror(path);
+				ok = false;
 			}
-			free(cookie.threads);
+			break;
 		}
-		return false;
+		if(fscanf(fp, "%" SCNu64, &ti->old_speed_max) != 1) {
+			fprintf(stderr, "%s: unrecognized contents\n", path);
+			ok = false;
+		} else if(fseek(fp, 0, SEEK_SET) < 0 || fprintf(fp, "%" PRIu64 "\n", speed_max) < 0 || fflush(fp) == EOF) {
+			perror(path);
+			ok = false;
+		} else {
+			ti->speed_changed = true;
+		}
+		fclose(fp);
 	}
+	return ok;
+}
 
-	assert(cookie.threads_started == cookie.thread_count);
-
-	// The threads are started. Loop until they’re all finished.
-	size_t remaining = cookie.thread_count;
-	bool cancelled = false;
-	while(remaining) {
-		struct pollfd pfds[] = {
-			{ .fd = sigfd, .events = POLLIN, .revents = 0 },
-			{ .fd = efd, .events = POLLIN, .revents = 0 },
-		};
-		if(poll(pfds, sizeof(pfds) / sizeof(*pfds), verbose ? PROGRESS_INTERVAL : -1) < 0) {
-			perror("poll");
-			break;
+// Puts back the scrub_speed_max values changed by limit_speeds.
+static bool restore_speeds(struct cookie *cookie) {
+	char fsid_string[FSID_STRING_SIZE];
+	format_fsid(cookie->fsid, fsid_string);
+	bool ok = true;
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		const struct thread_info *ti = &cookie->threads[i];
+		if(!ti->speed_changed) {
+			continue;
 		}
-		if(pfds[0].revents & POLLIN) {
-			// A signal was received. Get out.
-			cancelled = true;
-			break;
+		char path[64 + FSID_STRING_SIZE];
+		sprintf(path, "/sys/fs/btrfs/%s/devinfo/%" PRIu64 "/scrub_speed_max", fsid_string, (uint64_t) ti->args.devid);
+		FILE *fp = fopen(path, "w");
+		if(!fp) {
+			perror(path);
+			ok = false;
+			continue;
 		}
-		if(pfds[1].revents & POLLIN) {
-			// One or more threads notified us of completion.
-			eventfd_t count;
-			if(eventfd_read(efd, &count) < 0) {
-				perror("eventfd_read");
-				break;
-			}
-			assert(count <= remaining);
-			remaining -= count;
+		bool failed = fprintf(fp, "%" PRIu64 "\n", ti->old_speed_max) < 0;
+		failed |= fclose(fp) == EOF;
+		if(failed) {
+			perror(path);
+			ok = false;
 		}
-		if(verbose) {
-			for(size_t i = 0; i != cookie.thread_count; ++i) {
-				const struct thread_info *ti = &cookie.threads[i];
-				if(i) {
-					fputs("  ", stdout);
-				}
-				printf("[%" PRIu64 "]: ", (uint64_t) ti->args.devid);
-				struct btrfs_ioctl_scrub_args args = { .devid = ti->args.devid, };
-				const struct btrfs_ioctl_scrub_args *report_args;
-				if(atomic_load_explicit(&ti->done, memory_order_acquire)) {
-					report_args = &ti->args;
-				} else {
-					if(ioctl(fd, BTRFS_IOC_SCRUB_PROGRESS, &args) >= 0) {
-						report_args = &args;
-					} else {
-						// This can happen if the scrub is finished but the
-						// thread has not updated “done” yet.
-						report_args = 0;
-					}
-				}
-
-				if(report_args) {
-					unsigned int permille;
-					uint64_t bytes_scrubbed = report_args->progress.data_bytes_scrubbed + report_args->progress.tree_bytes_scrubbed;
-					if(!ti->bytes_used) {
-						permille = 500;
-					} else if(bytes_scrubbed > ti->bytes_used) {
-						permille = 1000;
-					} else {
-						permille = bytes_scrubbed * 1000 / ti->bytes_used;
-					}
-
-					uint64_t errors = report_args->progress.read_errors + report_args->progress.csum_errors + report_args->progress.verify_errors + report_args->progress.super_errors + report_args->progress.malloc_errors + report_args->progress.uncorrectable_errors + report_args->progress.corrected_errors + report_args->progress.unverified_errors;
-					printf("%3u.%u%%: [%" PRIu64 " error(s)]", permille / 10, permille % 10, errors);
-				} else {
-					fputs("???                ", stdout);
-				}
+	}
+	return ok;
+}
+
+static void cancel_scrubs(void *cookie_raw) {
+	const struct cookie *cookie = cookie_raw;
+	ioctl(cookie->fd, BTRFS_IOC_SCRUB_CANCEL, (void *) 0);
+}
+
+static void show_progress(void *cookie_raw) {
+	const struct cookie *cookie = cookie_raw;
+	for(size_t i = 0; i != cookie->thread_count; ++i) {
+		const struct thread_info *ti = &cookie->threads[i];
+		if(i) {
+			fputs("  ", stdout);
+		}
+		printf("[%" PRIu64 "]: ", (uint64_t) ti->args.devid);
+		struct btrfs_ioctl_scrub_args args;
+		const struct btrfs_scrub_progress *progress = get_progress(cookie->fd, ti, &args);
+		if(progress) {
+			unsigned int permille;
+			uint64_t bytes_scrubbed = progress->data_bytes_scrubbed + progress->tree_bytes_scrubbed;
+			if(!ti->bytes_used) {
+				permille = 500;
+			} else if(bytes_scrubbed > ti->bytes_used) {
+				permille = 1000;
+			} else {
+				permille = bytes_scrubbed * 1000 / ti->bytes_used;
 			}
-			putchar('\r');
-			fflush(stdout);
+
+			uint64_t errors = progress->read_errors + progress->csum_errors + progress->verify_errors + progress->super_errors + progress->malloc_errors + progress->uncorrectable_errors + progress->corrected_errors + progress->unverified_errors;
+			printf("%3u.%u%%: [%" PRIu64 " error(s)]", permille / 10, permille % 10, errors);
+		} else {
+			fputs("???                ", stdout);
 		}
 	}
+	putchar('\r');
+	fflush(stdout);
+}
 
-	// If any threads didn’t finish on their own, cancel the scrub.
-	if(remaining) {
-		ioctl(fd, BTRFS_IOC_SCRUB_CANCEL, (void *) 0);
+static void publish_stats(void *cookie_raw) {
+	const struct cookie *cookie = cookie_raw;
+	update_stats_file(cookie->stats, cookie->fd, cookie->mountpoint, cookie);
+}
+
+static void checkpoint(void *cookie_raw) {
+	struct cookie *cookie = cookie_raw;
+	cookie->ok &= save_positions(cookie->fd, cookie);
+}
+
+// Called as each device’s scrub returns: starts waiting devices in its place
+// and brings the progress display and statistics up to date.
+static void scrub_finished(struct runner_task *task, void *cookie_raw) {
+	struct cookie *cookie = cookie_raw;
+	struct thread_info *ti = task->arg;
+	if(cookie->options->order_by_health && !cookie->runner->cancelled) {
+		// Report finished devices straight away, so that a failing device
+		// scrubbed first is known about early.
+		if(cookie->verbose) {
+			// Move off the progress line.
+			putchar('\n');
+		}
+		cookie->ok &= report_device(cookie->mountpoint, cookie->verbose, ti, false);
+	}
+	if(!cookie->runner->cancelled && !start_scrubs(cookie)) {
+		// Devices that cannot be started fail the run, and the rest stop.
+		cookie->ok = false;
+		runner_cancel(cookie->runner);
 	}
+	if(cookie->stats) {
+		publish_stats(cookie);
+	}
+	if(cookie->verbose) {
+		show_progress(cookie);
+	}
+}
 
-	// If we were displaying progress, print an empty line to avoid terminal
-	// corruption.
-	if(verbose) {
-		putchar('\n');
+static bool do_scrub_fd(const char *mountpoint, bool verbose, const struct scrub_options *options, int fd) {
+	struct cookie cookie = { .mountpoint = mountpoint, .verbose = verbose, .options = options, .fd = fd, .ok = true, };
+	if(!for_each_device(mountpoint, fd, &add_device, &cookie)) {
+		free(cookie.threads);
+		return false;
 	}
 
-	// Join all the threads and present the results.
-	bool ok = true;
-	for(size_t i = 0; i != cookie.thread_count; ++i) {
-		if(thrd_join(cookie.threads[i].thread, 0) == thrd_error) {
-			fputs("thrd_join: error\n", stderr);
-			abort();
-		}
+	assert(cookie.threads_found == cookie.thread_count);
 
-		if(cookie.threads[i].ioctl_ret >= 0) {
-#define CHECK_ERROR(field_name, error_name) \
-			do { \
-				if(verbose || cookie.threads[i].args.progress.field_name) { \
-					fprintf(cookie.threads[i].args.progress.field_name ? stderr : stdout, "%s: device ID %" PRIu64 ": scrub detected %" PRIu64 " " error_name " error(s)\n", mountpoint, (uint64_t) cookie.threads[i].args.devid, (uint64_t) cookie.threads[i].args.progress.field_name); \
-					if(cookie.threads[i].args.progress.field_name) { \
-						ok = false; \
-					} \
-				} \
-			} while(0)
-			CHECK_ERROR(read_errors, "read");
-			CHECK_ERROR(csum_errors, "checksum");
-			CHECK_ERROR(verify_errors, "verify");
-			CHECK_ERROR(super_errors, "superblock");
-			CHECK_ERROR(malloc_errors, "malloc");
-			CHECK_ERROR(uncorrectable_errors, "uncorrectable");
-			CHECK_ERROR(corrected_errors, "corrected");
-			CHECK_ERROR(unverified_errors, "unverified");
-#undef CHECK_ERROR
-			if(verbose) {
-				if(cookie.threads[i].args.progress.no_csum) {
-					printf("%s: device ID %" PRIu64 ": scrub skipped %" PRIu64 " blocks without checksum\n", mountpoint, (uint64_t) cookie.threads[i].args.devid, (uint64_t) cookie.threads[i].args.progress.no_csum);
-				}
-				if(cookie.threads[i].args.progress.csum_discards) {
-					printf("%s: device ID %" PRIu64 ": scrub ignored %" PRIu64 " checksums without data\n", mountpoint, (uint64_t) cookie.threads[i].args.devid, (uint64_t) cookie.threads[i].args.progress.csum_discards);
-				}
+	if(verbose) {
+		for(size_t i = 0; i != cookie.thread_count; ++i) {
+			if(cookie.threads[i].args.start) {
+				printf("%s: device ID %" PRIu64 ": resuming scrub from byte %" PRIu64 "\n", mountpoint, (uint64_t) cookie.threads[i].args.devid, (uint64_t) cookie.threads[i].args.start);
 			}
-		} else if(!(cancelled && cookie.threads[i].ioctl_errno == ECANCELED)) {
-			fprintf(stderr, "%s: device ID %" PRIu64 ": scrub failed: %s\n", mountpoint, (uint64_t) cookie.threads[i].args.devid, strerror(cookie.threads[i].ioctl_errno));
-			ok = false;
 		}
 	}
 
-	// Clean up.
-	free(cookie.threads);
-	return ok;
-}
+	// A speed limit or statistics file that cannot be set up fails the run,
+	// but the scrub itself goes ahead.
+	if(options->speed_max_mib) {
+		cookie.ok &= limit_speeds(mountpoint, &cookie, (uint64_t) options->speed_max_mib * 1024 * 1024);
+	}
+	if(!plan_order(mountpoint, verbose, fd, &cookie, options->order_by_health)) {
+		restore_speeds(&cookie);
+		free(cookie.order);
+		free(cookie.threads);
+		return false;
+	}
+	cookie.limit = options->parallelism ? options->parallelism : SIZE_MAX;
 
-static bool do_scrub_fd(const char *mountpoint, bool verbose, int fd) {
-	// The scrub ioctl is blocking and uninterruptible (in the traditional
-	// signal-delivery sense) so just running it straight makes the process
-	// unkillable (even with kill -9). However, BTRFS_IOC_SCRUB_CANCEL is
-	// available, so make a signalfd to detect SIGINT, SIGQUIT, and SIGTERM and
-	// cancel the in-progress scrubs. In order to accomplish that, the scrubs
-	// run in separate threads and the main thread handles termination signals,
-	// thread reaping, and progress display.
-	//
-	// A signalfd is used to take the termination signals. An eventfd is used
-	// by the scrub threads to notify the main thread that they are finished.
-	sigset_t sigs;
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGINT);
-	sigaddset(&sigs, SIGQUIT);
-	sigaddset(&sigs, SIGTERM);
-	if(sigprocmask(SIG_BLOCK, &sigs, 0) < 0) {
-		perror("sigprocmask");
+	// The scrub ioctl is blocking and uninterruptible, but
+	// BTRFS_IOC_SCRUB_CANCEL is available, so each device is scrubbed on a
+	// worker thread, and all are cancelled if a termination signal arrives.
+	// Progress display, statistics, and checkpoints each have their own
+	// timer.
+	struct runner runner;
+	if(!runner_init(&runner, &cancel_scrubs, &scrub_finished, &cookie)) {
+		restore_speeds(&cookie);
+		free(cookie.order);
+		free(cookie.threads);
 		return false;
 	}
-	bool ret = true;
-	int sigfd = signalfd(-1, &sigs, 0);
-	if(sigfd >= 0) {
-		int efd = eventfd(0, 0);
-		if(efd >= 0) {
-			ret = do_scrub_fd_auxfds(mountpoint, verbose, fd, sigfd, efd);
+	cookie.runner = &runner;
+	struct stats_file stats;
+	if(options->stats_file) {
+		if(open_stats_file(&stats, options->stats_file, fd, mountpoint, &cookie)) {
+			cookie.stats = &stats;
+			cookie.ok &= runner_add_timer(&runner, options->stats_interval_ms, &publish_stats);
 		} else {
-			perror("eventfd");
-			ret = false;
+			cookie.ok = false;
 		}
-	} else {
-		perror("signalfd");
-		ret = false;
 	}
-	if(sigprocmask(SIG_UNBLOCK, &sigs, 0) < 0) {
-		perror("sigprocmask");
-		abort();
+	if(verbose) {
+		cookie.ok &= runner_add_timer(&runner, PROGRESS_INTERVAL, &show_progress);
 	}
-	return ret;
+	if(state_enabled()) {
+		cookie.ok &= runner_add_timer(&runner, CHECKPOINT_INTERVAL, &checkpoint);
+	}
+	if(!start_scrubs(&cookie)) {
+		// Forking a thread failed. Stop any scrubs that did get started.
+		cookie.ok = false;
+		runner_cancel(&runner);
+	}
+	cookie.ok &= runner_run(&runner);
+	bool cancelled = runner.cancelled;
+
+	// If we were displaying progress, print an empty line to avoid terminal
+	// corruption.
+	if(verbose) {
+		putchar('\n');
+		runner_report(&runner, mountpoint, "scrub");
+	}
+
+	// Every thread is done, so the statistics get the final figures, and a
+	// cancelled device’s position is the one the kernel reported when it
+	// stopped. Devices still waiting were never started.
+	if(cookie.stats) {
+		update_stats_file(cookie.stats, fd, mountpoint, &cookie);
+		close_stats_file(cookie.stats);
+	}
+	cookie.ok &= restore_speeds(&cookie);
+	if(state_enabled()) {
+		cookie.ok &= save_positions(fd, &cookie);
+		cookie.ok &= record_history(mountpoint, verbose, fd, &cookie) && state_save();
+	}
+	for(size_t i = 0; i != cookie.thread_count; ++i) {
+		if(!cookie.threads[i].reported) {
+			cookie.ok &= report_device(mountpoint, verbose, &cookie.threads[i], cancelled);
+		}
+	}
+
+	// Clean up. A pending termination signal takes effect here.
+	runner_deinit(&runner);
+	free(cookie.order);
+	free(cookie.threads);
+	return cookie.ok;
 }
 
-bool do_scrub(const char *mountpoint, bool verbose) {
+bool do_scrub(const char *mountpoint, bool verbose, const struct scrub_options *options) {
 	if(verbose) {
 		printf("Scrub %s:\n", mountpoint);
 	}
 	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
 	bool ret;
 	if(fd >= 0) {
-		ret = do_scrub_fd(mountpoint, verbose, fd);
+		ret = do_scrub_fd(mountpoint, verbose, options, fd);
 		close(fd);
 	} else {
 		perror(mountpoint);
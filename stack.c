@@ -0,0 +1,265 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stack.h"
+
+static size_t ancestor_hash(const struct ancestor_set *set, uint32_t dev_major, uint32_t dev_minor, uint64_t inode) {
+	uint64_t h = inode * UINT64_C(0x9E3779B97F4A7C15);
+	h ^= ((((uint64_t) dev_major) << 32) | dev_minor) * UINT64_C(0xC2B2AE3D27D4EB4F);
+	h ^= h >> 29;
+	return (size_t) h & (set->capacity - 1);
+}
+
+static bool ancestor_set_contains(const struct ancestor_set *set, uint32_t dev_major, uint32_t dev_minor, uint64_t inode) {
+	if(!set->count) {
+		return false;
+	}
+	for(size_t i = ancestor_hash(set, dev_major, dev_minor, inode); set->slots[i].used; i = (i + 1) & (set->capacity - 1)) {
+		const struct ancestor *a = &set->slots[i];
+		if(a->dev_major == dev_major && a->dev_minor == dev_minor && a->inode == inode) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Inserts without checking for space, which must have been reserved.
+static void ancestor_set_insert(struct ancestor_set *set, uint32_t dev_major, uint32_t dev_minor, uint64_t inode) {
+	size_t i = ancestor_hash(set, dev_major, dev_minor, inode);
+	while(set->slots[i].used) {
+		i = (i + 1) & (set->capacity - 1);
+	}
+	set->slots[i] = (struct ancestor) {
+		.dev_major = dev_major,
+		.dev_minor = dev_minor,
+		.inode = inode,
+		.used = true,
+	};
+	++set->count;
+}
+
+// Makes sure one more entry can be inserted.
+static bool ancestor_set_reserve(struct ancestor_set *set) {
+	if((set->count + 1) * 2 <= set->capacity) {
+		return true;
+	}
+	struct ancestor_set bigger = {
+		.capacity = set->capacity ? set->capacity * 2 : 64,
+		.count = 0,
+	};
+	bigger.slots = calloc(bigger.capacity, sizeof(*bigger.slots));
+	if(!bigger.slots) {
+		perror("calloc");
+		return false;
+	}
+	for(size_t i = 0; i != set->capacity; ++i) {
+		if(set->slots[i].used) {
+			ancestor_set_insert(&bigger, set->slots[i].dev_major, set->slots[i].dev_minor, set->slots[i].inode);
+		}
+	}
+	free(set->slots);
+	*set = bigger;
+	return true;
+}
+
+// Removes one copy of an entry, if there is one, shifting later entries in the
+// same run back so that no tombstones are needed. The search stops at the
+// first empty slot, of which there is always one since the table is kept at
+// most half full.
+static void ancestor_set_remove(struct ancestor_set *set, uint32_t dev_major, uint32_t dev_minor, uint64_t inode) {
+	if(!set->count) {
+		return;
+	}
+	size_t mask = set->capacity - 1;
+	size_t i = ancestor_hash(set, dev_major, dev_minor, inode);
+	for(;; i = (i + 1) & mask) {
+		const struct ancestor *a = &set->slots[i];
+		if(!a->used) {
+			return;
+		}
+		if(a->dev_major == dev_major && a->dev_minor == dev_minor && a->inode == inode) {
+			break;
+		}
+	}
+	size_t j = i;
+	for(;;) {
+		j = (j + 1) & mask;
+		if(!set->slots[j].used) {
+			break;
+		}
+		// The entry at j may move into the hole at i only if its home slot is
+		// not cyclically within (i, j].
+		size_t home = ancestor_hash(set, set->slots[j].dev_major, set->slots[j].dev_minor, set->slots[j].inode);
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			set->slots[i] = set->slots[j];
+			i = j;
+		}
+	}
+	set->slots[i].used = false;
+	--set->count;
+}
+
+void stack_init(struct stack *stack) {
+	stack->bottom = 0;
+	stack->top = 0;
+	stack->top_used = 0;
+	stack->free_chunks = 0;
+	stack->ancestors = (struct ancestor_set) {
+		.slots = 0,
+		.capacity = 0,
+		.count = 0,
+	};
+}
+
+bool stack_empty(const struct stack *stack) {
+	return !stack->top;
+}
+
+// Pushes a copy of an entry, including its name; the caller keeps ownership
+// of the name it passed, but the stack takes ownership of the descriptor.
+bool stack_push(struct stack *stack, const struct stack_entry *new) {
+	if(!ancestor_set_reserve(&stack->ancestors)) {
+		return false;
+	}
+	if(!stack->top || stack->top_used == CHUNK_CAPACITY) {
+		if(!stack->free_chunks) {
+			struct stack_chunk *new_chunk = malloc(sizeof(*new_chunk));
+			if(!new_chunk) {
+				perror("malloc");
+				return false;
+			}
+			new_chunk->previous = 0;
+			stack->free_chunks = new_chunk;
+		}
+		struct stack_chunk *new_chunk = stack->free_chunks;
+		stack->free_chunks = new_chunk->previous;
+		new_chunk->previous = stack->top;
+		new_chunk->next = 0;
+		new_chunk->names_used = 0;
+		if(stack->top) {
+			stack->top->next = new_chunk;
+		} else {
+			stack->bottom = new_chunk;
+		}
+		stack->top = new_chunk;
+		stack->top_used = 0;
+	}
+
+	struct stack_chunk *chunk = stack->top;
+	struct stack_entry *e = &chunk->entries[stack->top_used];
+	*e = *new;
+	char *name;
+	if(chunk->names_used + new->name_len + 1 <= NAME_ARENA_SIZE) {
+		name = chunk->names + chunk->names_used;
+		chunk->names_used += new->name_len + 1;
+		e->name_allocated = false;
+	} else {
+		name = malloc(new->name_len + 1);
+		if(!name) {
+			perror("malloc");
+			if(!stack->top_used) {
+				// Give back the chunk that was just taken.
+				stack->top = chunk->previous;
+				chunk->previous = stack->free_chunks;
+				stack->free_chunks = chunk;
+				if(stack->top) {
+					stack->top->next = 0;
+					stack->top_used = CHUNK_CAPACITY;
+				} else {
+					stack->bottom = 0;
+				}
+			}
+			return false;
+		}
+		e->name_allocated = true;
+	}
+	memcpy(name, new->name, new->name_len);
+	name[new->name_len] = '\0';
+	e->name = name;
+	e->buffer = (char *) chunk->buffers[stack->top_used];
+	e->buffer_pos = 0;
+	e->buffer_len = 0;
+	++stack->top_used;
+	ancestor_set_insert(&stack->ancestors, e->dev_major, e->dev_minor, e->inode);
+	return true;
+}
+
+void stack_pop(struct stack *stack) {
+	struct stack_entry *e = &stack->top->entries[stack->top_used - 1];
+	ancestor_set_remove(&stack->ancestors, e->dev_major, e->dev_minor, e->inode);
+	if(e->fd >= 0) {
+		close(e->fd);
+	}
+	if(e->name_allocated) {
+		free((char *) e->name);
+	} else {
+		stack->top->names_used -= e->name_len + 1;
+	}
+	--stack->top_used;
+	if(!stack->top_used) {
+		struct stack_chunk *empty_chunk = stack->top;
+		stack->top = empty_chunk->previous;
+		empty_chunk->previous = stack->free_chunks;
+		stack->free_chunks = empty_chunk;
+		if(stack->top) {
+			stack->top->next = 0;
+			stack->top_used = CHUNK_CAPACITY;
+		} else {
+			stack->bottom = 0;
+		}
+	}
+}
+
+void stack_deinit(struct stack *stack) {
+	while(!stack_empty(stack)) {
+		stack_pop(stack);
+	}
+	while(stack->free_chunks) {
+		struct stack_chunk *prev = stack->free_chunks->previous;
+		free(stack->free_chunks);
+		stack->free_chunks = prev;
+	}
+	free(stack->ancestors.slots);
+}
+
+struct stack_entry *stack_peek(struct stack *stack) {
+	return &stack->top->entries[stack->top_used - 1];
+}
+
+// Returns the next entry in a directory, or null with errno set to zero at
+// the end of the directory or nonzero on error.
+const struct dirent64 *stack_entry_read(struct stack_entry *e) {
+	if(e->buffer_pos == e->buffer_len) {
+		ssize_t rc = getdents64(e->fd, e->buffer, DIRENT_BUFFER_SIZE);
+		if(rc <= 0) {
+			if(!rc) {
+				errno = 0;
+			}
+			return 0;
+		}
+		e->buffer_pos = 0;
+		e->buffer_len = (size_t) rc;
+	}
+	const struct dirent64 *de = (const struct dirent64 *) (e->buffer + e->buffer_pos);
+	e->buffer_pos += de->d_reclen;
+	return de;
+}
+
+// Returns whether a directory is already on the stack.
+bool stack_contains(const struct stack *stack, uint32_t dev_major, uint32_t dev_minor, uint64_t inode) {
+	return ancestor_set_contains(&stack->ancestors, dev_major, dev_minor, inode);
+}
+
+void stack_foreach_up(struct stack *stack, bool (*cb)(struct stack_entry *, void *), void *cookie) {
+	for(struct stack_chunk *chunk = stack->bottom; chunk; chunk = chunk->next) {
+		size_t used = chunk == stack->top ? stack->top_used : CHUNK_CAPACITY;
+		for(size_t i = 0; i != used; ++i) {
+			if(!cb(&chunk->entries[i], cookie)) {
+				return;
+			}
+		}
+	}
+}
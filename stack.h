@@ -0,0 +1,79 @@
+#if !defined(STACK_H)
+#define STACK_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct dirent64;
+
+#define CHUNK_CAPACITY 8
+
+#define DIRENT_BUFFER_SIZE (32 * 1024)
+
+#define NAME_ARENA_SIZE (CHUNK_CAPACITY * (NAME_MAX + 1))
+
+struct stack_entry {
+	uint32_t dev_major, dev_minor;
+	uint64_t inode;
+
+	// The name normally lives in the chunk’s name arena; only names too long
+	// to fit there (which can only be the top-level path) are allocated
+	// separately.
+	const char *name;
+	size_t name_len;
+	bool name_allocated;
+
+	// The open directory, or -1 for an ancestor copied from a task. Entries
+	// are read with getdents64 into the chunk’s buffer for this entry.
+	int fd;
+	char *buffer;
+	size_t buffer_pos, buffer_len;
+};
+
+// Each chunk carries everything its entries need, so once a stack has grown
+// to its maximum depth, entering and leaving directories allocates nothing.
+struct stack_chunk {
+	struct stack_entry entries[CHUNK_CAPACITY];
+	struct stack_chunk *previous, *next;
+	size_t names_used;
+	char names[NAME_ARENA_SIZE];
+	uint64_t buffers[CHUNK_CAPACITY][DIRENT_BUFFER_SIZE / sizeof(uint64_t)];
+};
+
+// The set of (device, inode) pairs on a stack, used to detect loops without
+// walking the whole stack for every directory. It is an open-addressed hash
+// table with linear probing, kept at most half full.
+struct ancestor {
+	uint32_t dev_major, dev_minor;
+	uint64_t inode;
+	bool used;
+};
+
+struct ancestor_set {
+	struct ancestor *slots;
+	size_t capacity;
+	size_t count;
+};
+
+// The directories a worker is in the middle of scanning, from the top-level
+// directory at the bottom to the one being read at the top.
+struct stack {
+	struct stack_chunk *bottom, *top;
+	size_t top_used;
+	struct stack_chunk *free_chunks;
+	struct ancestor_set ancestors;
+};
+
+void stack_init(struct stack *stack);
+bool stack_empty(const struct stack *stack);
+bool stack_push(struct stack *stack, const struct stack_entry *new);
+void stack_pop(struct stack *stack);
+void stack_deinit(struct stack *stack);
+struct stack_entry *stack_peek(struct stack *stack);
+const struct dirent64 *stack_entry_read(struct stack_entry *e);
+bool stack_contains(const struct stack *stack, uint32_t dev_major, uint32_t dev_minor, uint64_t inode);
+void stack_foreach_up(struct stack *stack, bool (*cb)(struct stack_entry *, void *), void *cookie);
+
+#endif
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "state.h"
+
+struct record {
+	char *key;
+	uint64_t value;
+};
+
+static char *state_path;
+static struct record *records;
+static size_t record_count;
+static size_t record_capacity;
+static mtx_t lock;
+
+static struct record *find(const char *key) {
+	for(size_t i = 0; i != record_count; ++i) {
+		if(!strcmp(records[i].key, key)) {
+			return &records[i];
+		}
+	}
+	return 0;
+}
+
+static bool add(const char *key, uint64_t value) {
+	if(record_count == record_capacity) {
+		size_t new_capacity = record_capacity ? record_capacity * 2 : 16;
+		struct record *new_records = realloc(records, new_capacity * sizeof(*new_records));
+		if(!new_records) {
+			perror("realloc");
+			return false;
+		}
+		records = new_records;
+		record_capacity = new_capacity;
+	}
+	char *copy = strdup(key);
+	if(!copy) {
+		perror("strdup");
+		return false;
+	}
+	records[record_count].key = copy;
+	records[record_count].value = value;
+	++record_count;
+	return true;
+}
+
+bool state_open(const char *path) {
+	if(mtx_init(&lock, mtx_plain) != thrd_success) {
+		fputs("mtx_init: failed\n", stderr);
+		return false;
+	}
+	if(!path) {
+		return true;
+	}
+	state_path = strdup(path);
+	if(!state_path) {
+		perror("strdup");
+		return false;
+	}
+
+	// A missing file just means nothing has been remembered yet.
+	FILE *fp = fopen(path, "r");
+	if(!fp) {
+		if(errno == ENOENT) {
+			return true;
+		}
+		perror(path);
+		return false;
+	}
+	char line[256];
+	unsigned long line_number = 0;
+	bool ok = true;
+	while(ok && fgets(line, sizeof(line), fp)) {
+		++line_number;
+		char key[sizeof(line)];
+		uint64_t value;
+		if(sscanf(line, "%255s %" SCNu64, key, &value) == 2) {
+			ok = add(key, value);
+		} else {
+			fprintf(stderr, "%s:%lu: malformed line\n", path, line_number);
+			ok = false;
+		}
+	}
+	if(ferror(fp)) {
+		perror(path);
+		ok = false;
+	}
+	fclose(fp);
+	return ok;
+}
+
+bool state_enabled(void) {
+	return state_path != 0;
+}
+
+bool state_get_u64(const char *key, uint64_t *value) {
+	mtx_lock(&lock);
+	const struct record *r = find(key);
+	if(r) {
+		*value = r->value;
+	}
+	mtx_unlock(&lock);
+	return r != 0;
+}
+
+bool state_set_u64(const char *key, uint64_t value) {
+	if(!state_path) {
+		return true;
+	}
+	mtx_lock(&lock);
+	struct record *r = find(key);
+	bool ok = true;
+	if(r) {
+		r->value = value;
+	} else {
+		ok = add(key, value);
+	}
+	mtx_unlock(&lock);
+	return ok;
+}
+
+void state_remove(const char *key) {
+	mtx_lock(&lock);
+	struct record *r = find(key);
+	if(r) {
+		free(r->key);
+		*r = records[--record_count];
+	}
+	mtx_unlock(&lock);
+}
+
+void state_remove_prefix(const char *prefix) {
+	size_t prefix_len = strlen(prefix);
+	mtx_lock(&lock);
+	size_t kept = 0;
+	for(size_t i = 0; i != record_count; ++i) {
+		if(strncmp(records[i].key, prefix, prefix_len)) {
+			records[kept++] = records[i];
+		} else {
+			free(records[i].key);
+		}
+	}
+	record_count = kept;
+	mtx_unlock(&lock);
+}
+
+bool state_save(void) {
+	if(!state_path) {
+		return true;
+	}
+
+	// Write to a temporary file and rename it over the real one, so that a
+	// crash part way through never leaves a truncated state file behind.
+	size_t path_len = strlen(state_path);
+	char *temp_path = malloc(path_len + 5);
+	if(!temp_path) {
+		perror("malloc");
+		return false;
+	}
+	memcpy(temp_path, state_path, path_len);
+	memcpy(temp_path + path_len, ".new", 5);
+	mtx_lock(&lock);
+	bool ok = true;
+	FILE *fp = fopen(temp_path, "w");
+	if(fp) {
+		for(size_t i = 0; i != record_count; ++i) {
+			fprintf(fp, "%s %" PRIu64 "\n", records[i].key, records[i].value);
+		}
+		if(fflush(fp) == EOF || fsync(fileno(fp)) < 0) {
+			perror(temp_path);
+			ok = false;
+		}
+		if(fclose(fp) == EOF && ok) {
+			perror(temp_path);
+			ok = false;
+		}
+		if(ok && rename(temp_path, state_path) < 0) {
+			perror(state_path);
+			ok = false;
+		}
+		if(!ok) {
+			unlink(temp_path);
+		}
+	} else {
+		perror(temp_path);
+		ok = false;
+	}
+	mtx_unlock(&lock);
+	free(temp_path);
+	return ok;
+}
+
+void state_close(void) {
+	for(size_t i = 0; i != record_count; ++i) {
+		free(records[i].key);
+	}
+	free(records);
+	free(state_path);
+	records = 0;
+	record_count = 0;
+	record_capacity = 0;
+	state_path = 0;
+	mtx_destroy(&lock);
+}
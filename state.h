@@ -0,0 +1,23 @@
+#if !defined(STATE_H)
+#define STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The state file remembers things between runs, such as how far an operation
+// got, as a set of key/value pairs. It is loaded once at startup and written
+// back whenever an operation reaches a point worth remembering. All functions
+// are safe to call from multiple threads. If no state file was configured,
+// nothing is remembered: lookups fail and saves succeed without doing
+// anything.
+
+bool state_open(const char *path);
+bool state_enabled(void);
+bool state_get_u64(const char *key, uint64_t *value);
+bool state_set_u64(const char *key, uint64_t value);
+void state_remove(const char *key);
+void state_remove_prefix(const char *prefix);
+bool state_save(void);
+void state_close(void);
+
+#endif
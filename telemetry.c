@@ -0,0 +1,54 @@
+#include "telemetry.h"
+#include "util.h"
+
+// Starts with a sample of nothing done, so that the first rates cover the
+// time since the start.
+void telemetry_init(struct telemetry *telemetry) {
+	telemetry->start_ns = monotonic_ns();
+	telemetry->samples[0].ns = telemetry->start_ns;
+	telemetry->samples[0].items = 0;
+	telemetry->samples[0].bytes = 0;
+	telemetry->count = 1;
+	telemetry->next = 1;
+}
+
+// Records how many items and bytes have been done in total so far, replacing
+// the oldest sample once the buffer is full.
+void telemetry_sample(struct telemetry *telemetry, uint64_t items, uint64_t bytes) {
+	struct telemetry_sample *sample = &telemetry->samples[telemetry->next];
+	sample->ns = monotonic_ns();
+	sample->items = items;
+	sample->bytes = bytes;
+	telemetry->next = (telemetry->next + 1) % TELEMETRY_SAMPLES;
+	if(telemetry->count != TELEMETRY_SAMPLES) {
+		++telemetry->count;
+	}
+}
+
+// Works out the rates between the oldest and newest samples held. Returns
+// false if there are not yet two samples apart in time.
+bool telemetry_rates(const struct telemetry *telemetry, double *items_per_second, double *bytes_per_second) {
+	if(telemetry->count < 2) {
+		return false;
+	}
+	const struct telemetry_sample *newest = &telemetry->samples[(telemetry->next + TELEMETRY_SAMPLES - 1) % TELEMETRY_SAMPLES];
+	const struct telemetry_sample *oldest = &telemetry->samples[(telemetry->next + TELEMETRY_SAMPLES - telemetry->count) % TELEMETRY_SAMPLES];
+	if(newest->ns <= oldest->ns) {
+		return false;
+	}
+	double seconds = (double) (newest->ns - oldest->ns) / 1e9;
+	*items_per_second = (double) (newest->items - oldest->items) / seconds;
+	*bytes_per_second = (double) (newest->bytes - oldest->bytes) / seconds;
+	return true;
+}
+
+// Estimates how many seconds the items left will take at the current rate.
+// Returns false if there is no rate to go by.
+bool telemetry_eta(const struct telemetry *telemetry, uint64_t items_left, double *seconds) {
+	double items_per_second, bytes_per_second;
+	if(!telemetry_rates(telemetry, &items_per_second, &bytes_per_second) || items_per_second <= 0.0) {
+		return false;
+	}
+	*seconds = (double) items_left / items_per_second;
+	return true;
+}
@@ -0,0 +1,32 @@
+#if !defined(TELEMETRY_H)
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_SAMPLES 12
+
+// How much of a long-running operation has been done, sampled from time to
+// time. The most recent samples are kept in a ring buffer, from which rates
+// are worked out as a moving average over the time they span, so that the
+// rates and the estimated time left follow slowdowns rather than being
+// smoothed over the whole run.
+struct telemetry_sample {
+	uint64_t ns;
+	uint64_t items;
+	uint64_t bytes;
+};
+
+struct telemetry {
+	uint64_t start_ns;
+	struct telemetry_sample samples[TELEMETRY_SAMPLES];
+	size_t count, next;
+};
+
+void telemetry_init(struct telemetry *telemetry);
+void telemetry_sample(struct telemetry *telemetry, uint64_t items, uint64_t bytes);
+bool telemetry_rates(const struct telemetry *telemetry, double *items_per_second, double *bytes_per_second);
+bool telemetry_eta(const struct telemetry *telemetry, uint64_t items_left, double *seconds);
+
+#endif
@@ -1,45 +1,195 @@
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include "ops.h"
+#include "util.h"
 
-static bool do_trim_fd(const char *mountpoint, bool verbose, int fd) {
-	struct fstrim_range args = {
-		.start = 0,
-		.len = (uint64_t) -1,
-		.minlen = 0,
-	};
-	if(ioctl(fd, FITRIM, &args) >= 0) {
-		if(verbose) {
-			printf("%s: trimmed %" PRIu64 " unused bytes\n", mountpoint, (uint64_t) args.len);
+static const uint64_t MIB = 1024 * 1024;
+
+static bool read_granularity(const char *path, uint64_t *granularity) {
+	FILE *fp = fopen(path, "r");
+	if(!fp) {
+		return false;
+	}
+	bool ok = fscanf(fp, "%" SCNu64, granularity) == 1;
+	fclose(fp);
+	return ok;
+}
+
+// Raises the minimum extent length to the discard granularity of a device,
+// since discards of smaller extents free nothing on it. A partition has no
+// queue of its own, so its disk’s is used.
+static bool add_device_granularity(const struct btrfs_ioctl_fs_info_args *fs_info, const struct btrfs_ioctl_dev_info_args *dev_info, void *raw_minlen) {
+	(void) fs_info;
+	uint64_t *minlen = raw_minlen;
+	struct stat st;
+	if(stat((const char *) dev_info->path, &st) == 0 && S_ISBLK(st.st_mode)) {
+		char path[128];
+		uint64_t granularity;
+		sprintf(path, "/sys/dev/block/%u:%u/queue/discard_granularity", major(st.st_rdev), minor(st.st_rdev));
+		bool found = read_granularity(path, &granularity);
+		if(!found) {
+			sprintf(path, "/sys/dev/block/%u:%u/../queue/discard_granularity", major(st.st_rdev), minor(st.st_rdev));
+			found = read_granularity(path, &granularity);
 		}
-		return true;
-	} else if(errno == EOPNOTSUPP) {
-		if(verbose) {
-			printf("%s: trim not supported\n", mountpoint);
+		if(found && granularity > *minlen) {
+			*minlen = granularity;
 		}
-		return true;
-	} else {
-		perror(mountpoint);
+	}
+	return true;
+}
+
+static bool find_end(const struct btrfs_ioctl_search_header *header, const void *data, void *raw_end) {
+	uint64_t *end = raw_end;
+	if(header->type == BTRFS_CHUNK_ITEM_KEY && header->len >= sizeof(struct btrfs_chunk)) {
+		struct btrfs_chunk item;
+		memcpy(&item, data, sizeof(item));
+		if(header->offset + le64toh(item.length) > *end) {
+			*end = header->offset + le64toh(item.length);
+		}
+	}
+	return true;
+}
+
+// Finds the logical address just past the last chunk, which is where the
+// ranges given to FITRIM end.
+static bool find_logical_end(const char *mountpoint, int fd, uint64_t *end) {
+	const struct btrfs_ioctl_search_key key = {
+		.tree_id = BTRFS_CHUNK_TREE_OBJECTID,
+		.min_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+		.max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+		.min_type = BTRFS_CHUNK_ITEM_KEY,
+		.max_type = BTRFS_CHUNK_ITEM_KEY,
+		.min_offset = 0,
+		.max_offset = UINT64_MAX,
+		.min_transid = 0,
+		.max_transid = UINT64_MAX,
+	};
+	*end = 0;
+	return for_each_tree_item(mountpoint, fd, &key, &find_end, end);
+}
+
+static bool do_trim_fd(const char *mountpoint, bool verbose, const struct trim_options *options, int fd) {
+	// Unless told otherwise, skip free extents too small for any device to
+	// discard.
+	uint64_t minlen = (uint64_t) options->minlen_kib * 1024;
+	if(!options->minlen_kib && !for_each_device(mountpoint, fd, &add_device_granularity, &minlen)) {
 		return false;
 	}
+
+	// FITRIM ranges are logical addresses, which run to the end of the last
+	// chunk. Unallocated device space is not part of any range, so the first
+	// batch trims all of it.
+	uint64_t end = UINT64_MAX, batch = UINT64_MAX;
+	if(options->batch_mib) {
+		if(!find_logical_end(mountpoint, fd, &end)) {
+			return false;
+		}
+		batch = options->batch_mib * MIB;
+		if(!end) {
+			end = UINT64_MAX;
+		}
+	}
+	if(verbose) {
+		printf("%s: trimming free extents of at least %" PRIu64 " bytes", mountpoint, minlen);
+		if(options->batch_mib) {
+			printf(" in batches of %u MiB", options->batch_mib);
+		}
+		putchar('\n');
+	}
+
+	uint64_t trimmed = 0, batches = 0, total_ns = 0, min_ns = UINT64_MAX, max_ns = 0, slowest = 0;
+	bool progress_shown = false;
+	uint64_t start = 0;
+	do {
+		if(batches) {
+			if(termination_pending()) {
+				// Signals are blocked because other steps are running on
+				// other threads; stop so that they can take effect.
+				break;
+			}
+			if(options->pause_ms) {
+				struct timespec delay = {
+					.tv_sec = options->pause_ms / 1000,
+					.tv_nsec = (long) (options->pause_ms % 1000) * 1000000,
+				};
+				nanosleep(&delay, 0);
+			}
+		}
+		struct fstrim_range args = {
+			.start = start,
+			.len = end - start < batch ? end - start : batch,
+			.minlen = minlen,
+		};
+		uint64_t before = monotonic_ns();
+		if(ioctl(fd, FITRIM, &args) < 0) {
+			if(progress_shown) {
+				putchar('\n');
+			}
+			if(errno == EOPNOTSUPP) {
+				if(verbose) {
+					printf("%s: trim not supported\n", mountpoint);
+				}
+				return true;
+			} else {
+				perror(mountpoint);
+				return false;
+			}
+		}
+		uint64_t elapsed_ns = monotonic_ns() - before;
+		trimmed += args.len;
+		total_ns += elapsed_ns;
+		if(elapsed_ns < min_ns) {
+			min_ns = elapsed_ns;
+		}
+		if(elapsed_ns > max_ns) {
+			max_ns = elapsed_ns;
+			slowest = start;
+		}
+		++batches;
+		if(verbose && options->batch_mib) {
+			printf("%" PRIu64 " / %" PRIu64 " MiB: last batch %.1f ms, %" PRIu64 " bytes trimmed so far\r", (end - start < batch ? end : start + batch) / MIB, end / MIB, elapsed_ns / 1e6, trimmed);
+			fflush(stdout);
+			progress_shown = true;
+		}
+		start = end - start < batch ? end : start + batch;
+	} while(start < end);
+
+	if(verbose) {
+		if(progress_shown) {
+			putchar('\n');
+		}
+		printf("%s: trimmed %" PRIu64 " unused bytes\n", mountpoint, trimmed);
+		if(batches > 1) {
+			printf("%s: %" PRIu64 " batches took %.1f ms at least, %.1f ms on average, and %.1f ms at most (the batch at %" PRIu64 " MiB)\n", mountpoint, batches, min_ns / 1e6, total_ns / 1e6 / (double) batches, max_ns / 1e6, slowest / MIB);
+		} else if(batches) {
+			printf("%s: trim took %.1f ms\n", mountpoint, total_ns / 1e6);
+		}
+	}
+	return true;
 }
 
-bool do_trim(const char *mountpoint, bool verbose) {
+bool do_trim(const char *mountpoint, bool verbose, const struct trim_options *options) {
 	if(verbose) {
 		printf("Trim %s:\n", mountpoint);
 	}
 	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
 	bool ret;
 	if(fd >= 0) {
-		ret = do_trim_fd(mountpoint, verbose, fd);
+		ret = do_trim_fd(mountpoint, verbose, options, fd);
 		close(fd);
 	} else {
 		perror(mountpoint);
@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static unsigned int load_acquire(const unsigned int *p) {
+	return atomic_load_explicit((const _Atomic unsigned int *) p, memory_order_acquire);
+}
+
+static void store_release(unsigned int *p, unsigned int value) {
+	atomic_store_explicit((_Atomic unsigned int *) p, value, memory_order_release);
+}
+
+// Checks that the kernel supports every opcode the caller is going to use;
+// io_uring existing at all says nothing about which operations it has.
+static bool check_opcodes(int fd, const uint8_t *opcodes, size_t opcode_count) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if(!probe) {
+		return false;
+	}
+	bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+	for(size_t i = 0; ok && i != opcode_count; ++i) {
+		ok = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+	if(!ok && !errno) {
+		errno = EOPNOTSUPP;
+	}
+	free(probe);
+	return ok;
+}
+
+bool uring_init(struct uring *ring, unsigned int entries, const uint8_t *opcodes, size_t opcode_count) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd < 0) {
+		return false;
+	}
+	errno = 0;
+	if(!check_opcodes(ring->fd, opcodes, opcode_count)) {
+		int err = errno;
+		close(ring->fd);
+		errno = err;
+		return false;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED) {
+		int err = errno;
+		close(ring->fd);
+		errno = err;
+		return false;
+	}
+	ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if(ring->cq_ring == MAP_FAILED) {
+		int err = errno;
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		errno = err;
+		return false;
+	}
+	ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		int err = errno;
+		munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		errno = err;
+		return false;
+	}
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	ring->sq_entries = params.sq_entries;
+	ring->pending = 0;
+	return true;
+}
+
+void uring_deinit(struct uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+// Returns a zeroed submission queue entry to fill in, or null if the
+// submission queue is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+	unsigned int head = load_acquire(ring->sq_head);
+	unsigned int tail = *ring->sq_tail + ring->pending;
+	if(tail - head == ring->sq_entries) {
+		return 0;
+	}
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	++ring->pending;
+	return sqe;
+}
+
+// Submits every entry obtained since the last submission and waits until at
+// least wait_nr completions are available.
+bool uring_submit_and_wait(struct uring *ring, unsigned int wait_nr) {
+	unsigned int to_submit = ring->pending;
+	store_release(ring->sq_tail, *ring->sq_tail + to_submit);
+	ring->pending = 0;
+	while(to_submit || wait_nr) {
+		long rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS, (void *) 0, (size_t) 0);
+		if(rc < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		to_submit -= (unsigned int) rc;
+
+		// The wait count is satisfied once that many completions are
+		// sitting in the queue.
+		unsigned int available = load_acquire(ring->cq_tail) - *ring->cq_head;
+		if(available >= wait_nr) {
+			wait_nr = 0;
+		}
+	}
+	return true;
+}
+
+// Returns how many entries obtained so far the kernel has not yet taken, such
+// as those left behind when uring_submit_and_wait fails. The kernel never runs
+// these unless they are submitted again.
+unsigned int uring_unsubmitted(const struct uring *ring) {
+	return *ring->sq_tail - load_acquire(ring->sq_head) + ring->pending;
+}
+
+// Returns the oldest unconsumed completion, or null if there is none.
+const struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+	unsigned int head = *ring->cq_head;
+	if(head == load_acquire(ring->cq_tail)) {
+		return 0;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+	store_release(ring->cq_head, *ring->cq_head + 1);
+}
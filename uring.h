@@ -0,0 +1,37 @@
+#if !defined(URING_H)
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+// A minimal io_uring wrapper using the raw system calls, so that no library
+// beyond the kernel headers is needed. A ring must only be used by one thread
+// at a time.
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	unsigned int pending;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+bool uring_init(struct uring *ring, unsigned int entries, const uint8_t *opcodes, size_t opcode_count);
+void uring_deinit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+bool uring_submit_and_wait(struct uring *ring, unsigned int wait_nr);
+unsigned int uring_unsubmitted(const struct uring *ring);
+const struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif
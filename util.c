@@ -2,10 +2,40 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <linux/btrfs.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include "util.h"
 
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		return 0;
+	}
+	return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+bool parse_unsigned(const char *option, const char *text, unsigned long long min, unsigned long long max, unsigned long long *value) {
+	// strtoull accepts a leading minus sign and negates the result, which is
+	// never what is wanted for a count or size.
+	char *end;
+	errno = 0;
+	unsigned long long parsed = strtoull(text, &end, 10);
+	if(text[0] < '0' || text[0] > '9' || *end || errno == ERANGE || parsed < min || parsed > max) {
+		fprintf(stderr, "--%s: expected an integer from %llu to %llu, got “%s”\n", option, min, max, text);
+		return false;
+	}
+	*value = parsed;
+	return true;
+}
+
 bool for_each_device(const char *mountpoint, int fd, bool (*cb)(const struct btrfs_ioctl_fs_info_args *, const struct btrfs_ioctl_dev_info_args *, void *), void *cookie) {
 	struct btrfs_ioctl_fs_info_args fs_info;
 	if(ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
@@ -37,3 +67,351 @@ bool for_each_device(const char *mountpoint, int fd, bool (*cb)(const struct btr
 
 	return true;
 }
+
+bool for_each_tree_item(const char *mountpoint, int fd, const struct btrfs_ioctl_search_key *key, bool (*cb)(const struct btrfs_ioctl_search_header *, const void *, void *), void *cookie) {
+	// The search works on a linear space of (objectid, type, offset) keys, so
+	// items of types outside [min_type, max_type] can still be returned when
+	// they lie between the minimum and maximum keys; callers must check the
+	// type of each item themselves.
+	static const size_t BUFFER_SIZE = 64 * 1024;
+	struct btrfs_ioctl_search_args_v2 *args = malloc(sizeof(*args) + BUFFER_SIZE);
+	if(!args) {
+		perror("malloc");
+		return false;
+	}
+	args->key = *key;
+	for(;;) {
+		args->key.nr_items = UINT32_MAX;
+		args->buf_size = BUFFER_SIZE;
+		if(ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args) < 0) {
+			perror(mountpoint);
+			free(args);
+			return false;
+		}
+		if(!args->key.nr_items) {
+			free(args);
+			return true;
+		}
+
+		struct btrfs_ioctl_search_header header;
+		const char *pos = (const char *) args->buf;
+		for(uint32_t i = 0; i != args->key.nr_items; ++i) {
+			memcpy(&header, pos, sizeof(header));
+			pos += sizeof(header);
+			if(!cb(&header, pos, cookie)) {
+				free(args);
+				return true;
+			}
+			pos += header.len;
+		}
+
+		// Continue from the key just after the last one returned.
+		args->key.min_objectid = header.objectid;
+		args->key.min_type = header.type;
+		args->key.min_offset = header.offset;
+		if(args->key.min_offset != UINT64_MAX) {
+			++args->key.min_offset;
+		} else if(args->key.min_type != UINT8_MAX) {
+			++args->key.min_type;
+			args->key.min_offset = 0;
+		} else if(args->key.min_objectid != UINT64_MAX) {
+			++args->key.min_objectid;
+			args->key.min_type = 0;
+			args->key.min_offset = 0;
+		} else {
+			free(args);
+			return true;
+		}
+		if(args->key.min_objectid > args->key.max_objectid) {
+			free(args);
+			return true;
+		}
+	}
+}
+
+void format_fsid(const uint8_t *fsid, char *buffer) {
+	static const char HEX[] = "0123456789abcdef";
+	for(size_t i = 0; i != BTRFS_FSID_SIZE; ++i) {
+		if(i == 4 || i == 6 || i == 8 || i == 10) {
+			*buffer++ = '-';
+		}
+		*buffer++ = HEX[fsid[i] >> 4];
+		*buffer++ = HEX[fsid[i] & 15];
+	}
+	*buffer = '\0';
+}
+
+// Fills in the set of signals that ask maintenance to stop: SIGINT, SIGQUIT,
+// and SIGTERM.
+void termination_signals(sigset_t *sigs) {
+	sigemptyset(sigs);
+	sigaddset(sigs, SIGINT);
+	sigaddset(sigs, SIGQUIT);
+	sigaddset(sigs, SIGTERM);
+}
+
+// Returns whether a termination signal is waiting to be handled, as happens
+// when one arrives while they are blocked.
+bool termination_pending(void) {
+	sigset_t pending;
+	if(sigpending(&pending) < 0) {
+		return false;
+	}
+	return sigismember(&pending, SIGINT) == 1 || sigismember(&pending, SIGQUIT) == 1 || sigismember(&pending, SIGTERM) == 1;
+}
+
+// The epoll data identifying what became readable; timers follow in order.
+enum {
+	RUNNER_EVENT_SIGNAL,
+	RUNNER_EVENT_COMPLETION,
+	RUNNER_EVENT_TIMER,
+};
+
+static bool runner_watch(struct runner *runner, int fd, uint32_t which) {
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data = { .u32 = which },
+	};
+	if(epoll_ctl(runner->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+	return true;
+}
+
+bool runner_init(struct runner *runner, void (*cancel)(void *), void (*finished)(struct runner_task *, void *), void *cookie) {
+	runner->epfd = -1;
+	runner->sigfd = -1;
+	runner->efd = -1;
+	runner->tasks = 0;
+	runner->running = 0;
+	runner->cancel = cancel;
+	runner->finished = finished;
+	runner->cookie = cookie;
+	runner->timer_count = 0;
+	runner->cancelled = false;
+	runner->start_ns = monotonic_ns();
+	runner->cancel_ns = 0;
+	runner->end_ns = runner->start_ns;
+
+	termination_signals(&runner->sigs);
+	if(sigprocmask(SIG_BLOCK, &runner->sigs, &runner->old_sigs) < 0) {
+		perror("sigprocmask");
+		return false;
+	}
+	runner->sigfd = signalfd(-1, &runner->sigs, SFD_CLOEXEC);
+	if(runner->sigfd < 0) {
+		perror("signalfd");
+		runner_deinit(runner);
+		return false;
+	}
+	runner->efd = eventfd(0, EFD_CLOEXEC);
+	if(runner->efd < 0) {
+		perror("eventfd");
+		runner_deinit(runner);
+		return false;
+	}
+	runner->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(runner->epfd < 0) {
+		perror("epoll_create1");
+		runner_deinit(runner);
+		return false;
+	}
+	if(!runner_watch(runner, runner->sigfd, RUNNER_EVENT_SIGNAL) || !runner_watch(runner, runner->efd, RUNNER_EVENT_COMPLETION)) {
+		runner_deinit(runner);
+		return false;
+	}
+	return true;
+}
+
+// Arranges for cb to be called with the runner’s cookie every interval_ms
+// milliseconds while the runner runs.
+bool runner_add_timer(struct runner *runner, unsigned int interval_ms, void (*cb)(void *)) {
+	if(runner->timer_count == RUNNER_MAX_TIMERS) {
+		fputs("runner_add_timer: too many timers\n", stderr);
+		return false;
+	}
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(fd < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+	struct timespec interval = {
+		.tv_sec = interval_ms / 1000,
+		.tv_nsec = (long) (interval_ms % 1000) * 1000000,
+	};
+	struct itimerspec spec = { .it_interval = interval, .it_value = interval, };
+	if(timerfd_settime(fd, 0, &spec, 0) < 0) {
+		perror("timerfd_settime");
+		close(fd);
+		return false;
+	}
+	if(!runner_watch(runner, fd, RUNNER_EVENT_TIMER + (uint32_t) runner->timer_count)) {
+		close(fd);
+		return false;
+	}
+	runner->timer_fds[runner->timer_count] = fd;
+	runner->timer_cbs[runner->timer_count] = cb;
+	++runner->timer_count;
+	return true;
+}
+
+static int task_proc(void *raw_task) {
+	struct runner_task *task = raw_task;
+	task->ret = task->proc(task->arg);
+	task->error = errno;
+	task->end_ns = monotonic_ns();
+	atomic_store_explicit(&task->done, true, memory_order_release);
+	if(eventfd_write(task->efd, 1) < 0) {
+		perror("eventfd_write");
+		abort();
+	}
+	return 0;
+}
+
+// Starts proc(arg) on a new worker thread.
+bool runner_start(struct runner *runner, struct runner_task *task, int (*proc)(void *), void *arg) {
+	task->proc = proc;
+	task->arg = arg;
+	task->started = false;
+	atomic_init(&task->done, false);
+	task->start_ns = monotonic_ns();
+	task->end_ns = 0;
+	task->efd = runner->efd;
+	int rc = thrd_create(&task->thread, &task_proc, task);
+	if(rc == thrd_nomem) {
+		fprintf(stderr, "thrd_create: %s\n", strerror(ENOMEM));
+		return false;
+	} else if(rc == thrd_error) {
+		fputs("thrd_create: failed\n", stderr);
+		return false;
+	} else if(rc != thrd_success) {
+		fputs("thrd_create: unknown error\n", stderr);
+		return false;
+	}
+	task->started = true;
+	task->next = runner->tasks;
+	runner->tasks = task;
+	++runner->running;
+	return true;
+}
+
+// Asks the running tasks to stop, unless that has already been done. The
+// tasks still have to return before runner_run does.
+void runner_cancel(struct runner *runner) {
+	if(runner->cancelled) {
+		return;
+	}
+	runner->cancelled = true;
+	runner->cancel_ns = monotonic_ns();
+	if(runner->running) {
+		runner->cancel(runner->cookie);
+	}
+}
+
+// Joins one task that has returned, or any task if wait is set, and passes it
+// to the finished callback. Returns false if there was none.
+static bool runner_reap(struct runner *runner, bool wait) {
+	for(struct runner_task **link = &runner->tasks; *link; link = &(*link)->next) {
+		struct runner_task *task = *link;
+		if(wait || atomic_load_explicit(&task->done, memory_order_acquire)) {
+			if(thrd_join(task->thread, 0) == thrd_error) {
+				fputs("thrd_join: error\n", stderr);
+				abort();
+			}
+			*link = task->next;
+			--runner->running;
+			if(runner->finished) {
+				runner->finished(task, runner->cookie);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Handles signals, completions, and timers until no tasks are running.
+// Returns false if the loop itself failed, in which case the tasks are
+// cancelled and waited for.
+bool runner_run(struct runner *runner) {
+	bool ok = true;
+	while(runner->running) {
+		struct epoll_event events[RUNNER_EVENT_TIMER + RUNNER_MAX_TIMERS];
+		int count = epoll_wait(runner->epfd, events, sizeof(events) / sizeof(*events), -1);
+		if(count < 0 && errno == EINTR) {
+			continue;
+		} else if(count < 0) {
+			perror("epoll_wait");
+			ok = false;
+			break;
+		}
+		for(int i = 0; i != count; ++i) {
+			uint32_t which = events[i].data.u32;
+			if(which == RUNNER_EVENT_SIGNAL) {
+				// A termination signal was received. Get out as soon as
+				// the tasks stop. The signal is left pending, to take
+				// effect once it is unblocked, so stop watching for it.
+				if(epoll_ctl(runner->epfd, EPOLL_CTL_DEL, runner->sigfd, 0) < 0) {
+					perror("epoll_ctl");
+				}
+				runner_cancel(runner);
+			} else if(which == RUNNER_EVENT_COMPLETION) {
+				// One or more tasks have returned.
+				eventfd_t completions;
+				if(eventfd_read(runner->efd, &completions) < 0) {
+					perror("eventfd_read");
+					ok = false;
+					break;
+				}
+				while(runner_reap(runner, false));
+			} else {
+				size_t timer = which - RUNNER_EVENT_TIMER;
+				uint64_t expirations;
+				if(read(runner->timer_fds[timer], &expirations, sizeof(expirations)) < 0) {
+					perror("read");
+				}
+				runner->timer_cbs[timer](runner->cookie);
+			}
+		}
+		if(!ok) {
+			break;
+		}
+	}
+	if(!ok) {
+		runner_cancel(runner);
+		while(runner_reap(runner, true));
+	}
+	runner->end_ns = monotonic_ns();
+	return ok;
+}
+
+// Shows how long the tasks took, and how long they took to stop once
+// cancelled.
+void runner_report(const struct runner *runner, const char *mountpoint, const char *operation) {
+	printf("%s: %s took %.1f s\n", mountpoint, operation, (double) (runner->end_ns - runner->start_ns) / 1e9);
+	if(runner->cancelled) {
+		printf("%s: %s stopped %.3f s after being cancelled\n", mountpoint, operation, (double) (runner->end_ns - runner->cancel_ns) / 1e9);
+	}
+}
+
+// Closes the runner’s descriptors and puts back the signal mask, which lets a
+// pending termination signal take effect. No tasks may be running.
+void runner_deinit(struct runner *runner) {
+	for(size_t i = 0; i != runner->timer_count; ++i) {
+		close(runner->timer_fds[i]);
+	}
+	if(runner->epfd >= 0) {
+		close(runner->epfd);
+	}
+	if(runner->efd >= 0) {
+		close(runner->efd);
+	}
+	if(runner->sigfd >= 0) {
+		close(runner->sigfd);
+	}
+	fflush(stdout);
+	if(sigprocmask(SIG_SETMASK, &runner->old_sigs, 0) < 0) {
+		perror("sigprocmask");
+		abort();
+	}
+}
@@ -1,11 +1,90 @@
 #if !defined(UTIL_H)
 #define UTIL_H
 
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
 
 struct btrfs_ioctl_fs_info_args;
 struct btrfs_ioctl_dev_info_args;
+struct btrfs_ioctl_search_header;
+struct btrfs_ioctl_search_key;
 
+#define FSID_STRING_SIZE 37
+
+// The most periodic timers one task runner can have.
+#define RUNNER_MAX_TIMERS 4
+
+// One long, blocking call, such as a scrub or balance ioctl, run on its own
+// worker thread by a task runner. The fields after arg are filled in by the
+// runner; done becomes true, with ret, error, and end_ns valid, as soon as the
+// call returns.
+struct runner_task {
+	int (*proc)(void *arg);
+	void *arg;
+	bool started;
+	atomic_bool done;
+	int ret;
+	int error;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	thrd_t thread;
+	int efd;
+	struct runner_task *next;
+};
+
+// Runs tasks whose calls cannot be interrupted by signals in the traditional
+// sense, so that running them straight would make the process unkillable
+// (even with kill -9), but which can be asked to stop by some other call.
+//
+// While a runner exists, SIGINT, SIGQUIT, and SIGTERM are blocked and taken
+// through a signalfd instead. One epoll loop on the calling thread waits for
+// those signals, for an eventfd written by each worker thread as its call
+// returns, and for timerfds for periodic work such as progress display. On
+// the first signal the cancel callback is invoked, after which the loop keeps
+// going until every running task has returned; each finished task is joined
+// and passed to the finished callback, which may start more tasks. The signal
+// itself is left pending, so it terminates the process as usual once the
+// runner is gone and the signal mask is put back.
+struct runner {
+	int epfd;
+	int sigfd;
+	int efd;
+	sigset_t sigs;
+	sigset_t old_sigs;
+	struct runner_task *tasks;
+	size_t running;
+
+	void (*cancel)(void *cookie);
+	void (*finished)(struct runner_task *task, void *cookie);
+	void *cookie;
+
+	int timer_fds[RUNNER_MAX_TIMERS];
+	void (*timer_cbs[RUNNER_MAX_TIMERS])(void *cookie);
+	size_t timer_count;
+
+	bool cancelled;
+	uint64_t start_ns;
+	uint64_t cancel_ns;
+	uint64_t end_ns;
+};
+
+uint64_t monotonic_ns(void);
+bool parse_unsigned(const char *option, const char *text, unsigned long long min, unsigned long long max, unsigned long long *value);
 bool for_each_device(const char *mountpoint, int fd, bool (*cb)(const struct btrfs_ioctl_fs_info_args *, const struct btrfs_ioctl_dev_info_args *, void *), void *cookie);
+bool for_each_tree_item(const char *mountpoint, int fd, const struct btrfs_ioctl_search_key *key, bool (*cb)(const struct btrfs_ioctl_search_header *, const void *, void *), void *cookie);
+void format_fsid(const uint8_t *fsid, char *buffer);
+void termination_signals(sigset_t *sigs);
+bool termination_pending(void);
+bool runner_init(struct runner *runner, void (*cancel)(void *), void (*finished)(struct runner_task *, void *), void *cookie);
+bool runner_add_timer(struct runner *runner, unsigned int interval_ms, void (*cb)(void *));
+bool runner_start(struct runner *runner, struct runner_task *task, int (*proc)(void *), void *arg);
+void runner_cancel(struct runner *runner);
+bool runner_run(struct runner *runner);
+void runner_report(const struct runner *runner, const char *mountpoint, const char *operation);
+void runner_deinit(struct runner *runner);
 
 #endif